@@ -0,0 +1,320 @@
+#pragma once
+
+// X86Assembler encodes instructions with typed operands straight into
+// X86InstrVector:
+//
+//   X86Assembler as(code);
+//   auto loop = as.label("loop");
+//   as.bind(loop);
+//   as.mov(Reg(EAX), Mem(EBP, -8));   // mov eax, [ebp - 8]
+//   as.add(Reg(EAX), Imm(1));         // add eax, 1
+//   as.cmp(Reg(EAX), Imm(10));        // cmp eax, 10
+//   as.jcc(conditionLess, loop);      // jl loop
+//
+// Operands are 32 bit unless they are wide, which on x86-64 means
+// 64 bit operation with REX.W. Registers r8 - r15 get REX.R/X/B.
+// ModRM and SIB bytes are looked up in tables built at compile time,
+// nothing is allocated per instruction once buffer is reserved.
+
+#include <cstddef>
+#include "jitcompiler.h"
+
+// register operand
+struct Reg {
+  constexpr explicit Reg(int id, bool wide = false) : id(id), wide(wide) {}
+  int id;
+  bool wide;
+};
+
+constexpr int noIndex = -1;
+
+// memory operand [base + index * scale + disp]
+struct Mem {
+  constexpr Mem(int base, int disp = 0, bool wide = false)
+      : base(base), disp(disp), wide(wide) {}
+  constexpr Mem(int base, int index, int scale, int disp, bool wide = false)
+      : base(base), disp(disp), wide(wide), index(index), scale(scale) {}
+  int base;
+  int disp;
+  bool wide;
+  int index = noIndex;
+  int scale = 1;
+};
+
+// immediate, 32 bit at most
+struct Imm {
+  constexpr explicit Imm(int value) : value(value) {}
+  int value;
+};
+
+// r/m operand of ModRM byte, either register or memory
+struct RegMem {
+  constexpr RegMem(Reg reg) : isRegister(true), reg(reg), mem(EAX) {}
+  constexpr RegMem(Mem mem) : isRegister(false), reg(EAX), mem(mem) {}
+  constexpr bool wide() const { return isRegister ? reg.wide : mem.wide; }
+  bool isRegister;
+  Reg reg;
+  Mem mem;
+};
+
+// values of ModRM mod field
+constexpr unsigned modIndirect = 0;
+constexpr unsigned modDisp8 = 1;
+constexpr unsigned modDisp32 = 2;
+constexpr unsigned modRegister = 3;
+
+// rm value which means that SIB byte follows
+constexpr unsigned rmSib = 4;
+// index value which means no index in SIB byte
+constexpr unsigned sibNoIndex = 4;
+
+// all ModRM (mod, reg, rm) and SIB (scale, index, base) combinations
+struct EncodingTable {
+  unsigned char bytes[4][8][8];
+};
+
+constexpr EncodingTable makeEncodingTable() {
+  EncodingTable table{};
+  for (unsigned high = 0; high < 4; ++high)
+    for (unsigned middle = 0; middle < 8; ++middle)
+      for (unsigned low = 0; low < 8; ++low)
+        table.bytes[high][middle][low] =
+            static_cast<unsigned char>(high << 6 | middle << 3 | low);
+  return table;
+}
+
+constexpr EncodingTable modrmTable = makeEncodingTable();
+constexpr EncodingTable sibTable = makeEncodingTable();
+
+// SIB scale field for scale 1, 2, 4 and 8
+constexpr unsigned char scaleEncoding[9] = {0, 0, 1, 0, 2, 0, 0, 0, 3};
+
+// special cases of base register, indexed by its low 3 bits:
+// esp/r12 can be base only with SIB byte,
+// ebp/r13 with mod 0 means disp32 without base, so it needs displacement
+struct BaseEncoding {
+  bool needsSib;
+  bool needsDisplacement;
+};
+
+constexpr BaseEncoding baseEncodings[8] = {
+    {false, false}, {false, false}, {false, false}, {false, false},
+    {true, false},  {false, true},  {false, false}, {false, false}};
+
+// arithmetic instructions that share encoding scheme
+enum class AluOp { Add, Sub, Cmp };
+
+struct AluEncoding {
+  unsigned char rmReg;       // op r/m, reg
+  unsigned char regRm;       // op reg, r/m
+  unsigned char extension;   // op r/m, imm as 83/81 /extension
+  unsigned char accumulator; // op eax, imm32
+};
+
+constexpr AluEncoding aluEncodings[] = {
+    {0x01, 0x03, 0, 0x05}, // add
+    {0x29, 0x2B, 5, 0x2D}, // sub
+    {0x39, 0x3B, 7, 0x3D}, // cmp
+};
+
+constexpr bool fitsInByte(int value) { return value >= -128 && value <= 127; }
+
+struct X86Assembler {
+  explicit X86Assembler(X86InstrVector &code) : code(code) {}
+
+  Label label(const std::string &name) { return code.make_label(name); }
+  Label label() { return code.make_label(); }
+  void bind(Label label) { code.bind_label(label); }
+
+  void mov(Reg dst, Reg src) { emit(0x8B, dst, src); }
+  void mov(Reg dst, const RegMem &src) { emit(0x8B, dst, src); }
+  void mov(const RegMem &dst, Reg src) { emit(0x89, src, dst); }
+  void mov(Reg dst, Imm imm) {
+    // B8+r takes imm64 with REX.W, so wide register uses C7
+    if (isWide(dst.wide)) {
+      mov(RegMem(dst), imm);
+      return;
+    }
+    prefix(false, 0, noIndex, dst.id);
+    byte(0xB8 + (dst.id & 7));
+    code.push_int32(imm.value);
+  }
+  void mov(const RegMem &dst, Imm imm) {
+    emit(0xC7, 0, dst);
+    code.push_int32(imm.value);
+  }
+  // mov reg, address, where address has pointer size of target
+  void movAddress(Reg dst, const void *address) {
+    prefix(is64Bit(), 0, noIndex, dst.id);
+    byte(0xB8 + (dst.id & 7));
+    code.push_address(address);
+  }
+
+  void add(Reg dst, const RegMem &src) { alu(AluOp::Add, dst, src); }
+  void add(const RegMem &dst, Reg src) { alu(AluOp::Add, dst, src); }
+  void add(Reg dst, Reg src) { alu(AluOp::Add, dst, RegMem(src)); }
+  void add(const RegMem &dst, Imm imm) { alu(AluOp::Add, dst, imm); }
+  void sub(Reg dst, const RegMem &src) { alu(AluOp::Sub, dst, src); }
+  void sub(const RegMem &dst, Reg src) { alu(AluOp::Sub, dst, src); }
+  void sub(Reg dst, Reg src) { alu(AluOp::Sub, dst, RegMem(src)); }
+  void sub(const RegMem &dst, Imm imm) { alu(AluOp::Sub, dst, imm); }
+  void cmp(Reg dst, const RegMem &src) { alu(AluOp::Cmp, dst, src); }
+  void cmp(const RegMem &dst, Reg src) { alu(AluOp::Cmp, dst, src); }
+  void cmp(Reg dst, Reg src) { alu(AluOp::Cmp, dst, RegMem(src)); }
+  void cmp(const RegMem &dst, Imm imm) { alu(AluOp::Cmp, dst, imm); }
+
+  void alu(AluOp op, Reg dst, const RegMem &src) {
+    emit(aluEncodings[static_cast<int>(op)].regRm, dst, src);
+  }
+  void alu(AluOp op, const RegMem &dst, Reg src) {
+    emit(aluEncodings[static_cast<int>(op)].rmReg, src, dst);
+  }
+  void alu(AluOp op, const RegMem &dst, Imm imm) {
+    const auto &encoding = aluEncodings[static_cast<int>(op)];
+    if (fitsInByte(imm.value)) {
+      emit(0x83, encoding.extension, dst);
+      byte(imm.value);
+      return;
+    }
+    if (dst.isRegister && dst.reg.id == EAX) {
+      prefix(isWide(dst.wide()), 0, noIndex, EAX);
+      byte(encoding.accumulator);
+    } else {
+      emit(0x81, encoding.extension, dst);
+    }
+    code.push_int32(imm.value);
+  }
+
+  void imul(Reg dst, const RegMem &src) { emit(0x0F, 0xAF, dst, src); }
+  void imul(Reg dst, const RegMem &src, Imm imm) {
+    if (fitsInByte(imm.value)) {
+      emit(0x6B, dst, src);
+      byte(imm.value);
+      return;
+    }
+    emit(0x69, dst, src);
+    code.push_int32(imm.value);
+  }
+  // edx:eax / src
+  void idiv(const RegMem &src) { emit(0xF7, 7, src); }
+  // sign extends eax into edx
+  void cdq() { byte(0x99); }
+
+  void shl(const RegMem &dst, Imm imm) {
+    emit(0xC1, 4, dst);
+    byte(imm.value);
+  }
+
+  void lea(Reg dst, const Mem &src) { emit(0x8D, dst, src); }
+  // sign extends 32 bit src into 64 bit register
+  void movsxd(Reg dst, const RegMem &src) {
+    emit(0x63, Reg(dst.id, true), src);
+  }
+  // zero extends low byte of src
+  void movzxByte(Reg dst, const RegMem &src) { emit(0x0F, 0xB6, dst, src); }
+  // sets low byte of dst to 1 when condition holds, otherwise to 0
+  void setcc(unsigned char condition, const RegMem &dst) {
+    emit(0x0F, 0x90 | condition, Reg(0), dst);
+  }
+
+  void push(Reg reg) { stackOperation(0x50, reg); }
+  void push(const RegMem &src) { emit(0xFF, 6, src); }
+  void push(Imm imm) {
+    if (fitsInByte(imm.value)) {
+      byte(0x6A);
+      byte(imm.value);
+      return;
+    }
+    byte(0x68);
+    code.push_int32(imm.value);
+  }
+  void pop(Reg reg) { stackOperation(0x58, reg); }
+
+  void call(Reg target) { emit(0xFF, 2, RegMem(Reg(target.id))); }
+  // call rel32, resolved when code is linked
+  void call(const void *address) { code.push_call(address); }
+  void ret() { byte(0xC3); }
+
+  void jmp(Label target) { code.push_jump(target); }
+  // condition is x86 condition code
+  void jcc(unsigned char condition, Label target) {
+    code.push_conditional_jump(condition, target);
+  }
+
+private:
+  X86InstrVector &code;
+
+  bool is64Bit() const { return code.target() == Target::x86_64; }
+  // REX.W exists only on x86-64
+  bool isWide(bool wide) const { return wide && is64Bit(); }
+
+  void byte(int value) { code.push_back(static_cast<std::byte>(value)); }
+
+  void prefix(bool wide, int reg, int index, int base) {
+    unsigned char rex = (wide ? rexW : 0) | (reg >= R8 ? rexR : 0) |
+                        (index >= R8 ? rexX : 0) | (base >= R8 ? rexB : 0);
+    if (rex != 0)
+      byte(rexPrefix | rex);
+  }
+
+  void stackOperation(unsigned char opcode, Reg reg) {
+    prefix(false, 0, noIndex, reg.id);
+    byte(opcode + (reg.id & 7));
+  }
+
+  // instruction with ModRM operand, reg is register of instruction
+  void emit(unsigned char opcode, Reg reg, const RegMem &rm) {
+    emit(opcode, reg.id, rm, reg.wide);
+  }
+  // instruction with opcode extension in reg field of ModRM
+  void emit(unsigned char opcode, int extension, const RegMem &rm) {
+    emit(opcode, extension, rm, false);
+  }
+  // two byte opcode
+  void emit(unsigned char escape, unsigned char opcode, Reg reg,
+            const RegMem &rm) {
+    prefix(isWide(reg.wide || rm.wide()), reg.id, indexOf(rm), baseOf(rm));
+    byte(escape);
+    byte(opcode);
+    operand(reg.id, rm);
+  }
+
+  void emit(unsigned char opcode, int regField, const RegMem &rm, bool wide) {
+    prefix(isWide(wide || rm.wide()), regField, indexOf(rm), baseOf(rm));
+    byte(opcode);
+    operand(regField, rm);
+  }
+
+  static int baseOf(const RegMem &rm) {
+    return rm.isRegister ? rm.reg.id : rm.mem.base;
+  }
+  static int indexOf(const RegMem &rm) {
+    return rm.isRegister ? noIndex : rm.mem.index;
+  }
+
+  // ModRM with SIB and displacement
+  void operand(int regField, const RegMem &rm) {
+    auto reg = regField & 7;
+    if (rm.isRegister) {
+      byte(modrmTable.bytes[modRegister][reg][rm.reg.id & 7]);
+      return;
+    }
+    const auto &mem = rm.mem;
+    auto base = mem.base & 7;
+    const auto &encoding = baseEncodings[base];
+    auto mod = mem.disp == 0 && !encoding.needsDisplacement ? modIndirect
+               : fitsInByte(mem.disp)                       ? modDisp8
+                                                            : modDisp32;
+    if (mem.index == noIndex && !encoding.needsSib) {
+      byte(modrmTable.bytes[mod][reg][base]);
+    } else {
+      auto index = mem.index == noIndex ? sibNoIndex : mem.index & 7;
+      byte(modrmTable.bytes[mod][reg][rmSib]);
+      byte(sibTable.bytes[scaleEncoding[mem.scale]][index][base]);
+    }
+    if (mod == modDisp8)
+      byte(mem.disp);
+    if (mod == modDisp32)
+      code.push_int32(mem.disp);
+  }
+};
@@ -1,23 +1,31 @@
 #pragma once
 
+#include <map>
 #include <stack>
+#include <string>
 #include "astvisitor.h"
 #include "ast.h"
 
 // AstCloner clones AST deeply
+// optionally variables and labels can be renamed on the way
+
+using RenameMap = std::map<std::string, std::string>;
 
 struct AstCloner : public AstVisitor {
   AstCloner() {}
+  explicit AstCloner(const RenameMap &renames) : renames(renames) {}
 
   void visitPre(const BasicStatement *) {}
   void visitPre(const BasicExpression *) {}
   void visitPre(const VarDecl *stmt) {
-    auto node = makeNode(VarDecl(scope, stmt->var_name));
+    auto node = makeNode(VarDecl(scope, rename(stmt->var_name)));
+    static_cast<VarDecl *>(node.get())->type = stmt->type;
     nodesStack.push(node);
   }
   void visitPre(const Expression *stmt) {
     auto node = makeNode<Expression>(Expression(scope));
-    static_cast<Expression *>(node.get())->setElements(stmt->getChilds());
+    static_cast<Expression *>(node.get())
+        ->setElements(cloneElements(stmt->getChilds()));
     static_cast<Expression *>(node.get())->isPartOfCompoundStmt =
         stmt->isPartOfCompoundStmt;
     nodesStack.push(node);
@@ -39,12 +47,12 @@ struct AstCloner : public AstVisitor {
   }
 
   void visitPre(const LabelStatement *stmt) {
-    auto node = makeNode(LabelStatement(scope, stmt->label));
+    auto node = makeNode(LabelStatement(scope, rename(stmt->label)));
     nodesStack.push(node);
   }
 
   void visitPre(const GotoStatement *stmt) {
-    auto node = makeNode(GotoStatement(scope, stmt->label));
+    auto node = makeNode(GotoStatement(scope, rename(stmt->label)));
     nodesStack.push(node);
   }
 
@@ -52,7 +60,7 @@ struct AstCloner : public AstVisitor {
   void visitPre(const FunctionDecl *) {}
 
   void visitPre(const ReturnStatement *stmt) {
-    auto node = makeNode(ReturnStatement(scope, stmt->param));
+    auto node = makeNode(ReturnStatement(scope, rename(stmt->param)));
     nodesStack.push(node);
   }
 
@@ -178,6 +186,37 @@ struct AstCloner : public AstVisitor {
   StatementList getStatements() const { return statements; }
 
 private:
+  std::string rename(const std::string &name) const {
+    auto it = renames.find(name);
+    return it == renames.end() ? name : it->second;
+  }
+
+  Expression::ElementsType
+  cloneElements(const Expression::ElementsType &elements) const {
+    Expression::ElementsType result;
+    for (const auto &element : elements) {
+      if (auto basic = dynamic_cast<BasicExpression *>(element.get())) {
+        result.push_back(
+            makeNode(BasicExpression(scope, rename(basic->value))));
+      } else if (auto fcall = dynamic_cast<FunctionCall *>(element.get())) {
+        auto node = makeNode(FunctionCall(scope));
+        auto call = static_cast<FunctionCall *>(node.get());
+        call->name = fcall->name;
+        for (const auto &param : fcall->parameters)
+          call->parameters.push_back(rename(param));
+        result.push_back(node);
+      } else if (auto expr = dynamic_cast<Expression *>(element.get())) {
+        result.push_back(makeNode(Expression(scope,
+                                             cloneElements(expr->getChilds()),
+                                             expr->isPartOfCompoundStmt)));
+      } else {
+        result.push_back(element);
+      }
+    }
+    return result;
+  }
+
+  RenameMap renames;
   size_t scope = 0;
   StatementList statements;
   std::stack<StatementPtr> nodesStack;
@@ -1,8 +1,88 @@
 #pragma once
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
-void builtin_print(int value) { std::cout << value << std::endl; }
+// two decimal digits of each number below 100
+struct DigitPairs {
+  char digits[200];
+};
+
+constexpr DigitPairs makeDigitPairs() {
+  DigitPairs pairs{};
+  for (int i = 0; i < 100; ++i) {
+    pairs.digits[2 * i] = static_cast<char>('0' + i / 10);
+    pairs.digits[2 * i + 1] = static_cast<char>('0' + i % 10);
+  }
+  return pairs;
+}
+
+constexpr DigitPairs digitPairs = makeDigitPairs();
+
+// sign and 10 digits of int
+constexpr size_t maxIntLength = 11;
+
+// writes decimal value to out, returns number of written characters
+size_t formatInt(int value, char *out) {
+  char buffer[maxIntLength];
+  char *end = buffer + maxIntLength;
+  char *begin = end;
+  // unsigned magnitude, so INT_MIN doesn't overflow
+  auto magnitude = value < 0 ? 0u - static_cast<unsigned>(value)
+                             : static_cast<unsigned>(value);
+  while (magnitude >= 100) {
+    auto pair = 2 * (magnitude % 100);
+    magnitude /= 100;
+    *--begin = digitPairs.digits[pair + 1];
+    *--begin = digitPairs.digits[pair];
+  }
+  if (magnitude >= 10) {
+    *--begin = digitPairs.digits[2 * magnitude + 1];
+    *--begin = digitPairs.digits[2 * magnitude];
+  } else {
+    *--begin = static_cast<char>('0' + magnitude);
+  }
+  if (value < 0)
+    *--begin = '-';
+  auto length = static_cast<size_t>(end - begin);
+  std::memcpy(out, begin, length);
+  return length;
+}
+
+// Output of JIT programs. print only formats value into buffer,
+// which is written when it's full, on flush builtin and when thread
+// exits, so printing doesn't cost a system call per value.
+struct OutputBuffer {
+  static constexpr size_t capacity = 1 << 16;
+
+  ~OutputBuffer() { flush(); }
+
+  void write(int value) {
+    if (capacity - used < maxIntLength + 1)
+      flush();
+    used += formatInt(value, data + used);
+    data[used++] = '\n';
+  }
+
+  void flush() {
+    if (used == 0)
+      return;
+    std::cout.write(data, used);
+    std::cout.flush();
+    used = 0;
+  }
+
+private:
+  char data[capacity];
+  size_t used = 0;
+};
+
+thread_local OutputBuffer outputBuffer;
+
+void builtin_print(int value) { outputBuffer.write(value); }
+
+void builtin_flush() { outputBuffer.flush(); }
 
 void out(int *ptr) { *ptr = 0; }
 
@@ -0,0 +1,128 @@
+#pragma once
+
+// CodeBatch packs machine code of many programs into one block of code
+// heap, so a small program doesn't cost a page and a change of
+// protection of its own. Block is allocated and made executable once
+// for the whole batch:
+//
+//   auto batch = compileBatch(sources, functions);
+//   for (size_t i = 0; i < batch.size(); ++i)
+//     batch.entry(i)();
+//
+// Programs start at aligned offsets, their code is position independent
+// except direct calls of host functions, which are linked at the final
+// address of each program.
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ast.h"
+#include "compiler.h"
+#include "inliner.h"
+#include "cfg_flatten.h"
+#include "optimizer.h"
+#include "host_functions.h"
+#include "code_heap.h"
+#include "code_emitter.h"
+#include "jitcompiler.h"
+
+// start of every program in batch, keeps literal pools aligned
+constexpr size_t batchCodeAlignment = 16;
+
+struct CodeBatchException : public std::runtime_error {
+  CodeBatchException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+struct CodeBatch {
+  explicit CodeBatch(CodeHeap &codeHeap = defaultCodeHeap())
+      : heap(codeHeap) {}
+  CodeBatch(CodeBatch &&other)
+      : heap(other.heap), programs(std::move(other.programs)),
+        names(std::move(other.names)),
+        offsets(std::move(other.offsets)), block(other.block),
+        codeBytes(other.codeBytes) {
+    other.block = nullptr;
+  }
+  CodeBatch(const CodeBatch &) = delete;
+  CodeBatch &operator=(const CodeBatch &) = delete;
+
+  ~CodeBatch() {
+    if (block)
+      heap.release(block);
+  }
+
+  // adds final code of a program (after emit_literal_pool),
+  // returns its index, name is reported to profilers
+  size_t add(X86InstrVector code, std::string name = {}) {
+    if (block)
+      throw CodeBatchException("batch is already linked");
+    auto offset = (codeBytes + batchCodeAlignment - 1) / batchCodeAlignment *
+                  batchCodeAlignment;
+    codeBytes = offset + code.size();
+    offsets.push_back(offset);
+    if (name.empty())
+      name = "program#" + std::to_string(offsets.size() - 1);
+    names.push_back(std::move(name));
+    programs.push_back(std::move(code));
+    return offsets.size() - 1;
+  }
+
+  // copies all programs to one block and makes it executable
+  void link() {
+    if (block)
+      return;
+    block = heap.allocate(codeBytes);
+    for (size_t i = 0; i < programs.size(); ++i) {
+      auto destination = block + offsets[i];
+      programs[i].link(destination, reinterpret_cast<uintptr_t>(destination));
+    }
+    heap.makeExecutable(block);
+    for (size_t i = 0; i < programs.size(); ++i)
+      jitProfiler().codeLoaded(names[i], block + offsets[i],
+                               programs[i].size());
+    // code isn't needed once it's linked
+    programs.clear();
+    names.clear();
+  }
+
+  JitCompiler::pfunc entry(size_t index) const {
+    if (!block)
+      throw CodeBatchException("batch is not linked");
+    return reinterpret_cast<JitCompiler::pfunc>(block + offsets.at(index));
+  }
+
+  // number of programs
+  size_t size() const { return offsets.size(); }
+
+  // bytes of code including alignment between programs
+  size_t getCodeBytes() const { return codeBytes; }
+
+private:
+  CodeHeap &heap;
+  std::vector<X86InstrVector> programs;
+  std::vector<std::string> names;
+  std::vector<size_t> offsets;
+  std::byte *block = nullptr;
+  size_t codeBytes = 0;
+};
+
+// Compiles sources like driver does and links them into one batch,
+// syntax error of a source is reported with its index.
+CodeBatch compileBatch(const std::vector<std::string> &sources,
+                       const HostFunctions &functions,
+                       CodeHeap &heap = defaultCodeHeap()) {
+  CodeBatch batch(heap);
+  for (size_t i = 0; i < sources.size(); ++i) {
+    auto name = "<source " + std::to_string(i) + ">";
+    FunctionInliner inliner(parseSource(sources[i], name));
+    CFGFlattener visitor;
+    traverse(inliner.run(), visitor);
+    batch.add(emitMachineCode(optimize(visitor.getStatements()), functions),
+              name);
+  }
+  batch.link();
+  return batch;
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+// CodeCache keeps machine code of programs on disk, so a program that
+// didn't change isn't parsed and compiled again after restart.
+// Entries are addressed by hash of everything the code depends on:
+// source, parser tables of the grammar, version of code generator,
+// build of the compiler, target and host functions with their
+// signatures. Contents of entry are checksummed, damaged entry is
+// never loaded.
+//
+// Addresses of host functions differ between processes, so code refers
+// to them only through relocations, stored with names of functions and
+// resolved against HostFunctions of the running process on load:
+//   - direct calls, which are linked again with their stubs
+//   - absolute addresses in literal pool (targets of the stubs)
+//
+//   CodeCache cache(".cogecs-cache");
+//   auto key = cache.key(source, functions, target);
+//   auto code = cache.load(key, functions);  // empty when not cached
+//   if (!code)
+//     cache.store(key, emitMachineCode(statements, functions), functions);
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "compiler.h"
+#include "host_functions.h"
+#include "jitcompiler.h"
+
+// has to be bumped when emitted code or format of entries changes,
+// entries of another build are never used anyway (see codeCacheBuildId)
+constexpr uint32_t codeCacheVersion = 2;
+
+constexpr char codeCacheMagic[4] = {'C', 'G', 'C', 'C'};
+
+// FNV-1a, the same value in every process
+struct Fnv1aHash {
+  void add(const void *data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+      value ^= bytes[i];
+      value *= 1099511628211ull;
+    }
+  }
+  template <typename T> void addValue(T v) { add(&v, sizeof(v)); }
+  // length is hashed too, so "ab" "c" differs from "a" "bc"
+  void add(const std::string &text) {
+    addValue<uint64_t>(text.size());
+    add(text.data(), text.size());
+  }
+
+  uint64_t value = 14695981039346656037ull;
+};
+
+// changes whenever grammar.g is changed
+uint64_t grammarFingerprint() {
+  Fnv1aHash hash;
+  hash.addValue<uint32_t>(parser_tables_gram.nstates);
+  hash.addValue<uint32_t>(parser_tables_gram.nsymbols);
+  for (unsigned i = 0; i < parser_tables_gram.nsymbols; ++i)
+    hash.add(std::string(parser_tables_gram.symbols[i].name));
+  return hash.value;
+}
+
+// time the compiler was built, so code of an older code generator left
+// in the cache isn't loaded after rebuild, even without a new version
+uint64_t codeCacheBuildId() {
+  Fnv1aHash hash;
+  hash.add(std::string(__DATE__ " " __TIME__));
+  return hash.value;
+}
+
+struct CodeCache {
+  explicit CodeCache(std::filesystem::path cacheDirectory)
+      : directory(std::move(cacheDirectory)) {}
+
+  std::string key(const std::string &source, const HostFunctions &functions,
+                  Target target = hostTarget) const {
+    Fnv1aHash hash;
+    hash.addValue(codeCacheVersion);
+    hash.addValue(codeCacheBuildId());
+    hash.addValue(grammarFingerprint());
+    hash.addValue(static_cast<uint8_t>(target));
+    for (const auto &function : functions) {
+      hash.add(function.first);
+      hash.addValue(function.second.hasSignature);
+      hash.addValue(static_cast<uint8_t>(function.second.intrinsic));
+      hash.addValue(function.second.implementation != nullptr);
+      for (auto parameter : function.second.parameters)
+        hash.addValue(static_cast<uint8_t>(parameter));
+    }
+    hash.add(source);
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (int shift = 60; shift >= 0; shift -= 4)
+      result += digits[(hash.value >> shift) & 0xF];
+    return result;
+  }
+
+  // code with relocations resolved for this process, empty when entry
+  // doesn't exist or can't be used
+  std::optional<X86InstrVector> load(const std::string &key,
+                                     const HostFunctions &functions) const {
+    std::ifstream entry(path(key), std::ios::binary);
+    if (!entry)
+      return std::nullopt;
+    char magic[sizeof(codeCacheMagic)];
+    uint32_t version = 0;
+    uint64_t checksum = 0;
+    if (!entry.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), codeCacheMagic) ||
+        !read(entry, version) || version != codeCacheVersion ||
+        !read(entry, checksum))
+      return std::nullopt;
+    // bytes of damaged entry must not run as code
+    std::string contents(std::istreambuf_iterator<char>(entry), {});
+    Fnv1aHash hash;
+    hash.add(contents.data(), contents.size());
+    if (hash.value != checksum)
+      return std::nullopt;
+    std::istringstream file(std::move(contents));
+    uint8_t target = 0;
+    if (!read(file, target))
+      return std::nullopt;
+    X86InstrVector code(static_cast<Target>(target));
+    std::vector<std::byte> bytes;
+    if (!read(file, bytes))
+      return std::nullopt;
+    code.push_back(bytes);
+
+    auto addresses = symbolAddresses(functions);
+    uint64_t count = 0;
+    if (!read(file, count))
+      return std::nullopt;
+    for (uint64_t i = 0; i < count; ++i) {
+      uint64_t end = 0;
+      uint64_t stub = 0;
+      std::string symbol;
+      if (!read(file, end) || !read(file, stub) || !read(file, symbol) ||
+          !addresses.count(symbol) || end > code.size())
+        return std::nullopt;
+      code.add_call_reference(end, addresses[symbol],
+                              static_cast<size_t>(stub));
+    }
+    if (!read(file, count))
+      return std::nullopt;
+    for (uint64_t i = 0; i < count; ++i) {
+      uint64_t position = 0;
+      std::string symbol;
+      if (!read(file, position) || !read(file, symbol) ||
+          !addresses.count(symbol) ||
+          position + pointerSize(code.target()) > code.size())
+        return std::nullopt;
+      code.patch_address(position, addresses[symbol]);
+      code.add_absolute_reference(position, addresses[symbol]);
+    }
+    return code;
+  }
+
+  // Stores code, which has to be final (after emit_literal_pool).
+  // Code calling an address that isn't a host function can't be cached,
+  // returns false then or when entry can't be written.
+  bool store(const std::string &key, const X86InstrVector &code,
+             const HostFunctions &functions) const {
+    std::map<const void *, std::string> symbols;
+    for (const auto &symbol : symbolAddresses(functions))
+      symbols.emplace(symbol.second, symbol.first);
+    for (const auto &call : code.call_references()) {
+      if (!symbols.count(call.address))
+        return false;
+    }
+    for (const auto &absolute : code.absolute_references()) {
+      if (!symbols.count(absolute.second))
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    // written under temporary name, so concurrent readers never see
+    // a partial entry
+    auto temporary = path(key);
+    temporary += ".tmp";
+    {
+      std::ostringstream file;
+      write(file, static_cast<uint8_t>(code.target()));
+      write(file, code.instruction_vector());
+      write(file, static_cast<uint64_t>(code.call_references().size()));
+      for (const auto &call : code.call_references()) {
+        write(file, static_cast<uint64_t>(call.end));
+        write(file, static_cast<uint64_t>(call.stub));
+        write(file, symbols[call.address]);
+      }
+      write(file, static_cast<uint64_t>(code.absolute_references().size()));
+      for (const auto &absolute : code.absolute_references()) {
+        write(file, static_cast<uint64_t>(absolute.first));
+        write(file, symbols[absolute.second]);
+      }
+      auto contents = file.str();
+      Fnv1aHash hash;
+      hash.add(contents.data(), contents.size());
+
+      std::ofstream entry(temporary, std::ios::binary | std::ios::trunc);
+      if (!entry)
+        return false;
+      entry.write(codeCacheMagic, sizeof(codeCacheMagic));
+      write(entry, codeCacheVersion);
+      write(entry, hash.value);
+      entry.write(contents.data(),
+                  static_cast<std::streamsize>(contents.size()));
+      if (!entry)
+        return false;
+    }
+    std::filesystem::rename(temporary, path(key), error);
+    return !error;
+  }
+
+  std::filesystem::path path(const std::string &key) const {
+    return directory / (key + ".bin");
+  }
+
+private:
+  std::filesystem::path directory;
+
+  // functions and implementations of intrinsics by name
+  static std::map<std::string, const void *>
+  symbolAddresses(const HostFunctions &functions) {
+    std::map<std::string, const void *> addresses;
+    for (const auto &function : functions) {
+      addresses[function.first] = function.second.address;
+      if (function.second.implementation)
+        addresses[function.first + "@implementation"] =
+            function.second.implementation;
+    }
+    return addresses;
+  }
+
+  template <typename T> static void write(std::ostream &file, T value) {
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  static void write(std::ostream &file, const std::string &text) {
+    write(file, static_cast<uint32_t>(text.size()));
+    file.write(text.data(), static_cast<std::streamsize>(text.size()));
+  }
+  static void write(std::ostream &file, const std::vector<std::byte> &bytes) {
+    write(file, static_cast<uint64_t>(bytes.size()));
+    file.write(reinterpret_cast<const char *>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+  }
+
+  template <typename T> static bool read(std::istream &file, T &value) {
+    return static_cast<bool>(
+        file.read(reinterpret_cast<char *>(&value), sizeof(value)));
+  }
+  static bool read(std::istream &file, std::string &text) {
+    uint32_t size = 0;
+    if (!read(file, size) || size > maxSymbolLength)
+      return false;
+    text.resize(size);
+    return static_cast<bool>(file.read(&text[0], size));
+  }
+  static bool read(std::istream &file, std::vector<std::byte> &bytes) {
+    uint64_t size = 0;
+    if (!read(file, size) || size > maxCodeSize)
+      return false;
+    bytes.resize(static_cast<size_t>(size));
+    return static_cast<bool>(
+        file.read(reinterpret_cast<char *>(bytes.data()),
+                  static_cast<std::streamsize>(size)));
+  }
+
+  // limits of damaged entries
+  static constexpr uint32_t maxSymbolLength = 4096;
+  static constexpr uint64_t maxCodeSize = 1ull << 30;
+};
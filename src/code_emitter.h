@@ -6,191 +6,152 @@
 #include <functional>
 #include <map>
 #include <set>
-#include <stack>
+#include <algorithm>
 #include <utility>
 #include "ast.h"
 #include "astvisitor.h"
 #include "jitcompiler.h"
 #include "builtin.h"
+#include "host_functions.h"
 #include "symbol_table.h"
 #include "nullvisitor.h"
 #include "sema.h"
+#include "register_allocation.h"
+#include "peephole.h"
+#include "assembler.h"
+#include "pass_stats.h"
 
-/*
-// AllocationPass counts number of variables per each block
-// those between __alloc__ and __dealloc__ builtin expressions
-// Value (which is number of variables) is stored in a map, indexed by pair
-(level and position on the level)
-//               0              - level 0 (root)
-//              / \
-//             /   \
-//            0     1           - level 1 (indexes in map (1,0) (1,1))
-//           / \   / \
-//          0   1 0   1         - level 2 (indexes in map (2,0) (2,1) (2,2)
-(2,3)
-// It is further used to allocate specific number
-// of variables (memory) on the stack
-*/
-
-using AllocationMap = std::map<std::pair<size_t, size_t>, size_t>;
-
-using GotoLabelsFromIf = std::set<std::string>;
+using GotosFromIf = std::set<const Statement *>;
 using LabelToCodePosition = std::map<std::string, size_t>;
 
-// TODO: just for now stack for local variables will be only 256 bytes
-constexpr unsigned int stackSize = 256;
 using TypeSizeOfMap = std::map<std::string, int>;
 
-// for 32 bit arch
-TypeSizeOfMap typeSizeOfMap = {
+// for 32 bit arch, read only, so code can be emitted on many threads
+const TypeSizeOfMap typeSizeOfMap = {
     {"i32", 4},
     {"^i32", 4},
 };
 
-struct PreAllocationPass : public NullVisitor {
-  void visitPre(const BasicExpression *expr) {
-    if (expr->value == "__alloc__") {
-      ++allocationLevel;
-    }
-    if (expr->value == "__dealloc__") {
-      allocationLevelIndex[allocationLevel]++;
-      --allocationLevel;
-    }
-  }
-  void visitPre(const VarDecl *) {
-    allocs[std::make_pair(allocationLevel,
-                          allocationLevelIndex[allocationLevel])]++;
-  }
+// size of type in bytes, 0 for unknown type
+int typeSizeOf(const std::string &type) {
+  auto size = typeSizeOfMap.find(type);
+  return size == typeSizeOfMap.end() ? 0 : size->second;
+}
+
+// x86 condition codes, low bits of jcc and setcc opcodes
+constexpr unsigned char conditionEqual = 0x4;
+constexpr unsigned char conditionNotEqual = 0x5;
+constexpr unsigned char conditionLess = 0xC;
+constexpr unsigned char conditionGreaterOrEqual = 0xD;
+constexpr unsigned char conditionLessOrEqual = 0xE;
+constexpr unsigned char conditionGreater = 0xF;
+constexpr unsigned char noCondition = 0xFF;
+
+// System V passes first six integer arguments in these registers
+constexpr X86Register systemVArgumentRegisters[] = {EDI, ESI, EDX,
+                                                    ECX, R8,  R9};
+
+// return statement jumps here, to epilog, with the value in eax
+constexpr char returnLabel[] = "__return__";
+
+unsigned char conditionCode(const std::string &op) {
+  if (op == "==")
+    return conditionEqual;
+  if (op == "!=")
+    return conditionNotEqual;
+  if (op == "<")
+    return conditionLess;
+  if (op == ">=")
+    return conditionGreaterOrEqual;
+  if (op == "<=")
+    return conditionLessOrEqual;
+  if (op == ">")
+    return conditionGreater;
+  return noCondition;
+}
 
-  void dump() {
-    for (auto elem : allocs) {
-      // std::cout << "(" << elem.first.first << "," << elem.first.second << ")"
-      // << "->" << elem.second << std::endl;
+// condition which is true when given one is false
+unsigned char negateCondition(unsigned char condition) { return condition ^ 1; }
+
+// FrameLayoutPass computes slot of each variable in a single frame
+// of the function, addressed as [ebp - offset].
+// Blocks between __alloc__ and __dealloc__ get slots after those
+// used by enclosing blocks, sibling blocks share the same slots.
+// Variables are placed at decreasing addresses in order of declaration,
+// so pointer arithmetic still walks from one variable to the next.
+// Slot of i32 takes 4 bytes, pointer slot is aligned and takes
+// pointer size of target.
+//
+//   var a;            [ebp - 4]
+//   { var b; }        [ebp - 8]
+//   { var c; }        [ebp - 8]
+//   var d;            [ebp - 8]
+struct FrameLayoutPass : public NullVisitor {
+  explicit FrameLayoutPass(Target target = hostTarget) : target(target) {}
+
+  void visitPre(const BasicExpression *expr) {
+    if (expr->value == "__alloc__")
+      enclosingBytes.push_back(usedBytes);
+    if (expr->value == "__dealloc__" && !enclosingBytes.empty()) {
+      usedBytes = enclosingBytes.back();
+      enclosingBytes.pop_back();
     }
   }
-  std::map<std::pair<size_t, size_t>, size_t> getAllocationVector() const {
-    return allocs;
+  void visitPre(const VarDecl *varDecl) {
+    auto size = slotSize(varDecl->type);
+    usedBytes = (usedBytes + size + size - 1) / size * size;
+    offsets[varDecl] = -static_cast<int>(usedBytes);
+    frameSize = std::max(frameSize, usedBytes);
   }
 
-private:
-  size_t allocationLevel = 0;
-  std::map<size_t, size_t> allocationLevelIndex;
-  AllocationMap allocs;
-};
+  // offset from ebp
+  int offsetOf(const Statement *varDecl) const { return offsets.at(varDecl); }
 
-unsigned int calculateVariableOffset(const symbol &sym,
-                                     size_t currentAllocationLevel,
-                                     const AllocationMap &allocs) {
-  // TODO variable size is hardcoded for now and is always 4 bytes
-  // this is only true for 32 bit
-  // calculation variable position is frame layout dependent
-  // currently each variable is allocated at the beginning of stack frame
-  // each layer/scope adds additional 4 bytes due to fact of emitting
-  // new function prolog eg push ebp; mov ebp, esp;
-  char variableSize = 4;
-  // if in the same scope
-  if ((currentAllocationLevel - sym.scope) == 0) {
-    char ebpOffset = (sym.stack_position + 1) * variableSize;
-    return ebpOffset;
-  }
-  // if variable is defined in outer scope
-  // it requires to go up the stack
-  // so [ebp + value]
-  char numberOfLevelsUp = (currentAllocationLevel - sym.scope) * variableSize;
-  auto alloc_it =
-      allocs.find(std::make_pair(sym.allocation_level, sym.level_index));
-  auto numOfVariablesOnLevel = alloc_it->second;
-  char numberOfVariablesInBetween =
-      (numOfVariablesOnLevel - (sym.stack_position + 1)) * variableSize;
-  char ebpOffset = numberOfLevelsUp + (numberOfVariablesInBetween);
-  // std::cout << "sym:" << sym.id << " level:" << currentAllocationLevel
-  // 	      << " scope: " << sym.scope << " stack_position: " <<
-  // (int)sym.stack_position
-  //	      << " between:" << (int)numberOfVariablesInBetween << " epbOffset:"
-  //<< (int)ebpOffset << std::endl;
-
-  return ebpOffset;
-}
+  // number of bytes that has to be reserved in prolog
+  size_t getFrameSize() const { return frameSize; }
 
-unsigned int calculateVariablePositionOnStack(const symbol &sym,
-                                              size_t currentAllocationLevel,
-                                              const AllocationMap &allocs) {
-  if ((currentAllocationLevel - sym.scope) == 0) {
-    return stackSize -
-           calculateVariableOffset(sym, currentAllocationLevel, allocs);
+private:
+  size_t slotSize(const std::string &type) const {
+    if (!type.empty() && type[0] == '^')
+      return pointerSize(target);
+    return 4;
   }
-  return calculateVariableOffset(sym, currentAllocationLevel, allocs);
-}
+
+  Target target;
+  size_t usedBytes = 0;
+  std::vector<size_t> enclosingBytes;
+  size_t frameSize = 0;
+  std::map<const Statement *, int> offsets;
+};
 
 struct Basicx86Emitter : public NullVisitor {
-  Basicx86Emitter(X86InstrVector &v,
-                  std::map<std::pair<size_t, size_t>, size_t> allocVector,
+  Basicx86Emitter(X86InstrVector &v, const FrameLayoutPass &frameLayout,
                   BasicSymbolTable &symTable,
-                  const std::map<std::string, void *> &fMap)
-      : i_vector(v), allocs(allocVector), symbolTable(symTable),
-        functionMap(fMap) {
-    allocationLevelIndex[allocationLevel] = 0;
-  }
+                  const HostFunctions &fMap,
+                  const RegisterAssignment &regs = {},
+                  const std::set<const Statement *> &fused = {})
+      : i_vector(v), assembler(v), frame(frameLayout), symbolTable(symTable),
+        functionMap(fMap), registers(regs), fusedComparisons(fused) {}
   ~Basicx86Emitter() {}
   void visitPre(const BasicExpression *expr) {
-    if (expr->value == "__alloc__") {
+    // slots of all blocks are reserved in function prolog,
+    // so entering and leaving a block costs nothing
+    if (expr->value == "__alloc__")
       symbolTable.enterScope();
-      // emitting function prolog
-      // push ebp
-      // mov ebp, esp
-      // is used to simplify relative access to variables
-      // to calculate right offset
-      i_vector.push_function_prolog();
-
-      size_t numOfVariables = allocs[std::make_pair(
-          allocationLevel, allocationLevelIndex[allocationLevel])];
-      // std::cout << "alloc" << "(" << allocationLevel << "," <<
-      // allocationLevelIndex[allocationLevel] << ")" << ":" << numOfVariables <<
-      // std::endl;
-      for (size_t i = 0; i < numOfVariables; ++i) {
-        i_vector.push_back({std::byte(0x83), std::byte(0xEC),
-                            std::byte(0x04)}); // sub esp, 4 (alloc)
-      }
-      scopeId.push(std::make_pair(allocationLevel,
-                                  allocationLevelIndex[allocationLevel]));
-      ++allocationLevel;
-    }
-    if (expr->value == "__dealloc__") {
-      size_t level = allocationLevel - 1;
-      size_t numOfVariables =
-          allocs[std::make_pair(level, allocationLevelIndex[level])];
-      // std::cout << "dealloc" << "(" << level << "," <<
-      // allocationLevelIndex[level] << ")" << ":" << numOfVariables <<
-      // std::endl;
-      for (size_t i = 0; i < numOfVariables; ++i) {
-        i_vector.push_back({std::byte(0x83), std::byte(0xC4),
-                            std::byte(0x04)}); // add esp, 4 (dealloc)
-      }
-      --allocationLevel;
-      allocationLevelIndex[allocationLevel]++;
-
-      scopeId.pop();
-      // pop ebp
-      i_vector.push_back({std::byte(0x5D)});
+    if (expr->value == "__dealloc__")
       symbolTable.exitScope();
-    }
   }
   void visitPost(const VarDecl *varDecl) {
     if (symbolTable.exists(varDecl->var_name)) {
       throw CodeEmitterException("variable already defined : " +
                                  varDecl->var_name);
     }
-
-    auto scope = scopeId.top();
-    // std::cout << varDecl->var_name << " : " << "(" << scope.first << "," <<
-    // scope.second << ")" << " stack position:" <<
-    // (int)variable_position_on_stack_map[scope] << std::endl;
-
+    // variable in register still gets its slot, so frame layout
+    // does not depend on allocation
+    auto reg = registers.find(varDecl);
     symbolTable.insertSymbol(varDecl->var_name, varDecl->type,
-                             variable_position_on_stack_map[scope], scope.first,
-                             scope.second);
-
-    variable_position_on_stack_map[scope]++;
+                             frame.offsetOf(varDecl),
+                             reg != registers.end() ? reg->second : noRegister);
   }
   void visitPost(const Expression *expr) {
     auto children = expr->getChilds();
@@ -205,31 +166,24 @@ struct Basicx86Emitter : public NullVisitor {
         // variable alias on rhs
         if (std::isalpha(rhs->value[0])) {
           auto sym = symbolTable.findSymbol(rhs->value, 0);
-
-          auto currentAllocationLevel = scopeId.top().first;
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
+          if (lhsSymbol.register_id != noRegister) {
+            // mov reg, [ebp - ebpOffset] / reg
+            assembler.mov(Reg(lhsSymbol.register_id, isWide(sym)),
+                          variable(sym));
+            break;
+          }
           // mov eax, [ebp - ebpOffset]
-          i_vector.push_back(
-              {std::byte(0x8B), std::byte(0x45), std::byte(variablePosition)});
+          assembler.mov(Reg(EAX, isWide(sym)), variable(sym));
         }
         // value on rhs
         else {
           int rhsValue = std::stoi(rhs->value);
-
-          i_vector.push_back({std::byte(0xB8)}); // mov eax, rhsValue
-          i_vector.push_back(i_vector.int_to_bytes(rhsValue));
+          // mov [ebp - ebpOffset], rhsValue
+          assembler.mov(variable(lhsSymbol), Imm(rhsValue));
+          break;
         }
-
-        auto currentAllocationLevel = scopeId.top().first;
-
-        // std::cout << "sym : " << lhsSymbol.id << " level:" <<
-        // currentAllocationLevel << " scope:" << lhsSymbol.scope << std::endl;
-        unsigned int variablePosition = calculateVariablePositionOnStack(
-            lhsSymbol, currentAllocationLevel, allocs);
         // mov [ebp - ebpOffset], eax
-        i_vector.push_back(
-            {std::byte(0x89), std::byte(0x45), std::byte(variablePosition)});
+        assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
       }
       break;
     }
@@ -259,29 +213,18 @@ struct Basicx86Emitter : public NullVisitor {
           errMessage += outStream.str();
           throw CodeEmitterException(errMessage);
         }
-        auto currentAllocationLevel = scopeId.top().first;
-        unsigned int variablePosition = calculateVariablePositionOnStack(
-            sym, currentAllocationLevel, allocs);
         // mov eax, [ebp - ebpOffset]
-        i_vector.push_back(
-            {std::byte(0x8B), std::byte(0x45), std::byte(variablePosition)});
+        assembler.mov(Reg(EAX, isWide(sym)), variable(sym));
         if (!std::isalpha(rhsVariable->value[0])) {
           int value = std::stoi(rhsVariable->value);
           // mov [eax], value
-          i_vector.push_back({std::byte(0xC7), std::byte(0x00)});
-          i_vector.push_back(i_vector.int_to_bytes(value));
+          assembler.mov(Mem(EAX, 0, isWidePointee(sym)), Imm(value));
         } else {
-          auto sym = symbolTable.findSymbol(rhsVariable->value, 0);
-
-          auto currentAllocationLevel = scopeId.top().first;
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
-          // mov ebx, [ebp - ebpOffset]
-          i_vector.push_back(
-              {std::byte(0x8B), std::byte(0x5D), std::byte(variablePosition)});
-
-          // mov [eax], ebx
-          i_vector.push_back({std::byte(0x89), std::byte(0x18)});
+          auto rhsSymbol = symbolTable.findSymbol(rhsVariable->value, 0);
+          // mov edx, [ebp - ebpOffset]
+          assembler.mov(Reg(EDX, isWide(rhsSymbol)), variable(rhsSymbol));
+          // mov [eax], edx
+          assembler.mov(Mem(EAX, 0, isWidePointee(sym)), Reg(EDX));
         }
       } else {
         auto lhsSymbol = symbolTable.findSymbol(lhs->value, 0);
@@ -292,47 +235,20 @@ struct Basicx86Emitter : public NullVisitor {
         auto rhs = cast<BasicExpression>(children[3]);
         if (unaryOp->value == "!") {
           auto sym = symbolTable.findSymbol(rhs->value, 0);
-          auto currentAllocationLevel = scopeId.top().first;
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
           // mov eax, [ebp - ebpOffset]
-          i_vector.push_back(
-              {std::byte(0x8B), std::byte(0x45), std::byte(variablePosition)});
-          // compare rhsValue with 0
-          comparisonOperatorValue(0, insertJG);
-          // TODO: this is only true for 32 bit
-          unsigned int lhsVariablePosition = calculateVariablePositionOnStack(
-              lhsSymbol, currentAllocationLevel, allocs);
-
+          assembler.mov(Reg(EAX, isWide(sym)), variable(sym));
+          // ! gives 1 for values not greater than 0
+          assembler.cmp(Reg(EAX, isWide(sym)), Imm(0));
+          insertSetCondition(conditionLessOrEqual);
           // mov [ebp - ebpOffset], eax
-          i_vector.push_back({std::byte(0x89), std::byte(0x45),
-                              std::byte(lhsVariablePosition)});
+          assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
         }
         if (unaryOp->value == "&") {
-          i_vector.push_back({std::byte(0x89), std::byte(0xe8)});
           auto sym = symbolTable.findSymbol(rhs->value, 0);
-          auto currentAllocationLevel = scopeId.top().first;
-
-          unsigned int offset =
-              calculateVariableOffset(sym, currentAllocationLevel, allocs);
-          // go down the stack, variable in current scope
-          if ((currentAllocationLevel - sym.scope) == 0) {
-            // sub eax, offset
-            i_vector.push_back(
-                {std::byte(0x83), std::byte(0xe8), std::byte(offset)});
-
-          }
-          // go up the stack, variable in outer scope
-          else {
-            // add eax, offset
-            i_vector.push_back(
-                {std::byte(0x83), std::byte(0xc0), std::byte(offset)});
-          }
-          unsigned int lhsVariablePosition = calculateVariablePositionOnStack(
-              lhsSymbol, currentAllocationLevel, allocs);
+          // lea eax, [ebp - ebpOffset]
+          assembler.lea(Reg(EAX, is64Bit()), Mem(EBP, sym.stack_position));
           // mov [ebp - ebpOffset], eax
-          i_vector.push_back({std::byte(0x89), std::byte(0x45),
-                              std::byte(lhsVariablePosition)});
+          assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
         }
         if (unaryOp->value == "*") {
           auto sym = symbolTable.findSymbol(rhs->value, 0);
@@ -345,19 +261,12 @@ struct Basicx86Emitter : public NullVisitor {
             errMessage += outStream.str();
             throw CodeEmitterException(errMessage);
           }
-          auto currentAllocationLevel = scopeId.top().first;
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
           // mov eax, [ebp - ebpOffset]
-          i_vector.push_back(
-              {std::byte(0x8B), std::byte(0x45), std::byte(variablePosition)});
+          assembler.mov(Reg(EAX, isWide(sym)), variable(sym));
           // mov eax, [eax]
-          i_vector.push_back({std::byte(0x8B), std::byte(0x00)});
-          unsigned int lhsVariablePosition = calculateVariablePositionOnStack(
-              lhsSymbol, currentAllocationLevel, allocs);
+          assembler.mov(Reg(EAX, isWidePointee(sym)), Mem(EAX));
           // mov [ebp - ebpOffset], eax
-          i_vector.push_back({std::byte(0x89), std::byte(0x45),
-                              std::byte(lhsVariablePosition)});
+          assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
         }
       }
       break;
@@ -375,95 +284,74 @@ struct Basicx86Emitter : public NullVisitor {
           binOp->value == "/" || binOp->value == "==" || binOp->value == "!=" ||
           binOp->value == "<" || binOp->value == ">" || binOp->value == "<=" ||
           binOp->value == ">=") {
+        if (isComparisonOperator(binOp->value)) {
+          insertComparison(firstParam->value, secondParam->value);
+          auto condition = conditionCode(binOp->value);
+          // if statement that follows jumps on flags directly
+          if (fusedComparisons.count(expr)) {
+            pendingCondition = condition;
+            break;
+          }
+          insertSetCondition(condition);
+          // mov [ebp - ebpOffset], eax
+          assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
+          break;
+        }
+        // a = a + value is updated in place
+        if ((binOp->value == "+" || binOp->value == "-") &&
+            firstParam->value == lhs->value &&
+            !std::isalpha(secondParam->value[0])) {
+          insertUpdateValue(lhsSymbol, binOp->value,
+                            std::stoi(secondParam->value));
+          break;
+        }
         // variable alias as firstParam
         if (std::isalpha(firstParam->value[0])) {
           auto sym = symbolTable.findSymbol(firstParam->value, 0);
-          auto currentAllocationLevel = scopeId.top().first;
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
           // mov eax, [ebp - ebpOffset]
-          i_vector.push_back(
-              {std::byte(0x8B), std::byte(0x45), std::byte(variablePosition)});
+          assembler.mov(Reg(EAX, isWide(sym)), variable(sym));
         } else {
-          int rhsValue = std::stoi(firstParam->value);
-
-          i_vector.push_back({std::byte(0xB8)}); // mov eax, rhsValue
-          i_vector.push_back(i_vector.int_to_bytes(rhsValue));
+          // mov eax, rhsValue
+          assembler.mov(Reg(EAX), Imm(std::stoi(firstParam->value)));
         }
         if (std::isalpha(secondParam->value[0])) {
           auto sym = symbolTable.findSymbol(secondParam->value, 0);
-          auto currentAllocationLevel = scopeId.top().first;
-
-          unsigned int variablePosition = calculateVariablePositionOnStack(
-              sym, currentAllocationLevel, allocs);
 
           if (binOp->value == "+") {
-            auto sym = symbolTable.findSymbol(firstParam->value, 0);
+            auto firstSym = symbolTable.findSymbol(firstParam->value, 0);
             // stack grows downwards which means
             // that for pointer subtraction means addition and reverse
-            if (sym.type[0] == '^') {
-              auto sizeOf = typeSizeOfMap[sym.type];
-              for (int i = 0; i < sizeOf; ++i) {
-                i_vector.push_back({std::byte(0x2B), std::byte(0x45),
-                                    std::byte(variablePosition)});
-              }
+            if (firstSym.type[0] == '^') {
+              // sub eax, [ebp - ebpOffset] * sizeOf
+              insertPointerOffsetVariable(sym, typeSizeOf(firstSym.type),
+                                          AluOp::Sub, isWide(firstSym));
             } else {
               // add eax, [ebp - ebpOffset]
-              i_vector.push_back({std::byte(0x03), std::byte(0x45),
-                                  std::byte(variablePosition)});
+              assembler.add(Reg(EAX, isWide(sym)), variable(sym));
             }
           }
           if (binOp->value == "-") {
-            auto sym = symbolTable.findSymbol(firstParam->value, 0);
+            auto firstSym = symbolTable.findSymbol(firstParam->value, 0);
             // stack grows downwards which means
             // that for pointer subtraction means addition and reverse
-            if (sym.type[0] == '^') {
-              auto sizeOf = typeSizeOfMap[sym.type];
-              for (int i = 0; i < sizeOf; ++i) {
-                i_vector.push_back({std::byte(0x03), std::byte(0x45),
-                                    std::byte(variablePosition)});
-              }
+            if (firstSym.type[0] == '^') {
+              // add eax, [ebp - ebpOffset] * sizeOf
+              insertPointerOffsetVariable(sym, typeSizeOf(firstSym.type),
+                                          AluOp::Add, isWide(firstSym));
             } else {
               // sub eax, [ebp - ebpOffset]
-              i_vector.push_back({std::byte(0x2B), std::byte(0x45),
-                                  std::byte(variablePosition)});
+              assembler.sub(Reg(EAX, isWide(sym)), variable(sym));
             }
           }
           if (binOp->value == "*") {
             // imul        eax, dword ptr[ebp - ebpOffset]
-            i_vector.push_back({std::byte(0x0F), std::byte(0xAF),
-                                std::byte(0x45), std::byte(variablePosition)});
+            assembler.imul(Reg(EAX, isWide(sym)), variable(sym));
           }
           if (binOp->value == "/") {
-            // push ebx
-            i_vector.push_back({std::byte(0x53)});
             // cdq sign-extend EAX into EDX
-            i_vector.push_back({std::byte(0x99)});
-            // mov ebx, dword ptr[ebp - ebpOffset]
-            i_vector.push_back({std::byte(0x8B), std::byte(0x5D),
-                                std::byte(variablePosition)});
-            // idiv ebx
-            i_vector.push_back({std::byte(0xF7), std::byte(0xFB)});
-            // pop ebx
-            i_vector.push_back({std::byte(0x5B)});
-          }
-          if (binOp->value == "==") {
-            comparisonOperatorVariable(variablePosition, insertJNE);
-          }
-          if (binOp->value == "!=") {
-            comparisonOperatorVariable(variablePosition, insertJE);
-          }
-          if (binOp->value == "<") {
-            comparisonOperatorVariable(variablePosition, insertJNL);
-          }
-          if (binOp->value == ">") {
-            comparisonOperatorVariable(variablePosition, insertJNG);
-          }
-          if (binOp->value == ">=") {
-            comparisonOperatorVariable(variablePosition, insertJNGE);
-          }
-          if (binOp->value == "<=") {
-            comparisonOperatorVariable(variablePosition, insertJNLE);
+            assembler.cdq();
+            // idiv dword ptr[ebp - ebpOffset]
+            assembler.idiv(variable(sym));
           }
         } else {
           int rhsValue = std::stoi(secondParam->value);
@@ -472,14 +360,12 @@ struct Basicx86Emitter : public NullVisitor {
             // stack grows downwards which means
             // that for pointer subtraction means addition and reverse
             if (sym.type[0] == '^') {
-              auto sizeOf = typeSizeOfMap[sym.type];
-              for (int i = 0; i < sizeOf; ++i) {
-                i_vector.push_back({std::byte(0x2D)}); // sub eax, rhsValue
-                i_vector.push_back(i_vector.int_to_bytes(rhsValue));
-              }
+              auto sizeOf = typeSizeOf(sym.type);
+              // sub eax, rhsValue * sizeOf
+              assembler.sub(Reg(EAX, isWide(sym)), Imm(rhsValue * sizeOf));
             } else {
-              i_vector.push_back({std::byte(0x05)}); // add eax, rhsValue
-              i_vector.push_back(i_vector.int_to_bytes(rhsValue));
+              // add eax, rhsValue
+              assembler.add(Reg(EAX), Imm(rhsValue));
             }
           }
           if (binOp->value == "-") {
@@ -487,333 +373,576 @@ struct Basicx86Emitter : public NullVisitor {
             // stack grows downwards which means
             // that for pointer subtraction means addition and reverse
             if (sym.type[0] == '^') {
-              auto sizeOf = typeSizeOfMap[sym.type];
-              for (int i = 0; i < sizeOf; ++i) {
-                i_vector.push_back({std::byte(0x05)}); // add eax, rhsValue
-                i_vector.push_back(i_vector.int_to_bytes(rhsValue));
-              }
+              auto sizeOf = typeSizeOf(sym.type);
+              // add eax, rhsValue * sizeOf
+              assembler.add(Reg(EAX, isWide(sym)), Imm(rhsValue * sizeOf));
             } else {
-              i_vector.push_back({std::byte(0x2D)}); // sub eax, rhsValue
-              i_vector.push_back(i_vector.int_to_bytes(rhsValue));
+              // sub eax, rhsValue
+              assembler.sub(Reg(EAX), Imm(rhsValue));
             }
           }
           if (binOp->value == "*") {
-            // 69 C0 rhsValue  imul        eax, eax, rhsValue
-            i_vector.push_back({std::byte(0x69), std::byte(0xC0)});
-            i_vector.push_back(i_vector.int_to_bytes(rhsValue));
+            insertMulValue(rhsValue);
           }
           if (binOp->value == "/") {
-            // push ebx
-            i_vector.push_back({std::byte(0x53)});
+            assembler.push(Reg(EBX));
             // cdq sign-extend EAX into EDX
-            i_vector.push_back({std::byte(0x99)});
-            // mov ebx, rhsValue
-            i_vector.push_back({std::byte(0xBB)});
-            i_vector.push_back(i_vector.int_to_bytes(rhsValue));
-            // idiv ebx
-            i_vector.push_back({std::byte(0xF7), std::byte(0xFB)});
-            // pop ebx
-            i_vector.push_back({std::byte(0x5B)});
-          }
-          if (binOp->value == "==") {
-            comparisonOperatorValue(rhsValue, insertJNE);
-          }
-          if (binOp->value == "!=") {
-            comparisonOperatorValue(rhsValue, insertJE);
-          }
-          if (binOp->value == "<") {
-            comparisonOperatorValue(rhsValue, insertJNL);
-          }
-          if (binOp->value == ">") {
-            comparisonOperatorValue(rhsValue, insertJNG);
-          }
-          if (binOp->value == ">=") {
-            comparisonOperatorValue(rhsValue, insertJNGE);
-          }
-          if (binOp->value == "<=") {
-            comparisonOperatorValue(rhsValue, insertJNLE);
+            assembler.cdq();
+            assembler.mov(Reg(EBX), Imm(rhsValue));
+            assembler.idiv(Reg(EBX));
+            assembler.pop(Reg(EBX));
           }
         }
-        auto currentAllocationLevel = scopeId.top().first;
-        unsigned int variablePosition = calculateVariablePositionOnStack(
-            lhsSymbol, currentAllocationLevel, allocs);
         // mov [ebp - ebpOffset], eax
-        i_vector.push_back(
-            {std::byte(0x89), std::byte(0x45), std::byte(variablePosition)});
+        assembler.mov(variable(lhsSymbol), Reg(EAX, isWide(lhsSymbol)));
       }
       break;
     }
     }
   }
   void visitPost(const FunctionCall *fcall) {
-    // push params
-    // parameters are passed on the stack in reverse order from right to left
-    for (auto it = fcall->parameters.rbegin(); it != fcall->parameters.rend();
-         ++it) {
-      const auto &param = *it;
-      if (std::isdigit(param[0])) {
-        i_vector.push_back({std::byte(0x68)}); // push
-        i_vector.push_back(i_vector.int_to_bytes(std::stoi(param)));
-      }
-      if (std::isalpha(param[0])) {
-        // if it is not value check index on the stack
-        // and copy value that is indexed by this index
-        // FF 75 FC           push        dword ptr [ebp-4]
-        auto sym = symbolTable.findSymbol(param, 0);
-        auto currentAllocationLevel = scopeId.top().first;
-
-        unsigned int variablePosition = calculateVariablePositionOnStack(
-            sym, currentAllocationLevel, allocs);
-        i_vector.push_back(
-            {std::byte(0xFF), std::byte(0x75), std::byte(variablePosition)});
-      }
-    }
-
-    i_vector.push_back({std::byte(0xB8)}); // \  mov eax, address of function
-
     symbolTable.findSymbol(fcall->name, 0);
-
-    auto functionIterator = functionMap.find(fcall->name);
-
-    if (functionIterator != functionMap.end()) {
-      i_vector.push_back(i_vector.get_address(
-          reinterpret_cast<void *>(functionIterator->second)));
-    }
-    i_vector.push_back({std::byte(0xFF), std::byte(0xD0)}); // call eax
-
-    for (const auto &param : fcall->parameters) {
-      i_vector.push_back({std::byte(0x83), std::byte(0xC4),
-                          std::byte(0x04)}); // add esp, 4 (clean stack)
-    }
+    auto function = functionMap.find(fcall->name);
+    if (!function)
+      throw CodeEmitterException("unknown function : " + fcall->name);
+    checkArguments(*fcall, *function);
+    if (insertIntrinsic(*fcall, *function))
+      return;
+    insertCall(fcall->name, fcall->parameters, function->address);
   }
 
   void visitPre(const IfStatement *ifstatement) {
-    auto gotoStatement = cast<GotoStatement>(ifstatement->statements[0]);
-    gotoLabelsFromIf.insert(gotoStatement->label);
+    gotosFromIf.insert(ifstatement->statements[0].get());
   }
 
   void visitPost(const IfStatement *ifstatement) {
     auto gotoStatement = cast<GotoStatement>(ifstatement->statements[0]);
     auto conditionVariable =
         cast<BasicExpression>(ifstatement->condition.getChilds()[1]);
-
-    auto sym = symbolTable.findSymbol(conditionVariable->value, 0);
-    auto currentAllocationLevel = scopeId.top().first;
-    unsigned int variablePosition =
-        calculateVariablePositionOnStack(sym, currentAllocationLevel, allocs);
-    // pushf
-    // i_vector.push_back({ std::byte(0x66), std::byte(0x9C) });
-
-    // mov eax, 0
-    i_vector.push_back({std::byte(0xB8)});
-    i_vector.push_back(i_vector.int_to_bytes(0));
-
-    // cmp eax, dword ptr[ebp - ebpOffset]
-    i_vector.push_back(
-        {std::byte(0x3B), std::byte(0x45), std::byte(variablePosition)});
-
-    insertJE(i_vector);
-
-    // this is just a placeholder
-    constexpr auto labelOffset = 0;
-    i_vector.push_back({i_vector.int_to_bytes(labelOffset)});
-    auto pos = i_vector.size();
-
-    jumpTable.insert(std::make_pair(gotoStatement->label, pos));
+    auto target = assembler.label(gotoStatement->label);
+
+    if (pendingCondition != noCondition) {
+      // jump when fused comparison is false
+      assembler.jcc(negateCondition(pendingCondition), target);
+      pendingCondition = noCondition;
+    } else {
+      auto sym = symbolTable.findSymbol(conditionVariable->value, 0);
+      // cmp dword ptr[ebp - ebpOffset], 0
+      assembler.cmp(variable(sym), Imm(0));
+      assembler.jcc(conditionEqual, target);
+    }
   }
 
   void visitPre(const LabelStatement *stmt) {
-    labelToCodePosition[stmt->label] = i_vector.size();
-  }
-
-  void visitPost(const LabelStatement *stmt) {
-    constexpr size_t addressSize = 4;
-    // try to fix jumps
-    for (auto &element : jumpTable) {
-      if (element.first != stmt->label)
-        continue;
-      auto jumpOffset =
-          std::distance(i_vector.begin(),
-                        i_vector.begin() + i_vector.size() - element.second);
-      auto bytes = i_vector.int_to_bytes(jumpOffset);
-
-      for (size_t i = 0; i < addressSize; ++i) {
-        *(i_vector.begin() + element.second - addressSize + i) = bytes[i];
-      }
-      // popf
-      // i_vector.push_back({ std::byte(0x66), std::byte(0x9D) });
-    }
+    assembler.bind(assembler.label(stmt->label));
   }
 
   void visitPost(const GotoStatement *stmt) {
-    if (gotoLabelsFromIf.find(stmt->label) == gotoLabelsFromIf.end()) {
-
-      // std::cout << "current offset:" << i_vector.size() << std::endl;
-      // std::cout << "goto label:" << stmt->label << " << " <<
-      // labelToCodePosition[stmt->label] << std::endl;
-      X86InstrVector tmp_vector;
-      // jump is coded by e9 and four bytes for offset
-      constexpr auto sizeofJump = 5;
-      int offset =
-          labelToCodePosition[stmt->label] - sizeofJump - i_vector.size();
-
-      if (offset < 0) {
-        // negative offset jmp e9
-        // std::cout << "negative offset:" << offset << std::endl;
-        i_vector.push_back({std::byte(0xe9)});
-        i_vector.push_back(i_vector.int_to_bytes(offset));
-        // std::cout << "temp vector : " << tmp_vector.size() << std::endl;
-      } else {
-      }
-    }
+    // code for goto of if statement was generated with its condition
+    if (gotosFromIf.count(stmt))
+      return;
+    assembler.jmp(assembler.label(stmt->label));
   }
 
+  void visitPost(const ReturnStatement *stmt) {
+    // mov eax, value
+    insertLoadArgument(stmt->param, EAX);
+    assembler.jmp(assembler.label(returnLabel));
+    hasReturn = true;
+  }
+
+  bool returns() const { return hasReturn; }
+
   StatementList getStatements() const { return statements; }
 
+  LabelToCodePosition getLabelPositions() const {
+    return i_vector.label_positions();
+  }
+
 private:
   StatementList statements;
   BasicSymbolTable &symbolTable;
   X86InstrVector &i_vector;
-  size_t allocationLevel = 1;
-  std::map<size_t, size_t> allocationLevelIndex;
-  std::map<std::pair<size_t, size_t>, size_t> allocs;
-
-  // jumpTable contains a label as key and list of jmp instruction pointers
-  // these pointers point to placeholders at first and are fixed
-  // during label traversal
-  std::multimap<std::string, size_t> jumpTable;
+  X86Assembler assembler;
+  const FrameLayoutPass &frame;
 
-  // this set contains labels that are connected to if statements
-  // we have to omit them during visiting gotos as
-  // code for them was already generated during
-  // visiting if statement
-  GotoLabelsFromIf gotoLabelsFromIf;
+  // gotos that are part of if statements,
+  // jump for them is generated during visiting if statement
+  GotosFromIf gotosFromIf;
 
-  // each label points to specific position in code
-  LabelToCodePosition labelToCodePosition;
+  HostFunctions functionMap;
 
-  std::stack<std::pair<size_t, size_t>> scopeId;
+  RegisterAssignment registers;
 
-  // key is a pair that uniquely identifying scope
-  std::map<std::pair<size_t, size_t>, size_t> variable_position_on_stack_map;
+  // comparisons emitted as flags for if statement that follows them
+  std::set<const Statement *> fusedComparisons;
+  unsigned char pendingCondition = noCondition;
+  bool hasReturn = false;
 
-  std::map<std::string, void *> functionMap;
+  bool is64Bit() const { return i_vector.target() == Target::x86_64; }
 
-  void insertCmpVariable(unsigned int variablePosition) {
-    // cmp eax, dword ptr[ebp - ebpOffset]
-    i_vector.push_back(
-        {std::byte(0x3B), std::byte(0x45), std::byte(variablePosition)});
+  // pointers are 64 bit on x86-64, so operations on them need REX.W
+  bool isWide(const symbol &sym) const {
+    return is64Bit() && sym.type[0] == '^';
   }
-  void insertCmpValue(int value) {
-    // cmp eax, rhsValue
-    i_vector.push_back({std::byte(0x3D)});
-    i_vector.push_back(i_vector.int_to_bytes(value));
+  // pointer to pointer
+  bool isWidePointee(const symbol &sym) const {
+    return is64Bit() && sym.type.size() > 1 && sym.type[1] == '^';
   }
 
-  static void insertJG(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x8F)});
-  }
-  static void insertJNG(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x8E)});
-  }
-  static void insertJNL(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x8D)});
+  // variable operand, either register assigned by allocator
+  // or [ebp - ebpOffset]
+  RegMem variable(const symbol &sym) const {
+    return variable(sym, isWide(sym));
   }
-  static void insertJE(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x84)});
+  RegMem variable(const symbol &sym, bool wide) const {
+    if (sym.register_id != noRegister)
+      return Reg(sym.register_id, wide);
+    return Mem(EBP, sym.stack_position, wide);
   }
-  static void insertJNE(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x85)});
-  }
-  static void insertJNLE(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x8F)});
+
+  // arguments have to match signature of host function, if it's known,
+  // pointer can be passed as int (it's truncated on x86-64),
+  // but int variable can't be passed as pointer
+  void checkArguments(const FunctionCall &fcall,
+                      const HostFunction &function) {
+    if (!function.hasSignature)
+      return;
+    if (fcall.parameters.size() != function.parameters.size())
+      throw CodeEmitterException("wrong number of arguments : " + fcall.name);
+    for (size_t i = 0; i < fcall.parameters.size(); ++i) {
+      const auto &param = fcall.parameters[i];
+      if (std::isalpha(param[0]) &&
+          function.parameters[i] == ParameterKind::Pointer &&
+          symbolTable.findSymbol(param, 0).type[0] != '^')
+        throw CodeEmitterException("argument is not a pointer : " + param);
+    }
   }
-  static void insertJNGE(X86InstrVector &i_vector) {
-    i_vector.push_back({std::byte(0x0F), std::byte(0x8C)});
+
+  void insertCall(const std::string &name,
+                  const std::vector<std::string> &arguments,
+                  const void *address) {
+    if (is64Bit())
+      insertSystemVCall(name, arguments, address);
+    else
+      insertCdeclCall(arguments, address);
   }
 
-  void comparisonOperatorVariable(
-      unsigned int variablePosition,
-      std::function<void(X86InstrVector &i_vector)> operatorOpcode) {
-    // pushf
-    i_vector.push_back({std::byte(0x66), std::byte(0x9C)});
+  // System V passes first six integer arguments in registers
+  // and needs stack aligned to 16 bytes, which prolog guarantees.
+  // Allocator never keeps variable used by call in a caller saved
+  // register, so arguments can be moved without a conflict.
+  void insertSystemVCall(const std::string &name,
+                         const std::vector<std::string> &arguments,
+                         const void *address) {
+    if (arguments.size() > std::size(systemVArgumentRegisters))
+      throw CodeEmitterException("too many arguments : " + name);
+    for (size_t i = 0; i < arguments.size(); ++i)
+      insertLoadArgument(arguments[i], systemVArgumentRegisters[i]);
+    // call rel32
+    assembler.call(address);
+  }
 
-    insertCmpVariable(variablePosition);
+  void insertCdeclCall(const std::vector<std::string> &arguments,
+                       const void *address) {
+    // push params
+    // parameters are passed on the stack in reverse order from right to left
+    for (auto it = arguments.rbegin(); it != arguments.rend(); ++it) {
+      const auto &param = *it;
+      if (std::isdigit(param[0]))
+        assembler.push(Imm(std::stoi(param)));
+      if (std::isalpha(param[0])) {
+        // if it is not value check index on the stack
+        // and copy value that is indexed by this index
+        // FF 75 FC           push        dword ptr [ebp-4]
+        assembler.push(variable(symbolTable.findSymbol(param, 0)));
+      }
+    }
 
-    constexpr auto value0Offset = 10;
-    operatorOpcode(i_vector);
+    // call rel32
+    assembler.call(address);
 
-    i_vector.push_back(
-        {i_vector.int_to_bytes(value0Offset)}); // omit next 10 bytes
-    // label_value_1:
-    // mov eax,1
-    i_vector.push_back({std::byte(0xB8)});
-    i_vector.push_back(i_vector.int_to_bytes(1));
+    // add esp, 4 * number of params (clean stack)
+    if (!arguments.empty())
+      assembler.add(Reg(ESP), Imm(static_cast<int>(4 * arguments.size())));
+  }
 
-    // jump 5 bytes
-    constexpr auto endOffset = 5;
-    i_vector.push_back({std::byte(0xE9)});
-    i_vector.push_back(i_vector.int_to_bytes(endOffset));
-    // label_value_0 :
-    i_vector.push_back({std::byte(0xB8)});
-    i_vector.push_back(i_vector.int_to_bytes(0));
+  // mov reg, [ebp - ebpOffset] / value
+  void insertLoadArgument(const std::string &param, int reg) {
+    if (std::isalpha(param[0])) {
+      auto sym = symbolTable.findSymbol(param, 0);
+      assembler.mov(Reg(reg, isWide(sym)), variable(sym));
+      return;
+    }
+    assembler.mov(Reg(reg), Imm(std::stoi(param)));
+  }
 
-    // popf
-    i_vector.push_back({std::byte(0x66), std::byte(0x9D)});
+  // Expands builtin with known semantics inline, returns false when
+  // it has to be called. Arguments were checked against its signature.
+  bool insertIntrinsic(const FunctionCall &fcall,
+                       const HostFunction &function) {
+    const auto &arguments = fcall.parameters;
+    switch (function.intrinsic) {
+    case Intrinsic::StoreZero:
+      // mov eax, p
+      insertLoadArgument(arguments[0], EAX);
+      // mov dword ptr [eax], 0
+      assembler.mov(Mem(EAX), Imm(0));
+      return true;
+    case Intrinsic::Allocate:
+      if (!function.implementation)
+        return false;
+      // eax = implementation(size)
+      insertCall(fcall.name, {arguments[0]}, function.implementation);
+      // mov edx, out
+      insertLoadArgument(arguments[1], EDX);
+      // mov [edx], eax
+      assembler.mov(Mem(EDX, 0, is64Bit()), Reg(EAX, is64Bit()));
+      return true;
+    case Intrinsic::Release: {
+      if (!function.implementation)
+        return false;
+      // null pointer is not released
+      auto skip = assembler.label();
+      insertLoadArgument(arguments[0], EAX);
+      assembler.cmp(Reg(EAX, is64Bit()), Imm(0));
+      assembler.jcc(conditionEqual, skip);
+      insertCall(fcall.name, arguments, function.implementation);
+      assembler.bind(skip);
+      return true;
+    }
+    case Intrinsic::None:
+      break;
+    }
+    return false;
   }
 
-  void comparisonOperatorValue(
-      int value, std::function<void(X86InstrVector &i_vector)> operatorOpcode) {
-    // pushf
-    i_vector.push_back({std::byte(0x66), std::byte(0x9C)});
+  // var = var op value
+  void insertUpdateValue(const symbol &sym, const std::string &op, int value) {
+    // stack grows downwards, for pointers addition means subtraction
+    bool isPointer = sym.type[0] == '^';
+    if (isPointer)
+      value *= typeSizeOf(sym.type);
+    // add/sub [ebp - ebpOffset], value
+    assembler.alu((op == "+") != isPointer ? AluOp::Add : AluOp::Sub,
+                  variable(sym), Imm(value));
+  }
 
-    insertCmpValue(value);
+  // returns k when value is 2^k, otherwise -1
+  static int log2OfValue(int value) {
+    if (value <= 0 || (value & (value - 1)) != 0)
+      return -1;
+    int k = 0;
+    while ((1 << k) != value)
+      ++k;
+    return k;
+  }
 
-    constexpr auto value0Offset = 10;
-    operatorOpcode(i_vector);
+  void insertMulValue(int value) {
+    auto shift = log2OfValue(value);
+    if (shift == 0)
+      return;
+    if (shift > 0) {
+      // shl eax, shift
+      assembler.shl(Reg(EAX), Imm(shift));
+      return;
+    }
+    // lea eax, [eax + eax * scale] for 3, 5 and 9
+    if (value == 3 || value == 5 || value == 9) {
+      assembler.lea(Reg(EAX), Mem(EAX, EAX, value - 1, 0));
+      return;
+    }
+    // imul        eax, eax, value
+    assembler.imul(Reg(EAX), Reg(EAX), Imm(value));
+  }
 
-    i_vector.push_back(
-        {i_vector.int_to_bytes(value0Offset)}); // omit next 10 bytes
-    // label_value_1:
-    // mov eax,1
-    i_vector.push_back({std::byte(0xB8)});
-    i_vector.push_back(i_vector.int_to_bytes(1));
+  // eax = eax op [ebp - ebpOffset] * sizeOf
+  // where op is either add or sub
+  // wide pointer needs offset sign extended to 64 bits
+  void insertPointerOffsetVariable(const symbol &sym, int sizeOf, AluOp op,
+                                   bool wide) {
+    if (wide && !isWide(sym)) {
+      // movsxd rdx, [ebp - ebpOffset]
+      assembler.movsxd(Reg(EDX), variable(sym));
+    } else {
+      // mov edx, [ebp - ebpOffset]
+      assembler.mov(Reg(EDX, isWide(sym)), variable(sym));
+    }
+    auto shift = log2OfValue(sizeOf);
+    if (shift > 0) {
+      // shl edx, shift
+      assembler.shl(Reg(EDX, wide), Imm(shift));
+    } else if (shift < 0) {
+      // imul edx, edx, sizeOf
+      assembler.imul(Reg(EDX, wide), Reg(EDX, wide), Imm(sizeOf));
+    }
+    // add/sub eax, edx
+    assembler.alu(op, Reg(EAX, wide), RegMem(Reg(EDX, wide)));
+  }
 
-    // jump 5 bytes
-    constexpr auto endOffset = 5;
-    i_vector.push_back({std::byte(0xE9)});
-    i_vector.push_back(i_vector.int_to_bytes(endOffset));
-    // label_value_0 :
-    i_vector.push_back({std::byte(0xB8)});
-    i_vector.push_back(i_vector.int_to_bytes(0));
+  void insertSetCondition(unsigned char condition) {
+    // setcc al
+    assembler.setcc(condition, Reg(EAX));
+    // movzx eax, al
+    assembler.movzxByte(Reg(EAX), Reg(EAX));
+  }
 
-    // popf
-    i_vector.push_back({std::byte(0x66), std::byte(0x9D)});
+  // sets flags for first - second
+  void insertComparison(const std::string &first, const std::string &second) {
+    bool wide = (std::isalpha(first[0]) &&
+                 isWide(symbolTable.findSymbol(first, 0))) ||
+                (std::isalpha(second[0]) &&
+                 isWide(symbolTable.findSymbol(second, 0)));
+    if (std::isalpha(first[0]) && !std::isalpha(second[0])) {
+      // cmp dword ptr[ebp - ebpOffset], value
+      assembler.cmp(variable(symbolTable.findSymbol(first, 0), wide),
+                    Imm(std::stoi(second)));
+      return;
+    }
+    if (std::isalpha(first[0])) {
+      // mov eax, [ebp - ebpOffset]
+      assembler.mov(Reg(EAX, wide),
+                    variable(symbolTable.findSymbol(first, 0), wide));
+    } else {
+      // mov eax, value
+      assembler.mov(Reg(EAX), Imm(std::stoi(first)));
+    }
+    if (std::isalpha(second[0])) {
+      // cmp eax, dword ptr[ebp - ebpOffset]
+      assembler.cmp(Reg(EAX, wide),
+                    variable(symbolTable.findSymbol(second, 0), wide));
+    } else {
+      // cmp eax, value
+      assembler.cmp(Reg(EAX, wide), Imm(std::stoi(second)));
+    }
   }
 };
 
-auto emitMachineCode(const StatementList &statements,
-                     const std::map<std::string, void *> &functionMap) {
-  X86InstrVector i_vector;
-  i_vector.push_function_prolog();
+// upper estimate of code size of one flattened statement,
+// used to reserve code buffer up front
+constexpr size_t bytesPerStatement = 32;
+
+// System V requires stack aligned to 16 bytes at calls,
+// return address and saved rbp take 16 bytes, so frame together with
+// saved registers has to be multiple of 16
+size_t alignedFrameSize(size_t frameSize, size_t savedRegisters,
+                        Target target) {
+  if (target != Target::x86_64)
+    return frameSize;
+  auto size = frameSize + savedRegisters * 8;
+  return (size + 15) / 16 * 16 - savedRegisters * 8;
+}
+
+// index of label statement, statements.size() when there is none
+size_t findLabel(const StatementList &statements, const std::string &label) {
+  for (size_t i = 0; i < statements.size(); ++i) {
+    if (is<LabelStatement>(statements[i]) &&
+        cast<LabelStatement>(statements[i])->label == label)
+      return i;
+  }
+  return statements.size();
+}
+
+// declarations of parameters, first variable of each name
+std::vector<const Statement *>
+findParameters(const StatementList &statements,
+               const std::vector<std::string> &parameters) {
+  std::vector<const Statement *> declarations;
+  for (const auto &parameter : parameters) {
+    auto decl = std::find_if(
+        statements.begin(), statements.end(), [&](const StatementPtr &stmt) {
+          return is<VarDecl>(stmt) && cast<VarDecl>(stmt)->var_name == parameter;
+        });
+    if (decl == statements.end())
+      throw CodeEmitterException("undeclared parameter : " + parameter);
+    declarations.push_back(decl->get());
+  }
+  return declarations;
+}
+
+// Code of a program, a loop entry or a function, see emitMachineCode
+// and emitFunctionCode
+X86InstrVector emitCode(const StatementList &statements,
+                        const HostFunctions &functionMap, Target target,
+                        const std::string &entryLabel,
+                        const std::vector<std::string> &parameters,
+                        bool isFunction, CodeHeap *heap) {
+  X86InstrVector i_vector(target);
+  i_vector.reserve((statements.size() + 1) * bytesPerStatement);
+  X86Assembler assembler(i_vector);
   BasicSymbolTable symbolTable;
 
   for (const auto &function : functionMap) {
     symbolTable.insertSymbol(function.first, "function");
   }
 
-  PreAllocationPass preallocPass;
-  traverse(statements, preallocPass);
+  FrameLayoutPass frameLayout(target);
+  {
+    PassTimer timer("frame layout");
+    traverse(statements, frameLayout);
+  }
+
+  {
+    PassTimer timer("semantic check");
+    SemanticChecker semaChecker;
+    traverse(statements, semaChecker);
+  }
+
+  PassTimer allocation("register allocation");
+  LinearScanAllocator allocator(statements, target);
+  auto registers = allocator.run();
+  allocation.count(registers.size(), "registers");
+  allocation.stop();
+  std::set<const Statement *> fusedComparisons;
+  for (auto index : findFusedComparisons(statements))
+    fusedComparisons.insert(statements[index].get());
+  // callee saved registers are preserved for the caller
+  std::set<int> savedRegisters;
+  for (const auto &reg : registers) {
+    if (isCalleeSaved(reg.second, target))
+      savedRegisters.insert(reg.second);
+  }
+  bool isEntry = !entryLabel.empty();
+  auto frameSize = alignedFrameSize(isEntry ? 0 : frameLayout.getFrameSize(),
+                                    savedRegisters.size(), target);
+
+  // variables kept in registers and live at statement are loaded
+  // from their slots
+  auto loadRegisters = [&](size_t index) {
+    for (auto decl : allocator.liveAt(index)) {
+      auto varDecl = static_cast<const VarDecl *>(decl);
+      bool wide = target == Target::x86_64 && varDecl->type[0] == '^';
+      // mov reg, [ebp - ebpOffset]
+      assembler.mov(Reg(registers.at(decl), wide),
+                    Mem(EBP, frameLayout.offsetOf(decl), wide));
+    }
+  };
+
+  if (isEntry) {
+    auto entry = findLabel(statements, entryLabel);
+    if (entry == statements.size())
+      throw CodeEmitterException("undefined label : " + entryLabel);
+    if (target == Target::x86_64) {
+      // push rbp
+      assembler.push(Reg(EBP));
+      // mov rbp, rdi
+      assembler.mov(Reg(EBP, true), Reg(EDI, true));
+    } else {
+      // mov eax, [esp + 4]
+      assembler.mov(Reg(EAX), Mem(ESP, 4));
+      // push ebp
+      assembler.push(Reg(EBP));
+      // mov ebp, eax
+      assembler.mov(Reg(EBP), Reg(EAX));
+    }
+    // only alignment of stack
+    if (frameSize > 0)
+      assembler.sub(Reg(ESP, true), Imm(static_cast<int>(frameSize)));
+    for (auto reg : savedRegisters)
+      assembler.push(Reg(reg));
+    loadRegisters(entry);
+    assembler.jmp(assembler.label(entryLabel));
+  } else {
+    i_vector.push_function_prolog();
+    // sub esp, frameSize
+    if (frameSize > 0)
+      assembler.sub(Reg(ESP, true), Imm(static_cast<int>(frameSize)));
+    for (auto reg : savedRegisters)
+      assembler.push(Reg(reg));
+  }
 
-  SemanticChecker semaChecker;
-  traverse(statements, semaChecker);
+  if (isFunction) {
+    auto declarations = findParameters(statements, parameters);
+    if (target == Target::x86_64 &&
+        parameters.size() > std::size(systemVArgumentRegisters))
+      throw CodeEmitterException("too many parameters");
+    // arguments are stored to slots of parameters first,
+    // registers of parameters may be argument registers
+    for (size_t i = 0; i < declarations.size(); ++i) {
+      auto slot = Mem(EBP, frameLayout.offsetOf(declarations[i]));
+      if (target == Target::x86_64) {
+        // mov [rbp - ebpOffset], argument register
+        assembler.mov(slot, Reg(systemVArgumentRegisters[i]));
+      } else {
+        // mov eax, [ebp + 8 + 4 * i]
+        assembler.mov(Reg(EAX), Mem(EBP, static_cast<int>(8 + 4 * i)));
+        // mov [ebp - ebpOffset], eax
+        assembler.mov(slot, Reg(EAX));
+      }
+    }
+    loadRegisters(0);
+  }
 
-  Basicx86Emitter visitor(i_vector, preallocPass.getAllocationVector(),
-                          symbolTable, functionMap);
+  Basicx86Emitter visitor(i_vector, frameLayout, symbolTable, functionMap,
+                          registers, fusedComparisons);
 
-  traverse(statements, visitor);
+  {
+    PassTimer timer("x86 emitter");
+    traverse(statements, visitor);
+    timer.count(i_vector.size(), "bytes");
+  }
 
+  // function that ends without return statement returns 0
+  if (isFunction)
+    assembler.mov(Reg(EAX), Imm(0));
+  if (visitor.returns())
+    assembler.bind(assembler.label(returnLabel));
+
+  auto unboundLabels = i_vector.unbound_labels();
+  if (!unboundLabels.empty())
+    throw CodeEmitterException("undefined label : " + unboundLabels.front());
+
+  for (auto it = savedRegisters.rbegin(); it != savedRegisters.rend(); ++it)
+    assembler.pop(Reg(*it));
+  if (frameSize > 0) {
+    // frame of entry is not on the stack
+    if (isEntry)
+      // add esp, frameSize
+      assembler.add(Reg(ESP, true), Imm(static_cast<int>(frameSize)));
+    else
+      // mov esp, ebp
+      assembler.mov(Reg(ESP, true), Reg(EBP, true));
+  }
   i_vector.push_function_epilog();
 
-  return i_vector;
+  PassTimer timer("peephole");
+  PeepholeOptimizer peephole(i_vector, visitor.getLabelPositions());
+  auto code = peephole.run(heap);
+  code.emit_literal_pool();
+  timer.count(code.size(), "bytes");
+  return code;
+}
+
+// Machine code of the program, either entered from its beginning as
+//   int program()
+// or, when entry label is given, at that label with frame of the caller
+// laid out by FrameLayoutPass (e.g. interpreter frame for OSR)
+//   int program(std::byte *framePointer)
+// Such code doesn't reserve its frame, it loads variables kept
+// in registers and live at the label from their slots and jumps there.
+// Result is the value of return statement, undefined without one.
+// Final code is emitted into code heap when it's given, so JitCompiler
+// can make it executable in place.
+X86InstrVector emitMachineCode(const StatementList &statements,
+                               const HostFunctions &functionMap,
+                               Target target = hostTarget,
+                               const std::string &entryLabel = {},
+                               CodeHeap *heap = nullptr) {
+  return emitCode(statements, functionMap, target, entryLabel, {}, false,
+                  heap);
+}
+
+// Machine code of a function called by calling convention of target
+// (cdecl on x86, System V on x86-64)
+//   int function(int, int, ...)
+// Parameters are variables declared in statements, arguments are
+// stored to their slots in prolog. Function returns value of return
+// statement or 0 when it ends without one.
+X86InstrVector emitFunctionCode(const StatementList &statements,
+                                const std::vector<std::string> &parameters,
+                                const HostFunctions &functionMap,
+                                Target target = hostTarget,
+                                CodeHeap *heap = nullptr) {
+  return emitCode(statements, functionMap, target, {}, parameters, true,
+                  heap);
 }
@@ -0,0 +1,300 @@
+#pragma once
+
+// CodeHeap places compiled code into executable memory. Memory is mapped
+// in large chunks and code of many programs is sub-allocated from them,
+// so compiling doesn't cost a system mapping each time.
+//
+// Memory is never writable and executable at once (W^X): block is
+// writable after allocate, makeExecutable turns it to read and execute
+// and released block is inaccessible until it's allocated again.
+// Blocks are rounded to whole pages, so changing protection of one block
+// never affects code of another one.
+//
+//   auto code = heap.allocate(size);     // writable
+//   std::memcpy(code, bytes, size);
+//   heap.makeExecutable(code);           // executable, read only
+//   ...
+//   heap.release(code);                  // space is reused
+//
+// Chunk that becomes empty is unmapped, unless it's the only one.
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum class MemoryProtection { None, ReadWrite, ReadExecute };
+
+size_t systemPageSize() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// readable and writable memory, nullptr when it can't be mapped
+std::byte *mapMemory(size_t size, bool hugePages) {
+#ifdef _WIN32
+  (void)hugePages;
+  return static_cast<std::byte *>(
+      VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return nullptr;
+#ifdef MADV_HUGEPAGE
+  // only a hint, kernel backs chunk by transparent huge pages
+  // where protection of its pages doesn't differ
+  if (hugePages)
+    madvise(memory, size, MADV_HUGEPAGE);
+#else
+  (void)hugePages;
+#endif
+  return static_cast<std::byte *>(memory);
+#endif
+}
+
+void unmapMemory(std::byte *memory, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  VirtualFree(memory, 0, MEM_RELEASE);
+#else
+  munmap(memory, size);
+#endif
+}
+
+bool protectMemory(std::byte *memory, size_t size,
+                   MemoryProtection protection) {
+#ifdef _WIN32
+  DWORD flags = PAGE_NOACCESS;
+  if (protection == MemoryProtection::ReadWrite)
+    flags = PAGE_READWRITE;
+  if (protection == MemoryProtection::ReadExecute)
+    flags = PAGE_EXECUTE_READ;
+  DWORD previous;
+  return VirtualProtect(memory, size, flags, &previous) != 0;
+#else
+  int flags = PROT_NONE;
+  if (protection == MemoryProtection::ReadWrite)
+    flags = PROT_READ | PROT_WRITE;
+  if (protection == MemoryProtection::ReadExecute)
+    flags = PROT_READ | PROT_EXEC;
+  return mprotect(memory, size, flags) == 0;
+#endif
+}
+
+struct CodeHeapException : public std::runtime_error {
+  CodeHeapException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+struct CodeHeapOptions {
+  // size of a single mapping, larger code gets chunk of its own
+  size_t chunkSize = 1 << 20;
+  // back chunks by huge pages when system allows it
+  bool hugePages = false;
+};
+
+struct CodeHeap {
+  explicit CodeHeap(CodeHeapOptions heapOptions = {})
+      : options(heapOptions), pageSize(systemPageSize()) {}
+  CodeHeap(const CodeHeap &) = delete;
+  CodeHeap &operator=(const CodeHeap &) = delete;
+
+  ~CodeHeap() {
+    for (const auto &chunk : chunks)
+      unmapMemory(chunk.second.base, chunk.second.size);
+  }
+
+  // writable block of at least given size
+  std::byte *allocate(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size = roundToPages(size == 0 ? 1 : size);
+    for (auto &chunk : chunks) {
+      if (auto block = takeFreeBlock(chunk.second, size))
+        return block;
+    }
+    auto &chunk = mapChunk(std::max(size, roundToPages(options.chunkSize)));
+    return takeFreeBlock(chunk, size);
+  }
+
+  // block becomes read only and executable
+  void makeExecutable(std::byte *block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!protectMemory(block, allocations.at(block),
+                       MemoryProtection::ReadExecute))
+      throw CodeHeapException("code can't be made executable");
+  }
+
+  // block can't be used after it's released
+  void release(std::byte *block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto allocation = allocations.find(block);
+    if (allocation == allocations.end())
+      return;
+    auto size = allocation->second;
+    allocations.erase(allocation);
+    usedBytes -= size;
+    protectMemory(block, size, MemoryProtection::None);
+
+    auto &chunk = chunkOf(block);
+    auto offset = static_cast<size_t>(block - chunk.base);
+    // merge with neighbouring free blocks
+    auto next = chunk.freeBlocks.lower_bound(offset);
+    if (next != chunk.freeBlocks.end() && offset + size == next->first) {
+      size += next->second;
+      next = chunk.freeBlocks.erase(next);
+    }
+    if (next != chunk.freeBlocks.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        offset = previous->first;
+        size += previous->second;
+        chunk.freeBlocks.erase(previous);
+      }
+    }
+    chunk.freeBlocks[offset] = size;
+
+    if (size == chunk.size && chunks.size() > 1) {
+      auto base = chunk.base;
+      unmapMemory(base, chunk.size);
+      mappedBytes -= chunk.size;
+      chunks.erase(base);
+    }
+  }
+
+  // bytes of all mappings
+  size_t getMappedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return mappedBytes;
+  }
+  // bytes of allocated blocks
+  size_t getUsedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return usedBytes;
+  }
+  size_t getChunkCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return chunks.size();
+  }
+
+private:
+  struct Chunk {
+    std::byte *base;
+    size_t size;
+    // offset of free block and its size
+    std::map<size_t, size_t> freeBlocks;
+  };
+
+  CodeHeapOptions options;
+  size_t pageSize;
+  mutable std::mutex mutex;
+  // chunks by their base address
+  std::map<std::byte *, Chunk> chunks;
+  // allocated blocks with their sizes
+  std::map<std::byte *, size_t> allocations;
+  size_t mappedBytes = 0;
+  size_t usedBytes = 0;
+
+  size_t roundToPages(size_t size) const {
+    return (size + pageSize - 1) / pageSize * pageSize;
+  }
+
+  Chunk &mapChunk(size_t size) {
+    auto base = mapMemory(size, options.hugePages);
+    if (!base)
+      throw CodeHeapException("executable memory can't be mapped");
+    // free space is inaccessible
+    protectMemory(base, size, MemoryProtection::None);
+    mappedBytes += size;
+    auto &chunk = chunks[base];
+    chunk = Chunk{base, size, {{0, size}}};
+    return chunk;
+  }
+
+  Chunk &chunkOf(std::byte *block) {
+    return std::prev(chunks.upper_bound(block))->second;
+  }
+
+  // first fit, nullptr when chunk has no block large enough
+  std::byte *takeFreeBlock(Chunk &chunk, size_t size) {
+    for (auto it = chunk.freeBlocks.begin(); it != chunk.freeBlocks.end();
+         ++it) {
+      if (it->second < size)
+        continue;
+      auto offset = it->first;
+      auto remaining = it->second - size;
+      chunk.freeBlocks.erase(it);
+      if (remaining > 0)
+        chunk.freeBlocks[offset + size] = remaining;
+      auto block = chunk.base + offset;
+      if (!protectMemory(block, size, MemoryProtection::ReadWrite))
+        throw CodeHeapException("code can't be made writable");
+      allocations[block] = size;
+      usedBytes += size;
+      return block;
+    }
+    return nullptr;
+  }
+};
+
+// heap used by JitCompiler unless it's given another one
+CodeHeap &defaultCodeHeap() {
+  static CodeHeap heap;
+  return heap;
+}
+
+// Allocator of code bytes, which places them straight into a writable
+// block of code heap, so code can be made executable where it was
+// emitted. Without heap it uses ordinary memory.
+template <typename T> struct CodeHeapAllocator {
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+
+  CodeHeapAllocator(CodeHeap *codeHeap = nullptr) noexcept : heap(codeHeap) {}
+  template <typename U>
+  CodeHeapAllocator(const CodeHeapAllocator<U> &other) noexcept
+      : heap(other.heap) {}
+
+  T *allocate(size_t n) {
+    if (!heap)
+      return std::allocator<T>().allocate(n);
+    return reinterpret_cast<T *>(heap->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *memory, size_t n) {
+    if (!heap) {
+      std::allocator<T>().deallocate(memory, n);
+      return;
+    }
+    heap->release(reinterpret_cast<std::byte *>(memory));
+  }
+
+  CodeHeap *heap;
+};
+
+template <typename T, typename U>
+bool operator==(const CodeHeapAllocator<T> &lhs,
+                const CodeHeapAllocator<U> &rhs) {
+  return lhs.heap == rhs.heap;
+}
+
+template <typename T, typename U>
+bool operator!=(const CodeHeapAllocator<T> &lhs,
+                const CodeHeapAllocator<U> &rhs) {
+  return lhs.heap != rhs.heap;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+// CompileService compiles programs on a pool of worker threads, so the
+// caller doesn't wait for parser and code generator. It gets a handle
+// at once and keeps running the program another way, in interpreter or
+// from code cache, until machine code is ready:
+//
+//   CompileService service(functions);
+//   auto handle = service.compile(source);
+//   ...
+//   if (handle.isReady())
+//     handle.entry()();        // native
+//   else
+//     eval(statements, functions);
+//
+// Every job has its own parser, passes and emitter. They share only
+// read only tables and the code heap, which is synchronized.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ast.h"
+#include "compiler.h"
+#include "inliner.h"
+#include "cfg_flatten.h"
+#include "optimizer.h"
+#include "host_functions.h"
+#include "code_heap.h"
+#include "code_emitter.h"
+#include "jitcompiler.h"
+
+// Executable code of a compiled program, released when the last handle
+// referring to it is gone.
+struct CompiledProgram {
+  CompiledProgram(X86InstrVector &&code, CodeHeap &heap,
+                  const std::string &name)
+      : jit(std::move(code), heap), entry(jit.compile(name)) {}
+
+  JitCompiler jit;
+  JitCompiler::pfunc entry;
+};
+
+using CompiledProgramPtr = std::shared_ptr<CompiledProgram>;
+
+struct CompileHandle {
+  CompileHandle() = default;
+  explicit CompileHandle(std::shared_future<CompiledProgramPtr> future)
+      : result(std::move(future)) {}
+
+  // false for default constructed handle
+  bool isValid() const { return result.valid(); }
+
+  bool isReady() const {
+    return result.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  void wait() const { result.wait(); }
+
+  // waits for the program, rethrows error of its compilation
+  JitCompiler::pfunc entry() const { return result.get()->entry; }
+
+  // entry point, nullptr while program is being compiled
+  JitCompiler::pfunc tryEntry() const {
+    return isReady() ? entry() : nullptr;
+  }
+
+private:
+  std::shared_future<CompiledProgramPtr> result;
+};
+
+// leaves a core to thread which runs programs
+size_t defaultCompileWorkers() {
+  auto cores = static_cast<size_t>(std::thread::hardware_concurrency());
+  return cores > 1 ? cores - 1 : 1;
+}
+
+struct CompileService {
+  explicit CompileService(const HostFunctions &functions,
+                          size_t workers = defaultCompileWorkers(),
+                          CodeHeap &codeHeap = defaultCodeHeap())
+      : functionMap(functions), heap(codeHeap) {
+    for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i)
+      threads.emplace_back([this] { work(); });
+  }
+  CompileService(const CompileService &) = delete;
+  CompileService &operator=(const CompileService &) = delete;
+
+  // jobs already queued are finished, so no handle is left without result
+  ~CompileService() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  // parses, inlines, flattens and optimizes source like driver does,
+  // syntax error is rethrown by the handle as CompileException
+  CompileHandle compile(std::string source, std::string name = "<source>") {
+    return submit([this, source = std::move(source),
+                   name = std::move(name)]() mutable {
+      FunctionInliner inliner(parseSource(std::move(source), name));
+      CFGFlattener visitor;
+      traverse(inliner.run(), visitor);
+      return emit(optimize(visitor.getStatements()), {}, name);
+    });
+  }
+
+  // Compiles flattened statements, which must not be modified until
+  // program is compiled. Entry label gives code entered at that label
+  // with frame of the interpreter (see emitMachineCode).
+  CompileHandle compile(StatementList statements,
+                        std::string entryLabel = {}) {
+    return submit([this, statements = std::move(statements),
+                   entryLabel = std::move(entryLabel)] {
+      return emit(statements, entryLabel,
+                  entryLabel.empty() ? "program" : "program@" + entryLabel);
+    });
+  }
+
+  size_t getWorkerCount() const { return threads.size(); }
+
+  // jobs waiting for a worker
+  size_t getQueuedJobs() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size();
+  }
+
+private:
+  const HostFunctions functionMap;
+  CodeHeap &heap;
+  mutable std::mutex mutex;
+  std::condition_variable wakeUp;
+  std::deque<std::packaged_task<CompiledProgramPtr()>> jobs;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+
+  CompiledProgramPtr emit(const StatementList &statements,
+                          const std::string &entryLabel,
+                          const std::string &name) {
+    return std::make_shared<CompiledProgram>(
+        emitMachineCode(statements, functionMap, hostTarget, entryLabel,
+                        &heap),
+        heap, name);
+  }
+
+  template <typename Job> CompileHandle submit(Job job) {
+    std::packaged_task<CompiledProgramPtr()> task(std::move(job));
+    CompileHandle handle(task.get_future().share());
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(task));
+    }
+    wakeUp.notify_one();
+    return handle;
+  }
+
+  void work() {
+    for (;;) {
+      std::packaged_task<CompiledProgramPtr()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeUp.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      // exception of the job is stored in its future
+      job();
+    }
+  }
+};
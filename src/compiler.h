@@ -9,6 +9,7 @@
 #include "dparse.h"
 #include "ast.h"
 #include "astvisitor.h"
+#include "nullvisitor.h"
 #include <cstring>
 
 constexpr size_t MAX_LINE_LENGTH = 44; /* must be at least 4 */
@@ -279,19 +280,30 @@ public:
   FileNotFoundException(const char *what) : std::runtime_error(what) {}
 };
 
-StatementList parse(D_Parser *p, char *begin, char *end, AstVisitor &visitor) {
+// AST of parse tree produced by dparse
+StatementList buildAst(D_ParseNode *pn, AstVisitor &visitor) {
   StatementList statementList;
-  auto pn = dparse(p, begin, std::distance(begin, end));
-  if (p->syntax_errors) {
-    printf("compilation failure %d %s\n", p->loc.line, p->loc.pathname);
-    return statementList;
-  }
   size_t scope = 0;
   print_parsetree(parser_tables_gram, pn, pre_visit_node, post_visit_node,
                   statementList, scope, visitor);
   return statementList;
 }
 
+// parse tree of source, nullptr on syntax error, which is reported
+D_ParseNode *parseTree(D_Parser *p, char *begin, char *end) {
+  auto pn = dparse(p, begin, std::distance(begin, end));
+  if (p->syntax_errors) {
+    printf("compilation failure %d %s\n", p->loc.line, p->loc.pathname);
+    return nullptr;
+  }
+  return pn;
+}
+
+StatementList parse(D_Parser *p, char *begin, char *end, AstVisitor &visitor) {
+  auto pn = parseTree(p, begin, end);
+  return pn ? buildAst(pn, visitor) : StatementList();
+}
+
 StatementList compile(const std::string &file, D_Parser *p,
                       AstVisitor &visitor) {
   std::ifstream in(file);
@@ -324,3 +336,19 @@ ParserPtr initialize_parser() {
   parser->save_parse_tree = 1;
   return parser;
 }
+
+struct CompileException : public std::runtime_error {
+  CompileException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// AST of source text, throws CompileException on syntax error
+StatementList parseSource(std::string source,
+                          const std::string &name = "<source>") {
+  auto parser = initialize_parser(name);
+  NullVisitor visitor;
+  auto statements =
+      parse(parser.get(), &source[0], &source[0] + source.size(), visitor);
+  if (parser->syntax_errors)
+    throw CompileException("syntax error in " + name);
+  return statements;
+}
@@ -46,8 +46,9 @@
 #define relloc dont_use_realloc_use_REALLOC_instead
 #define free dont_use_free_use_FREE_instead
 #else
-#define MALLOC malloc
-#define REALLOC realloc
+/* counted by d_allocation_hook, see util.c */
+#define MALLOC d_malloc
+#define REALLOC d_realloc
 #define FREE free
 #endif
 #endif
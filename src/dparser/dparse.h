@@ -83,6 +83,9 @@ int resolve_amb_greedy(D_Parser *dp, int n, D_ParseNode **v);
 
 char *d_dup_pathname_str(const char *str);
 
+/* when set, it's called with size of every allocation of the parser */
+extern void (*d_allocation_hook)(size_t size);
+
 #if defined(__cplusplus)
 }
 #endif
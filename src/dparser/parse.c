@@ -1448,7 +1448,13 @@ shift_all(Parser *p, char *pos) {
   }
 }
 
-static VecZNode path1; /* static first path for speed */
+/* each thread parses with its own first path */
+#ifdef __cplusplus
+#define D_THREAD_LOCAL thread_local
+#else
+#define D_THREAD_LOCAL _Thread_local
+#endif
+static D_THREAD_LOCAL VecZNode path1; /* static first path for speed */
 
 static VecZNode *
 new_VecZNode(VecVecZNode *paths, int n, int parent) {
@@ -439,3 +439,17 @@ char *escape_string(char *s) { return escape_string_internal(s, 0); }
 char *escape_string_single_quote(char *s) { return escape_string_internal(s, 1); }
 
 void d_free(void *x) { FREE(x); }
+
+void (*d_allocation_hook)(size_t size) = 0;
+
+void *d_malloc(size_t size) {
+  if (d_allocation_hook)
+    d_allocation_hook(size);
+  return malloc(size);
+}
+
+void *d_realloc(void *p, size_t size) {
+  if (d_allocation_hook)
+    d_allocation_hook(size);
+  return realloc(p, size);
+}
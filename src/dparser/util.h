@@ -129,6 +129,8 @@ void d_warn(const char *str, ...);
 char *dup_str(const char *str, const char *end);
 uint strhashl(const char *s, int len);
 void d_free(void *);
+void *d_malloc(size_t size);
+void *d_realloc(void *p, size_t size);
 
 void int_list_diff(int *a, int *b, int *c);
 void int_list_intersect(int *a, int *b, int *c);
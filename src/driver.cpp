@@ -11,66 +11,206 @@
 #include <memory>
 #include <functional>
 #include <map>
+#include <utility>
+#include <cstdlib>
+#include <new>
 #include "dparse.h"
 #include "ast.h"
 #include "compiler.h"
 #include "nullvisitor.h"
 #include "dumpvisitor.h"
 #include "astcloner.h"
+#include "inliner.h"
 #include "cfg_flatten.h"
+#include "optimizer.h"
 #include "code_emitter.h"
+#include "interpreter.h"
+#include "compile_service.h"
+#include "tiered.h"
+#include "code_cache.h"
 #include "builtin.h"
+#include "pass_stats.h"
 
-using FunctionMap = std::map<std::string, void *>;
+Target parseTarget(const std::string &name) {
+  if (name == "x86")
+    return Target::x86;
+  if (name == "x86-64")
+    return Target::x86_64;
+  throw std::runtime_error("unknown target : " + name);
+}
+
+// code cache is used only when COGECS_CACHE_DIR names its directory,
+// so runs don't leave files in working directory by default
+std::string codeCacheDirectory() {
+  auto directory = std::getenv("COGECS_CACHE_DIR");
+  return directory ? directory : "";
+}
+
+std::string readSource(const std::string &fileName) {
+  std::ifstream file(fileName, std::ios::binary);
+  if (!file.is_open())
+    throw FileNotFoundException("FileNotFound");
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+// allocations are counted for --time-passes
+void *operator new(std::size_t size) {
+  countAllocation(size);
+  if (auto memory = std::malloc(size ? size : 1))
+    return memory;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+
+void operator delete(void *memory, std::size_t) noexcept {
+  std::free(memory);
+}
 
 int main(int argc, char *argv[]) {
 
-  if (argc < 3) {
-    std::cerr
-        << "syntax: compiler.exe filename [ast|run|transform|emitx86|emitbin]"
-        << std::endl;
+  // --time-passes (or --stats) reports passes of compilation to stderr,
+  // --time-passes=json (or --stats=json) in JSON
+  std::vector<std::string> args;
+  std::string statsFormat;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--time-passes" || arg == "--stats")
+      statsFormat = "text";
+    else if (arg == "--time-passes=json" || arg == "--stats=json")
+      statsFormat = "json";
+    else
+      args.push_back(arg);
+  }
+
+  if (args.size() < 2) {
+    std::cerr << "syntax: compiler.exe filename "
+                 "[ast|run|interp|tiered|transform|optimize|emitx86|emitbin] "
+                 "[x86|x86-64] [--time-passes[=json]]"
+              << std::endl;
     return -1;
   }
 
+  PassStatistics statistics;
+  if (!statsFormat.empty()) {
+    activePassStatistics() = &statistics;
+    d_allocation_hook = &countAllocation;
+  }
+  auto reportStatistics = [&] {
+    if (statsFormat == "json")
+      statistics.printJson(std::cerr);
+    else if (statsFormat == "text")
+      statistics.print(std::cerr);
+  };
+
   try {
-    std::string command;
+    auto command = args[1];
 
-    if (argc == 3)
-      command = argv[2];
+    // code for other target can be emitted, but not run
+    auto target = hostTarget;
+    if (args.size() >= 3)
+      target = parseTarget(args[2]);
 
     std::vector<int> v = {4, 2, 6};
 
-    auto inputFile = argv[1];
+    auto inputFile = args[0];
+
+    HostFunctions functionMap;
+    functionMap.add("print", &builtin_print);
+    functionMap.add("flush", &builtin_flush);
+    functionMap.addIntrinsic("out", &out, Intrinsic::StoreZero);
+    functionMap.addIntrinsic("malloc", &builtin_malloc, Intrinsic::Allocate,
+                             reinterpret_cast<const void *>(&std::malloc));
+    functionMap.addIntrinsic("free", &builtin_free, Intrinsic::Release,
+                             reinterpret_cast<const void *>(&std::free));
+
+    if (command == "run" && target != hostTarget)
+      throw std::runtime_error("code for other target can't be run");
+
+    PassTimer reading("read");
+    auto source = readSource(inputFile);
+    reading.count(source.size(), "bytes");
+    reading.stop();
+
+    // unchanged program is run from cache without parsing it
+    auto cacheDirectory = codeCacheDirectory();
+    std::string cacheKey;
+    if (command == "run" && !cacheDirectory.empty()) {
+      CodeCache cache(cacheDirectory);
+      PassTimer lookup("code cache");
+      cacheKey = cache.key(source, functionMap, target);
+      auto code = cache.load(cacheKey, functionMap);
+      lookup.stop();
+      if (code) {
+        JitCompiler jit(*code);
+        auto x86function = jit.compile(inputFile);
+        x86function();
+        builtin_flush();
+        reportStatistics();
+        return 0;
+      }
+    }
 
     auto p = initialize_parser(inputFile);
 
+    PassTimer parsing("dparse");
+    auto tree = parseTree(p.get(), &source[0], &source[0] + source.size());
+    parsing.stop();
+
+    PassTimer building("ast");
     NullVisitor nvisitor;
+    auto statements = tree ? buildAst(tree, nvisitor) : StatementList();
+    building.count(countNodes(statements), "nodes");
+    building.stop();
 
-    auto statements = compile(argv[1], p.get(), nvisitor);
+    PassTimer inlining("inline");
+    FunctionInliner inliner(statements);
+    auto inlined = inliner.run();
+    inlining.count(inliner.numberOfInlinedCalls(), "calls");
+    inlining.stop();
 
+    PassTimer flattening("flatten");
     CFGFlattener visitor;
-
-    traverse(statements, visitor);
-
-    FunctionMap functionMap = {{"print", (void *)&builtin_print},
-                               {"out", (void *)&out},
-                               {"malloc", (void *)&builtin_malloc},
-                               {"free", (void *)&builtin_free}};
+    traverse(inlined, visitor);
+    flattening.count(visitor.getStatements().size(), "statements");
+    flattening.stop();
 
     if (command == "ast") {
       dumpAST(visitor.getStatements(), std::cout);
     } else if (command == "transform") {
       dumpCode(visitor.getStatements(), std::cout);
+    } else if (command == "optimize") {
+      dumpCode(optimize(visitor.getStatements()), std::cout);
     } else if (command == "emitx86") {
-      auto x86_text = emitMachineCode(visitor.getStatements(), functionMap);
+      auto x86_text = emitMachineCode(optimize(visitor.getStatements()),
+                                      functionMap, target);
       x86_text.dumpExt();
     } else if (command == "run") {
-      auto x86_text = emitMachineCode(visitor.getStatements(), functionMap);
-      JitCompiler jit(x86_text);
-      auto x86function = jit.compile();
+      auto x86_text = emitMachineCode(optimize(visitor.getStatements()),
+                                      functionMap, target, {},
+                                      &defaultCodeHeap());
+      if (!cacheKey.empty())
+        CodeCache(cacheDirectory).store(cacheKey, x86_text, functionMap);
+      JitCompiler jit(std::move(x86_text));
+      auto x86function = jit.compile(inputFile);
       x86function();
+      builtin_flush();
+    } else if (command == "interp") {
+      eval(optimize(visitor.getStatements()), functionMap);
+      builtin_flush();
+    } else if (command == "tiered") {
+      // hot code is compiled while interpreter keeps running
+      CompileService compileService(functionMap, 1);
+      TierPolicy policy;
+      policy.compileService = &compileService;
+      TieredEngine engine(optimize(visitor.getStatements()), functionMap,
+                          policy);
+      engine.run();
+      builtin_flush();
     } else if (command == "emitbin") {
-      auto x86_text = emitMachineCode(visitor.getStatements(), functionMap);
+      auto x86_text = emitMachineCode(optimize(visitor.getStatements()),
+                                      functionMap, target);
       std::ofstream ofile("x86.bin", std::ios::binary);
       ofile.write((char *)&x86_text.instruction_vector()[0],
                   x86_text.instruction_vector().size());
@@ -78,5 +218,6 @@ int main(int argc, char *argv[]) {
   } catch (const std::runtime_error &err) {
     std::cerr << err.what() << std::endl;
   }
+  reportStatistics();
   return 0;
 }
@@ -0,0 +1,501 @@
+#pragma once
+
+// ControlFlowGraph splits flattened code (output of CFGFlattener) into
+// basic blocks and computes dominators.
+// Basic block starts at a label or just after if/goto statement
+// and finishes at if/goto statement or just before next label.
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <algorithm>
+#include "ast.h"
+#include "tools.h"
+
+constexpr size_t noBlock = static_cast<size_t>(-1);
+
+bool isIdentifier(const std::string &value) {
+  return !value.empty() && std::isalpha(value[0]);
+}
+
+bool isAllocationMarker(const StatementPtr &stmt, const std::string &marker) {
+  if (!is<Expression>(stmt))
+    return false;
+  const auto &children = cast<Expression>(stmt)->getChilds();
+  return children.size() == 1 && is<BasicExpression>(children[0]) &&
+         cast<BasicExpression>(children[0])->value == marker;
+}
+
+const FunctionCall *getFunctionCall(const StatementPtr &stmt) {
+  if (!is<Expression>(stmt))
+    return nullptr;
+  const auto &children = cast<Expression>(stmt)->getChilds();
+  if (children.size() != 1 || !is<FunctionCall>(children[0]))
+    return nullptr;
+  return cast<FunctionCall>(children[0]);
+}
+
+// returns name of variable that is assigned by expression
+// a = b, a = op b, a = b op c
+// or empty string if statement is not an assignment to variable
+std::string assignedVariable(const StatementPtr &stmt) {
+  if (!is<Expression>(stmt))
+    return "";
+  const auto &children = cast<Expression>(stmt)->getChilds();
+  if (children.size() < 3 || !is<BasicExpression>(children[0]) ||
+      !is<BasicExpression>(children[1]))
+    return "";
+  if (cast<BasicExpression>(children[1])->value != "=")
+    return "";
+  return cast<BasicExpression>(children[0])->value;
+}
+
+// *p = value
+bool isStoreThroughPointer(const StatementPtr &stmt) {
+  if (!is<Expression>(stmt))
+    return false;
+  const auto &children = cast<Expression>(stmt)->getChilds();
+  return children.size() == 4 && is<BasicExpression>(children[0]) &&
+         cast<BasicExpression>(children[0])->value == "*";
+}
+
+// variables read by statement
+std::vector<std::string> usedVariables(const StatementPtr &stmt) {
+  std::vector<std::string> used;
+  if (auto fcall = getFunctionCall(stmt)) {
+    for (const auto &param : fcall->parameters) {
+      if (isIdentifier(param))
+        used.push_back(param);
+    }
+    return used;
+  }
+  if (is<IfStatement>(stmt)) {
+    for (const auto &child : cast<IfStatement>(stmt)->condition.getChilds()) {
+      if (is<BasicExpression>(child) &&
+          isIdentifier(cast<BasicExpression>(child)->value))
+        used.push_back(cast<BasicExpression>(child)->value);
+    }
+    return used;
+  }
+  if (is<ReturnStatement>(stmt)) {
+    if (isIdentifier(cast<ReturnStatement>(stmt)->param))
+      used.push_back(cast<ReturnStatement>(stmt)->param);
+    return used;
+  }
+  if (!is<Expression>(stmt))
+    return used;
+  const auto &children = cast<Expression>(stmt)->getChilds();
+  // lhs of assignment is not a use, except *p = b
+  size_t first = assignedVariable(stmt).empty() ? 0 : 2;
+  for (size_t i = first; i < children.size(); ++i) {
+    if (!is<BasicExpression>(children[i]))
+      continue;
+    const auto &value = cast<BasicExpression>(children[i])->value;
+    if (isIdentifier(value) && value != "__alloc__" && value != "__dealloc__")
+      used.push_back(value);
+  }
+  return used;
+}
+
+bool isComparisonOperator(const std::string &op) {
+  return op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" ||
+         op == ">=";
+}
+
+struct BasicBlock {
+  size_t id = 0;
+  // statements [begin, end) of flattened statement list
+  size_t begin = 0;
+  size_t end = 0;
+  std::vector<size_t> successors;
+  std::vector<size_t> predecessors;
+};
+
+struct ControlFlowGraph {
+  explicit ControlFlowGraph(const StatementList &stmts) : statements(stmts) {
+    buildBlocks();
+    connectBlocks();
+    computeDominators();
+  }
+
+  const StatementList &getStatements() const { return statements; }
+  const std::vector<BasicBlock> &getBlocks() const { return blocks; }
+  const BasicBlock &block(size_t id) const { return blocks[id]; }
+  size_t size() const { return blocks.size(); }
+
+  size_t blockOf(size_t statementIndex) const {
+    return statementToBlock[statementIndex];
+  }
+
+  size_t blockOfLabel(const std::string &label) const {
+    auto it = labelToBlock.find(label);
+    if (it == labelToBlock.end())
+      return noBlock;
+    return it->second;
+  }
+
+  bool reachable(size_t id) const { return idom[id] != noBlock; }
+
+  size_t immediateDominator(size_t id) const {
+    return id == 0 ? noBlock : idom[id];
+  }
+
+  const std::vector<size_t> &dominatorTreeChildren(size_t id) const {
+    return domChildren[id];
+  }
+
+  bool dominates(size_t a, size_t b) const {
+    if (!reachable(b))
+      return false;
+    while (b != a && b != 0)
+      b = idom[b];
+    return a == b;
+  }
+
+  // blocks in reverse post order
+  const std::vector<size_t> &reversePostOrder() const { return rpo; }
+
+private:
+  void buildBlocks() {
+    statementToBlock.assign(statements.size(), noBlock);
+    size_t begin = 0;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      const auto &stmt = statements[i];
+      if (is<LabelStatement>(stmt) && i != begin) {
+        addBlock(begin, i);
+        begin = i;
+      }
+      if (is<IfStatement>(stmt) || is<GotoStatement>(stmt) ||
+          is<ReturnStatement>(stmt)) {
+        addBlock(begin, i + 1);
+        begin = i + 1;
+      }
+    }
+    if (begin < statements.size() || blocks.empty())
+      addBlock(begin, statements.size());
+  }
+
+  void addBlock(size_t begin, size_t end) {
+    BasicBlock bb;
+    bb.id = blocks.size();
+    bb.begin = begin;
+    bb.end = end;
+    for (size_t i = begin; i < end; ++i) {
+      statementToBlock[i] = bb.id;
+      if (is<LabelStatement>(statements[i]))
+        labelToBlock[cast<LabelStatement>(statements[i])->label] = bb.id;
+    }
+    blocks.push_back(bb);
+  }
+
+  void addEdge(size_t from, size_t to) {
+    if (to == noBlock)
+      return;
+    auto &succ = blocks[from].successors;
+    if (std::find(succ.begin(), succ.end(), to) != succ.end())
+      return;
+    succ.push_back(to);
+    blocks[to].predecessors.push_back(from);
+  }
+
+  void connectBlocks() {
+    for (auto &bb : blocks) {
+      size_t next = bb.id + 1 < blocks.size() ? bb.id + 1 : noBlock;
+      if (bb.begin == bb.end) {
+        addEdge(bb.id, next);
+        continue;
+      }
+      const auto &last = statements[bb.end - 1];
+      if (is<GotoStatement>(last)) {
+        addEdge(bb.id, blockOfLabel(cast<GotoStatement>(last)->label));
+      } else if (is<IfStatement>(last)) {
+        auto gotoStatement =
+            cast<GotoStatement>(cast<IfStatement>(last)->statements[0]);
+        addEdge(bb.id, next);
+        addEdge(bb.id, blockOfLabel(gotoStatement->label));
+      } else if (!is<ReturnStatement>(last)) {
+        addEdge(bb.id, next);
+      }
+    }
+  }
+
+  void postOrder(size_t id, std::vector<bool> &visited,
+                 std::vector<size_t> &order) {
+    visited[id] = true;
+    for (auto succ : blocks[id].successors) {
+      if (!visited[succ])
+        postOrder(succ, visited, order);
+    }
+    order.push_back(id);
+  }
+
+  // Cooper, Harvey, Kennedy "A Simple, Fast Dominance Algorithm"
+  void computeDominators() {
+    std::vector<bool> visited(blocks.size(), false);
+    std::vector<size_t> order;
+    postOrder(0, visited, order);
+    rpo.assign(order.rbegin(), order.rend());
+    std::vector<size_t> rpoIndex(blocks.size(), noBlock);
+    for (size_t i = 0; i < rpo.size(); ++i)
+      rpoIndex[rpo[i]] = i;
+
+    idom.assign(blocks.size(), noBlock);
+    idom[0] = 0;
+    auto intersect = [&](size_t a, size_t b) {
+      while (a != b) {
+        while (rpoIndex[a] > rpoIndex[b])
+          a = idom[a];
+        while (rpoIndex[b] > rpoIndex[a])
+          b = idom[b];
+      }
+      return a;
+    };
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t i = 1; i < rpo.size(); ++i) {
+        size_t id = rpo[i];
+        size_t newIdom = noBlock;
+        for (auto pred : blocks[id].predecessors) {
+          if (idom[pred] == noBlock)
+            continue;
+          newIdom = newIdom == noBlock ? pred : intersect(pred, newIdom);
+        }
+        if (idom[id] != newIdom) {
+          idom[id] = newIdom;
+          changed = true;
+        }
+      }
+    }
+    domChildren.assign(blocks.size(), {});
+    for (size_t id = 1; id < blocks.size(); ++id) {
+      if (idom[id] != noBlock)
+        domChildren[idom[id]].push_back(id);
+    }
+  }
+
+  StatementList statements;
+  std::vector<BasicBlock> blocks;
+  std::vector<size_t> statementToBlock;
+  std::map<std::string, size_t> labelToBlock;
+  std::vector<size_t> idom;
+  std::vector<std::vector<size_t>> domChildren;
+  std::vector<size_t> rpo;
+};
+
+// AllocationRegions keeps lexical structure of flattened code.
+// Each __alloc__ / __dealloc__ pair opens and closes a region,
+// variable is visible from its declaration to the end of the region
+// it was declared in.
+struct AllocationRegions {
+  explicit AllocationRegions(const StatementList &statements) {
+    std::vector<size_t> open;
+    statementToRegion.assign(statements.size(), noBlock);
+    for (size_t i = 0; i < statements.size(); ++i) {
+      const auto &stmt = statements[i];
+      if (isAllocationMarker(stmt, "__alloc__")) {
+        size_t parent = open.empty() ? noBlock : open.back();
+        regionParent.push_back(parent);
+        regionDeclarations.emplace_back();
+        open.push_back(regionParent.size() - 1);
+      }
+      statementToRegion[i] = open.empty() ? noBlock : open.back();
+      if (is<VarDecl>(stmt) && !open.empty()) {
+        regionDeclarations[open.back()].push_back(
+            std::make_pair(cast<VarDecl>(stmt)->var_name, i));
+      }
+      if (isAllocationMarker(stmt, "__dealloc__") && !open.empty())
+        open.pop_back();
+    }
+  }
+
+  // index of declaration visible for name at given statement
+  // or noBlock if variable is not declared
+  size_t resolve(const std::string &name, size_t statementIndex) const {
+    size_t region = statementToRegion[statementIndex];
+    while (region != noBlock) {
+      for (const auto &decl : regionDeclarations[region]) {
+        if (decl.first == name && decl.second < statementIndex)
+          return decl.second;
+      }
+      region = regionParent[region];
+    }
+    return noBlock;
+  }
+
+private:
+  std::vector<size_t> statementToRegion;
+  std::vector<size_t> regionParent;
+  std::vector<std::vector<std::pair<std::string, size_t>>> regionDeclarations;
+};
+
+// type of variable visible at given statement,
+// empty string if variable is not declared
+std::string variableType(const StatementList &statements,
+                         const AllocationRegions &regions,
+                         const std::string &name, size_t index) {
+  auto decl = regions.resolve(name, index);
+  if (decl == noBlock)
+    return "";
+  return cast<VarDecl>(statements[decl])->type;
+}
+
+// NaturalLoop is defined by back edges (latch -> header) where header
+// dominates latch. Header has to start with a label, that is the form
+// produced by CFGFlattener for while loops.
+struct NaturalLoop {
+  size_t header = noBlock;
+  std::vector<size_t> latches;
+  std::set<size_t> blocks;
+
+  bool contains(size_t id) const { return blocks.count(id) > 0; }
+};
+
+// returns loops ordered from innermost to outermost
+std::vector<NaturalLoop> findNaturalLoops(const ControlFlowGraph &cfg) {
+  std::map<size_t, NaturalLoop> loops;
+  for (const auto &bb : cfg.getBlocks()) {
+    if (!cfg.reachable(bb.id))
+      continue;
+    for (auto succ : bb.successors) {
+      if (!cfg.dominates(succ, bb.id))
+        continue;
+      const auto &header = cfg.block(succ);
+      if (header.begin == header.end ||
+          !is<LabelStatement>(cfg.getStatements()[header.begin]))
+        continue;
+      auto &loop = loops[succ];
+      loop.header = succ;
+      loop.latches.push_back(bb.id);
+      loop.blocks.insert(succ);
+      std::vector<size_t> worklist = {bb.id};
+      while (!worklist.empty()) {
+        auto id = worklist.back();
+        worklist.pop_back();
+        if (!loop.blocks.insert(id).second)
+          continue;
+        for (auto pred : cfg.block(id).predecessors)
+          worklist.push_back(pred);
+      }
+    }
+  }
+  std::vector<NaturalLoop> result;
+  for (const auto &loop : loops)
+    result.push_back(loop.second);
+  std::stable_sort(result.begin(), result.end(),
+                   [](const NaturalLoop &lhs, const NaturalLoop &rhs) {
+                     return lhs.blocks.size() < rhs.blocks.size();
+                   });
+  return result;
+}
+
+// Preheader is a place just before loop header label, statements
+// inserted there are executed once before entering the loop.
+// It exists only when loop is entered by falling through to its header.
+bool hasPreheader(const ControlFlowGraph &cfg, const NaturalLoop &loop) {
+  if (loop.header == 0)
+    return false;
+  for (auto pred : cfg.block(loop.header).predecessors) {
+    if (loop.contains(pred))
+      continue;
+    if (pred != loop.header - 1)
+      return false;
+    const auto &bb = cfg.block(pred);
+    if (bb.begin == bb.end)
+      continue;
+    const auto &last = cfg.getStatements()[bb.end - 1];
+    if (is<GotoStatement>(last) || is<IfStatement>(last))
+      return false;
+  }
+  return true;
+}
+
+// call that gets pointer (or unknown variable) can change any variable
+bool passesPointer(const StatementList &statements,
+                   const AllocationRegions &regions, const StatementPtr &stmt,
+                   size_t index) {
+  auto fcall = getFunctionCall(stmt);
+  if (!fcall)
+    return false;
+  for (const auto &param : fcall->parameters) {
+    if (!isIdentifier(param))
+      continue;
+    auto type = variableType(statements, regions, param, index);
+    if (type.empty() || type[0] == '^')
+      return true;
+  }
+  return false;
+}
+
+// what is defined inside of a loop
+struct LoopSummary {
+  std::map<std::string, size_t> assignments;
+  std::set<std::string> declarations;
+  bool clobbersMemory = false;
+
+  bool isChanged(const std::string &var) const {
+    return clobbersMemory || assignments.count(var) ||
+           declarations.count(var);
+  }
+};
+
+LoopSummary summarizeLoop(const ControlFlowGraph &cfg,
+                          const AllocationRegions &regions,
+                          const NaturalLoop &loop) {
+  const auto &statements = cfg.getStatements();
+  LoopSummary summary;
+  for (auto id : loop.blocks) {
+    const auto &bb = cfg.block(id);
+    for (size_t i = bb.begin; i < bb.end; ++i) {
+      const auto &stmt = statements[i];
+      if (is<VarDecl>(stmt))
+        summary.declarations.insert(cast<VarDecl>(stmt)->var_name);
+      auto var = assignedVariable(stmt);
+      if (!var.empty())
+        summary.assignments[var]++;
+      if (isStoreThroughPointer(stmt) ||
+          passesPointer(statements, regions, stmt, i))
+        summary.clobbersMemory = true;
+    }
+  }
+  return summary;
+}
+
+// Comparisons t = a op b followed by if (! t) goto label,
+// where t is used only by that if statement.
+// They can be emitted as compare and branch, without t being set.
+std::set<size_t> findFusedComparisons(const StatementList &statements) {
+  AllocationRegions regions(statements);
+  std::map<size_t, size_t> uses;
+  std::map<size_t, size_t> assignments;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    for (const auto &name : usedVariables(statements[i]))
+      ++uses[regions.resolve(name, i)];
+    auto lhs = assignedVariable(statements[i]);
+    if (!lhs.empty())
+      ++assignments[regions.resolve(lhs, i)];
+  }
+  std::set<size_t> result;
+  for (size_t i = 0; i + 1 < statements.size(); ++i) {
+    auto lhs = assignedVariable(statements[i]);
+    const auto &next = statements[i + 1];
+    if (lhs.empty() || !is<IfStatement>(next))
+      continue;
+    const auto &children = cast<Expression>(statements[i])->getChilds();
+    if (children.size() != 5 || !is<BasicExpression>(children[3]) ||
+        !isComparisonOperator(cast<BasicExpression>(children[3])->value))
+      continue;
+    const auto &condition = cast<IfStatement>(next)->condition.getChilds();
+    if (condition.size() != 2 || !is<BasicExpression>(condition[1]) ||
+        cast<BasicExpression>(condition[1])->value != lhs)
+      continue;
+    auto decl = regions.resolve(lhs, i);
+    if (decl == noBlock || regions.resolve(lhs, i + 1) != decl)
+      continue;
+    if (uses[decl] == 1 && assignments[decl] == 1)
+      result.insert(i);
+  }
+  return result;
+}
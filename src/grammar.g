@@ -19,7 +19,7 @@ function_call : id '(' param* ')';
 function_decl : 'function' id '(' id* ')' block_statement ;
 param : id | number;
 op: '=' | '+' | '-' | '*' | '/' | '==' | '!=' | '<' | '<=' | '>=' | '>' | '&&' | '||';
-id : "[@a-zA-Z]" "[a-zA-Z0-9_]*";
+id : "[@a-zA-Z][a-zA-Z0-9_]*";
 number : "[0-9]*";
 not : '!';
 addr : '&';
@@ -0,0 +1,100 @@
+#pragma once
+
+// HostFunctions maps names of functions used by programs to C functions
+// of the host. Function registered with its signature gets number of
+// arguments checked at compile time and each argument is moved straight
+// to its place with width of the parameter:
+//
+//   HostFunctions functions;
+//   functions.add("print", &builtin_print);   // void(int)
+//   functions.add("out", &out);               // void(int *)
+//
+// Intrinsics are builtins with known semantics, which emitter expands
+// inline (see Intrinsic), so hot loops don't pay for a call.
+//
+// Parameters have to be int or pointers. They are passed in registers
+// on x86-64 (System V) and pushed on the stack on x86 (cdecl).
+
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+enum class ParameterKind { Int, Pointer };
+
+template <typename T> constexpr ParameterKind parameterKind() {
+  static_assert(std::is_pointer_v<T> ||
+                    (std::is_integral_v<T> && sizeof(T) <= sizeof(int)),
+                "host function parameter has to be int or pointer");
+  return std::is_pointer_v<T> ? ParameterKind::Pointer : ParameterKind::Int;
+}
+
+// builtins that emitter expands inline instead of calling them
+enum class Intrinsic {
+  None,
+  // out(p): *p = 0
+  StoreZero,
+  // malloc(size out): *out = implementation(size)
+  Allocate,
+  // free(p): implementation(p) unless p is null
+  Release,
+};
+
+struct HostFunction {
+  const void *address = nullptr;
+  std::vector<ParameterKind> parameters;
+  // function registered only by its address can't be checked
+  bool hasSignature = false;
+  Intrinsic intrinsic = Intrinsic::None;
+  // function called by inline expansion, e.g. malloc of C library
+  const void *implementation = nullptr;
+};
+
+struct HostFunctions {
+  using const_iterator = std::map<std::string, HostFunction>::const_iterator;
+
+  HostFunctions() = default;
+  // functions known only by their addresses
+  HostFunctions(const std::map<std::string, void *> &addresses) {
+    for (const auto &function : addresses)
+      add(function.first, function.second);
+  }
+
+  template <typename R, typename... Args>
+  void add(const std::string &name, R (*function)(Args...)) {
+    functions[name] = HostFunction{reinterpret_cast<const void *>(function),
+                                   {parameterKind<Args>()...},
+                                   true};
+  }
+
+  void add(const std::string &name, const void *address) {
+    functions[name] = HostFunction{address, {}, false};
+  }
+
+  // builtin expanded inline by emitter, it still can be called
+  // through its address when expansion isn't possible
+  template <typename R, typename... Args>
+  void addIntrinsic(const std::string &name, R (*function)(Args...),
+                    Intrinsic intrinsic,
+                    const void *implementation = nullptr) {
+    add(name, function);
+    functions[name].intrinsic = intrinsic;
+    functions[name].implementation = implementation;
+  }
+
+  void add(const std::string &name, const HostFunction &function) {
+    functions[name] = function;
+  }
+
+  // nullptr when there is no such function
+  const HostFunction *find(const std::string &name) const {
+    auto it = functions.find(name);
+    return it != functions.end() ? &it->second : nullptr;
+  }
+
+  const_iterator begin() const { return functions.begin(); }
+  const_iterator end() const { return functions.end(); }
+
+private:
+  std::map<std::string, HostFunction> functions;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+// FunctionInliner replaces calls of small functions with their bodies.
+// It works on AST, before code is flattened.
+// Call f(1 x) or y = f(1 x) becomes a block where parameters are
+// declared as variables and initialized with arguments:
+//
+//   function f(a b) { var r:i32; r = a + b; return r; }
+//   y = f(1 x);
+//                   ==>
+//   {
+//     var a__inl0:i32; a__inl0 = 1;
+//     var b__inl0:i32; b__inl0 = x;
+//     var r__inl0:i32; r__inl0 = a__inl0 + b__inl0;
+//     y = r__inl0;
+//   }
+//
+// Parameters, locals and labels are renamed with unique suffix, as
+// emitter does not allow variable shadowing.
+// Only leaf functions which return (if at all) in last statement are
+// inlined. Function declaration is removed when all its calls were inlined.
+
+#include <map>
+#include <set>
+#include <cctype>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "tools.h"
+#include "astcloner.h"
+
+// maximum number of statements in inlined function
+constexpr size_t defaultInlineBudget = 32;
+
+struct FunctionInliner {
+  explicit FunctionInliner(const StatementList &stmts,
+                           size_t budget = defaultInlineBudget)
+      : statements(stmts), budget(budget) {}
+
+  StatementList run() {
+    for (const auto &stmt : statements) {
+      if (is<FunctionDecl>(stmt))
+        functions[cast<FunctionDecl>(stmt)->name] = cast<FunctionDecl>(stmt);
+    }
+    for (const auto &function : functions) {
+      if (isInlineable(function.second))
+        inlineable.insert(function.first);
+    }
+
+    types.emplace_back();
+    auto result = inlineCalls(statements);
+    types.pop_back();
+
+    // remove functions that are not called anymore
+    std::set<std::string> called;
+    for (const auto &stmt : result)
+      collectCalls(stmt, called);
+    StatementList program;
+    for (const auto &stmt : result) {
+      if (is<FunctionDecl>(stmt) &&
+          inlinedFunctions.count(cast<FunctionDecl>(stmt)->name) &&
+          !called.count(cast<FunctionDecl>(stmt)->name))
+        continue;
+      program.push_back(stmt);
+    }
+    return program;
+  }
+
+  size_t numberOfInlinedCalls() const { return inlined; }
+
+private:
+  static size_t sizeOf(const StatementList &stmts) {
+    size_t size = 0;
+    for (const auto &stmt : stmts) {
+      ++size;
+      if (is<BlockStatement>(stmt))
+        size += sizeOf(cast<BlockStatement>(stmt)->statements);
+      if (is<IfStatement>(stmt))
+        size += sizeOf(cast<IfStatement>(stmt)->statements);
+      if (is<WhileLoop>(stmt))
+        size += sizeOf(cast<WhileLoop>(stmt)->statements);
+    }
+    return size;
+  }
+
+  static const FunctionCall *callOf(const StatementPtr &stmt) {
+    if (!is<Expression>(stmt))
+      return nullptr;
+    const auto &children = cast<Expression>(stmt)->getChilds();
+    if (children.size() == 1 && is<FunctionCall>(children[0]))
+      return cast<FunctionCall>(children[0]);
+    if (children.size() == 3 && is<FunctionCall>(children[2]))
+      return cast<FunctionCall>(children[2]);
+    return nullptr;
+  }
+
+  static void collectCalls(const Expression &expr,
+                           std::set<std::string> &called) {
+    for (const auto &child : expr.getChilds()) {
+      if (is<FunctionCall>(child))
+        called.insert(cast<FunctionCall>(child)->name);
+      if (is<Expression>(child))
+        collectCalls(*cast<Expression>(child), called);
+    }
+  }
+
+  static void collectCalls(const StatementPtr &stmt,
+                           std::set<std::string> &called) {
+    if (is<Expression>(stmt))
+      collectCalls(*cast<Expression>(stmt), called);
+    if (is<BlockStatement>(stmt)) {
+      for (const auto &child : cast<BlockStatement>(stmt)->statements)
+        collectCalls(child, called);
+    }
+    if (is<IfStatement>(stmt)) {
+      collectCalls(cast<IfStatement>(stmt)->condition, called);
+      for (const auto &child : cast<IfStatement>(stmt)->statements)
+        collectCalls(child, called);
+    }
+    if (is<WhileLoop>(stmt)) {
+      collectCalls(cast<WhileLoop>(stmt)->condition, called);
+      for (const auto &child : cast<WhileLoop>(stmt)->statements)
+        collectCalls(child, called);
+    }
+    if (is<FunctionDecl>(stmt)) {
+      for (const auto &child : cast<FunctionDecl>(stmt)->statements)
+        collectCalls(child, called);
+    }
+  }
+
+  // statements that are not allowed in inlined body
+  bool isInlineable(const StatementList &stmts, bool allowReturn) const {
+    for (size_t i = 0; i < stmts.size(); ++i) {
+      const auto &stmt = stmts[i];
+      if (is<FunctionDecl>(stmt))
+        return false;
+      if (is<ReturnStatement>(stmt) && (!allowReturn || i + 1 != stmts.size()))
+        return false;
+      std::set<std::string> called;
+      collectCalls(stmt, called);
+      for (const auto &name : called) {
+        if (functions.count(name))
+          return false;
+      }
+      if (is<BlockStatement>(stmt) &&
+          !isInlineable(cast<BlockStatement>(stmt)->statements, false))
+        return false;
+      if (is<IfStatement>(stmt) &&
+          !isInlineable(cast<IfStatement>(stmt)->statements, false))
+        return false;
+      if (is<WhileLoop>(stmt) &&
+          !isInlineable(cast<WhileLoop>(stmt)->statements, false))
+        return false;
+    }
+    return true;
+  }
+
+  // function body is a block statement
+  static const StatementList &bodyOf(const FunctionDecl *function) {
+    const auto &stmts = function->statements;
+    if (stmts.size() == 1 && is<BlockStatement>(stmts[0]))
+      return cast<BlockStatement>(stmts[0])->statements;
+    return stmts;
+  }
+
+  bool isInlineable(const FunctionDecl *function) const {
+    return sizeOf(bodyOf(function)) <= budget &&
+           isInlineable(bodyOf(function), true);
+  }
+
+  static void collectNames(const StatementList &stmts, RenameMap &renames,
+                           const std::string &suffix) {
+    for (const auto &stmt : stmts) {
+      if (is<VarDecl>(stmt))
+        renames[cast<VarDecl>(stmt)->var_name] =
+            cast<VarDecl>(stmt)->var_name + suffix;
+      if (is<LabelStatement>(stmt))
+        renames[cast<LabelStatement>(stmt)->label] =
+            cast<LabelStatement>(stmt)->label + suffix;
+      if (is<BlockStatement>(stmt))
+        collectNames(cast<BlockStatement>(stmt)->statements, renames, suffix);
+      if (is<IfStatement>(stmt))
+        collectNames(cast<IfStatement>(stmt)->statements, renames, suffix);
+      if (is<WhileLoop>(stmt))
+        collectNames(cast<WhileLoop>(stmt)->statements, renames, suffix);
+    }
+  }
+
+  std::string typeOf(const std::string &param) const {
+    for (auto it = types.rbegin(); it != types.rend(); ++it) {
+      auto type = it->find(param);
+      if (type != it->end())
+        return type->second;
+    }
+    return "i32";
+  }
+
+  StatementPtr makeAssignment(size_t scope, const std::string &lhs,
+                              const std::string &rhs) const {
+    return makeNode(Expression(scope, {makeNode(BasicExpression(scope, lhs)),
+                                       makeNode(BasicExpression(scope, "=")),
+                                       makeNode(BasicExpression(scope, rhs))}));
+  }
+
+  // returns block that replaces call or nullptr if call can't be inlined
+  StatementPtr inlineCall(const StatementPtr &stmt) {
+    auto fcall = callOf(stmt);
+    if (!fcall || !inlineable.count(fcall->name))
+      return nullptr;
+    auto function = functions[fcall->name];
+    if (function->parameters.size() != fcall->parameters.size())
+      return nullptr;
+    const auto &body = bodyOf(function);
+    bool returnsValue = !body.empty() && is<ReturnStatement>(body.back());
+    const auto &children = cast<Expression>(stmt)->getChilds();
+    std::string result;
+    if (children.size() == 3) {
+      if (!returnsValue)
+        return nullptr;
+      result = cast<BasicExpression>(children[0])->value;
+    }
+
+    inlinedFunctions.insert(fcall->name);
+    auto suffix = "__inl" + std::to_string(inlined++);
+    RenameMap renames;
+    for (const auto &param : function->parameters)
+      renames[param] = param + suffix;
+    collectNames(body, renames, suffix);
+
+    auto scope = stmt->scope;
+    StatementList block;
+    for (size_t i = 0; i < function->parameters.size(); ++i) {
+      const auto &param = function->parameters[i];
+      const auto &arg = fcall->parameters[i];
+      auto decl = makeNode(VarDecl(scope, renames[param]));
+      cast<VarDecl>(decl)->type =
+          std::isalpha(arg[0]) ? typeOf(arg) : std::string("i32");
+      block.push_back(decl);
+      block.push_back(makeAssignment(scope, renames[param], arg));
+    }
+
+    AstCloner cloner(renames);
+    traverse(body, cloner);
+    for (const auto &clone : cloner.getStatements()) {
+      if (is<ReturnStatement>(clone)) {
+        auto value = cast<ReturnStatement>(clone)->param;
+        if (!result.empty())
+          block.push_back(makeAssignment(scope, result, value));
+        continue;
+      }
+      block.push_back(clone);
+    }
+    return makeNode(BlockStatement(scope, block));
+  }
+
+  StatementList inlineCalls(const StatementList &stmts) {
+    StatementList result;
+    for (const auto &stmt : stmts) {
+      if (is<VarDecl>(stmt))
+        types.back()[cast<VarDecl>(stmt)->var_name] = cast<VarDecl>(stmt)->type;
+      if (auto block = inlineCall(stmt)) {
+        result.push_back(block);
+        continue;
+      }
+      result.push_back(inlineNested(stmt));
+    }
+    return result;
+  }
+
+  // nested statements are copied with calls inlined
+  StatementPtr inlineNested(const StatementPtr &stmt) {
+    if (is<BlockStatement>(stmt)) {
+      auto block = *cast<BlockStatement>(stmt);
+      block.statements = inlineScope(block.statements);
+      return makeNode(std::move(block));
+    }
+    if (is<IfStatement>(stmt)) {
+      auto ifStatement = *cast<IfStatement>(stmt);
+      ifStatement.statements = inlineScope(ifStatement.statements);
+      return makeNode(std::move(ifStatement));
+    }
+    if (is<WhileLoop>(stmt)) {
+      auto loop = *cast<WhileLoop>(stmt);
+      loop.statements = inlineScope(loop.statements);
+      return makeNode(std::move(loop));
+    }
+    if (is<FunctionDecl>(stmt) &&
+        !inlineable.count(cast<FunctionDecl>(stmt)->name)) {
+      auto function = *cast<FunctionDecl>(stmt);
+      function.statements = inlineScope(function.statements);
+      return makeNode(std::move(function));
+    }
+    return stmt;
+  }
+
+  StatementList inlineScope(const StatementList &stmts) {
+    types.emplace_back();
+    auto result = inlineCalls(stmts);
+    types.pop_back();
+    return result;
+  }
+
+  StatementList statements;
+  size_t budget;
+  std::map<std::string, const FunctionDecl *> functions;
+  std::set<std::string> inlineable;
+  std::set<std::string> inlinedFunctions;
+  // types of visible variables, one map per scope
+  std::vector<std::map<std::string, std::string>> types;
+  size_t inlined = 0;
+};
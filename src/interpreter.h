@@ -1,5 +1,729 @@
 #pragma once
 
+// Register based bytecode and its interpreter.
+//
+// Flattened statements are compiled to three address instructions,
+// which operands are slots of a frame addressed relative to frame pointer,
+// the same way as in JIT code:
+//   - variables are at negative offsets given by FrameLayoutPass, so
+//     taking address of variable and pointer arithmetic behave as in JIT
+//   - scratch slots and constants are at positive offsets and take 8 bytes,
+//     constant is stored sign extended, so it can be read as int or pointer
+//
+//   a = a * 3          Mul [fp - 4], [fp - 4], [fp + 16]
+//   t = a < n          (fused with if statement that follows)
+//   if (! t) goto L    JumpUnlessLt L, [fp - 4], [fp - 8]
+//
+// Instructions are dispatched with computed goto (labels as values)
+// on GCC and Clang, so each handler jumps straight to the next one,
+// other compilers use a switch.
+
+#include <cctype>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 #include "ast.h"
+#include "nullvisitor.h"
+#include "symbol_table.h"
+#include "sema.h"
+#include "flow_graph.h"
+#include "host_functions.h"
+#include "code_emitter.h"
+
+struct InterpreterException : public std::runtime_error {
+  InterpreterException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// a = b op c, jumps keep their target in a
+#define COGECS_OPCODES(X)                                                     \
+  X(Mov)                                                                      \
+  X(MovPtr)                                                                   \
+  X(Widen)                                                                    \
+  X(AddressOf)                                                                \
+  X(Load)                                                                     \
+  X(LoadPtr)                                                                  \
+  X(Store)                                                                    \
+  X(StorePtr)                                                                 \
+  X(Add)                                                                      \
+  X(Sub)                                                                      \
+  X(Mul)                                                                      \
+  X(Div)                                                                      \
+  X(PtrAddBytes)                                                              \
+  X(PtrSubBytes)                                                              \
+  X(Eq)                                                                       \
+  X(Ne)                                                                       \
+  X(Lt)                                                                       \
+  X(Le)                                                                       \
+  X(Gt)                                                                       \
+  X(Ge)                                                                       \
+  X(EqPtr)                                                                    \
+  X(NePtr)                                                                    \
+  X(LtPtr)                                                                    \
+  X(LePtr)                                                                    \
+  X(GtPtr)                                                                    \
+  X(GePtr)                                                                    \
+  X(Jump)                                                                     \
+  X(BackEdge)                                                                 \
+  X(JumpIfZero)                                                               \
+  X(JumpUnlessEq)                                                             \
+  X(JumpUnlessNe)                                                             \
+  X(JumpUnlessLt)                                                             \
+  X(JumpUnlessLe)                                                             \
+  X(JumpUnlessGt)                                                             \
+  X(JumpUnlessGe)                                                             \
+  X(Call)                                                                     \
+  X(Halt)
+
+enum class Opcode : unsigned char {
+#define COGECS_OPCODE_ENUM(name) name,
+  COGECS_OPCODES(COGECS_OPCODE_ENUM)
+#undef COGECS_OPCODE_ENUM
+};
+
+struct BytecodeInstruction {
+  Opcode op;
+  int a = 0;
+  int b = 0;
+  int c = 0;
+};
+
+// call of host function with arguments read from slots
+struct CallSite {
+  const void *address = nullptr;
+  std::vector<int> arguments;
+  // pointers and constants are read in full width, int variables
+  // are sign extended
+  std::vector<bool> wide;
+};
+
+struct Bytecode {
+  std::vector<BytecodeInstruction> instructions;
+  std::vector<CallSite> calls;
+  // bytes used by variables below frame pointer
+  size_t frameSize = 0;
+  // values of slots that follow scratch slots
+  std::vector<long long> constants;
+  // header label of each loop, its back edges are counted
+  std::vector<std::string> loops;
+};
+
+// execution counts gathered by interpreter
+struct Profile {
+  // executions of back edges of each loop in Bytecode::loops
+  std::vector<size_t> backEdges;
+};
+
+constexpr int bytecodeSlotSize = 8;
+constexpr int firstScratchSlot = 0;
+constexpr int secondScratchSlot = bytecodeSlotSize;
+constexpr int firstConstantSlot = 2 * bytecodeSlotSize;
+// the same limit as for System V calls in JIT code
+constexpr size_t maxCallArguments = 6;
+
+struct BytecodeCompiler : public NullVisitor {
+  BytecodeCompiler(const FrameLayoutPass &frameLayout,
+                   const HostFunctions &functions,
+                   const std::set<const Statement *> &fused = {})
+      : frame(frameLayout), functionMap(functions),
+        fusedComparisons(fused) {}
+
+  void visitPre(const BasicExpression *expr) {
+    if (expr->value == "__alloc__")
+      symbolTable.enterScope();
+    if (expr->value == "__dealloc__")
+      symbolTable.exitScope();
+  }
+
+  void visitPost(const VarDecl *varDecl) {
+    if (symbolTable.exists(varDecl->var_name)) {
+      throw InterpreterException("variable already defined : " +
+                                 varDecl->var_name);
+    }
+    symbolTable.insertSymbol(varDecl->var_name, varDecl->type,
+                             frame.offsetOf(varDecl));
+  }
+
+  void visitPost(const Expression *expr) {
+    auto children = expr->getChilds();
+    switch (children.size()) {
+    case 3: {
+      auto lhs = symbolTable.findSymbol(value(children[0]), 0);
+      auto rhs = value(children[2]);
+      if (isPointer(lhs))
+        emit(Opcode::MovPtr, lhs.stack_position,
+             pointerOperand(rhs, firstScratchSlot));
+      else
+        emit(Opcode::Mov, lhs.stack_position, operand(rhs));
+      break;
+    }
+    case 4: {
+      if (value(children[0]) == "*") {
+        // *p = v
+        auto pointer = dereferenced(value(children[1]), expr);
+        auto rhs = value(children[3]);
+        if (isPointerToPointer(pointer))
+          emit(Opcode::StorePtr, pointer.stack_position,
+               pointerOperand(rhs, firstScratchSlot));
+        else
+          emit(Opcode::Store, pointer.stack_position, operand(rhs));
+        break;
+      }
+      auto lhs = symbolTable.findSymbol(value(children[0]), 0);
+      auto unaryOp = value(children[2]);
+      auto rhs = value(children[3]);
+      if (unaryOp == "!") {
+        // ! gives 1 for values not greater than 0
+        auto op = isPointer(rhs) ? Opcode::LePtr : Opcode::Le;
+        emitInt(lhs, op, operand(rhs), constant(0));
+      }
+      if (unaryOp == "&") {
+        auto sym = symbolTable.findSymbol(rhs, 0);
+        if (isPointer(lhs)) {
+          emit(Opcode::AddressOf, lhs.stack_position, sym.stack_position);
+        } else {
+          emit(Opcode::AddressOf, firstScratchSlot, sym.stack_position);
+          emit(Opcode::Mov, lhs.stack_position, firstScratchSlot);
+        }
+      }
+      if (unaryOp == "*") {
+        auto pointer = dereferenced(rhs, expr);
+        if (isPointer(lhs) && isPointerToPointer(pointer))
+          emit(Opcode::LoadPtr, lhs.stack_position, pointer.stack_position);
+        else
+          emitInt(lhs, Opcode::Load, pointer.stack_position);
+      }
+      break;
+    }
+    case 5: {
+      auto lhs = symbolTable.findSymbol(value(children[0]), 0);
+      auto first = value(children[2]);
+      auto binOp = value(children[3]);
+      auto second = value(children[4]);
+      if (isComparisonOperator(binOp)) {
+        bool wide = isPointer(first) || isPointer(second);
+        // if statement that follows jumps on comparison directly
+        if (fusedComparisons.count(expr) && !wide) {
+          pendingComparison = {comparison(binOp, Opcode::JumpUnlessEq), 0,
+                               operand(first), operand(second)};
+          break;
+        }
+        if (wide)
+          emitInt(lhs, comparison(binOp, Opcode::EqPtr),
+                  pointerOperand(first, firstScratchSlot),
+                  pointerOperand(second, secondScratchSlot));
+        else
+          emitInt(lhs, comparison(binOp, Opcode::Eq), operand(first),
+                  operand(second));
+        break;
+      }
+      if ((binOp == "+" || binOp == "-") && isPointer(first)) {
+        emitPointerOffset(lhs, symbolTable.findSymbol(first, 0), binOp,
+                          second);
+        break;
+      }
+      static const std::map<std::string, Opcode> arithmetic = {
+          {"+", Opcode::Add},
+          {"-", Opcode::Sub},
+          {"*", Opcode::Mul},
+          {"/", Opcode::Div},
+      };
+      auto op = arithmetic.find(binOp);
+      if (op == arithmetic.end())
+        throw InterpreterException("unsupported operator : " + binOp);
+      emitInt(lhs, op->second, operand(first), operand(second));
+      break;
+    }
+    }
+  }
+
+  void visitPost(const FunctionCall *fcall) {
+    auto function = functionMap.find(fcall->name);
+    if (!function)
+      throw InterpreterException("unknown function : " + fcall->name);
+    const auto &arguments = fcall->parameters;
+    if (function->hasSignature &&
+        arguments.size() != function->parameters.size())
+      throw InterpreterException("wrong number of arguments : " +
+                                 fcall->name);
+    if (arguments.size() > maxCallArguments)
+      throw InterpreterException("too many arguments : " + fcall->name);
+    CallSite call;
+    // intrinsics are called through their wrappers
+    call.address = function->address;
+    for (size_t i = 0; i < arguments.size(); ++i) {
+      const auto &argument = arguments[i];
+      if (function->hasSignature &&
+          function->parameters[i] == ParameterKind::Pointer &&
+          std::isalpha(argument[0]) && !isPointer(argument))
+        throw InterpreterException("argument is not a pointer : " + argument);
+      call.arguments.push_back(operand(argument));
+      call.wide.push_back(!std::isalpha(argument[0]) || isPointer(argument));
+    }
+    emit(Opcode::Call, static_cast<int>(bytecode.calls.size()));
+    bytecode.calls.push_back(std::move(call));
+  }
+
+  void visitPre(const IfStatement *ifstatement) {
+    gotosFromIf.insert(ifstatement->statements[0].get());
+  }
+
+  void visitPost(const IfStatement *ifstatement) {
+    auto gotoStatement = cast<GotoStatement>(ifstatement->statements[0]);
+    auto condition = value(ifstatement->condition.getChilds()[1]);
+    if (pendingComparison.op != Opcode::Halt) {
+      // jump when fused comparison is false
+      emit(pendingComparison.op, 0, pendingComparison.b,
+           pendingComparison.c);
+      pendingComparison = BytecodeInstruction{Opcode::Halt};
+    } else {
+      emit(Opcode::JumpIfZero, 0, operand(condition));
+    }
+    jumpFixups.emplace_back(bytecode.instructions.size() - 1,
+                            gotoStatement->label);
+  }
+
+  void visitPre(const LabelStatement *stmt) {
+    labels[stmt->label] = static_cast<int>(bytecode.instructions.size());
+  }
+
+  void visitPost(const GotoStatement *stmt) {
+    // jump of if statement was emitted with its condition
+    if (gotosFromIf.count(stmt))
+      return;
+    emit(Opcode::Jump);
+    jumpFixups.emplace_back(bytecode.instructions.size() - 1, stmt->label);
+  }
+
+  // value of return isn't kept, native code returns it
+  void visitPost(const ReturnStatement *) { emit(Opcode::Halt); }
+
+  // resolves jumps and terminates the program,
+  // goto to preceding label closes a loop
+  Bytecode finish() {
+    emit(Opcode::Halt);
+    std::map<std::string, int> loopIds;
+    for (const auto &fixup : jumpFixups) {
+      auto label = labels.find(fixup.second);
+      if (label == labels.end())
+        throw InterpreterException("undefined label : " + fixup.second);
+      auto &instruction = bytecode.instructions[fixup.first];
+      instruction.a = label->second;
+      if (instruction.op != Opcode::Jump ||
+          label->second > static_cast<int>(fixup.first))
+        continue;
+      auto loop = loopIds.emplace(fixup.second, bytecode.loops.size());
+      if (loop.second)
+        bytecode.loops.push_back(fixup.second);
+      instruction.op = Opcode::BackEdge;
+      instruction.b = loop.first->second;
+    }
+    bytecode.frameSize = frame.getFrameSize();
+    return bytecode;
+  }
+
+private:
+  const FrameLayoutPass &frame;
+  const HostFunctions &functionMap;
+  BasicSymbolTable symbolTable;
+  Bytecode bytecode;
+
+  // gotos that are part of if statements,
+  // jump for them is emitted during visiting if statement
+  GotosFromIf gotosFromIf;
+  std::map<std::string, int> labels;
+  std::vector<std::pair<size_t, std::string>> jumpFixups;
+  std::map<int, int> constantSlots;
+
+  // comparisons compiled into conditional jump of if statement
+  std::set<const Statement *> fusedComparisons;
+  BytecodeInstruction pendingComparison{Opcode::Halt};
+
+  static const std::string &value(const std::shared_ptr<Statement> &node) {
+    return cast<BasicExpression>(node)->value;
+  }
+
+  void emit(Opcode op, int a = 0, int b = 0, int c = 0) {
+    bytecode.instructions.push_back({op, a, b, c});
+  }
+
+  static bool isPointer(const symbol &sym) { return sym.type[0] == '^'; }
+  static bool isPointerToPointer(const symbol &sym) {
+    return sym.type.size() > 1 && sym.type[1] == '^';
+  }
+  bool isPointer(const std::string &name) {
+    return std::isalpha(name[0]) && isPointer(symbolTable.findSymbol(name, 0));
+  }
+
+  int constant(int value) {
+    auto it = constantSlots.find(value);
+    if (it != constantSlots.end())
+      return it->second;
+    auto slot = firstConstantSlot + bytecodeSlotSize *
+                                        static_cast<int>(
+                                            bytecode.constants.size());
+    bytecode.constants.push_back(value);
+    constantSlots[value] = slot;
+    return slot;
+  }
+
+  // slot of variable or constant
+  int operand(const std::string &name) {
+    if (std::isalpha(name[0]))
+      return symbolTable.findSymbol(name, 0).stack_position;
+    return constant(std::stoi(name));
+  }
+
+  // operand read as pointer, int variable is widened in scratch slot
+  int pointerOperand(const std::string &name, int scratch) {
+    if (!std::isalpha(name[0]) || isPointer(name))
+      return operand(name);
+    emit(Opcode::Widen, scratch, operand(name));
+    return scratch;
+  }
+
+  symbol dereferenced(const std::string &name, const Expression *expr) {
+    auto sym = symbolTable.findSymbol(name, 0);
+    if (!isPointer(sym)) {
+      std::stringstream outStream;
+      for (const auto &child : expr->getChilds())
+        child->text(outStream);
+      throw InterpreterException("only pointers can be dereferenced : " +
+                                 outStream.str());
+    }
+    return sym;
+  }
+
+  // lhs = b op c for instruction with int result
+  void emitInt(const symbol &lhs, Opcode op, int b, int c = 0) {
+    if (!isPointer(lhs)) {
+      emit(op, lhs.stack_position, b, c);
+      return;
+    }
+    emit(op, firstScratchSlot, b, c);
+    emit(Opcode::Widen, lhs.stack_position, firstScratchSlot);
+  }
+
+  // lhs = p +/- n, stack grows downwards, so addition
+  // means subtraction of n * sizeOf and reverse
+  void emitPointerOffset(const symbol &lhs, const symbol &pointer,
+                         const std::string &op, const std::string &count) {
+    auto sizeOf = typeSizeOf(pointer.type);
+    int offset = 0;
+    if (std::isalpha(count[0])) {
+      emit(Opcode::Mul, secondScratchSlot, operand(count), constant(sizeOf));
+      offset = secondScratchSlot;
+    } else {
+      offset = constant(std::stoi(count) * sizeOf);
+    }
+    auto ptrOp = op == "+" ? Opcode::PtrSubBytes : Opcode::PtrAddBytes;
+    if (isPointer(lhs)) {
+      emit(ptrOp, lhs.stack_position, pointer.stack_position, offset);
+      return;
+    }
+    emit(ptrOp, firstScratchSlot, pointer.stack_position, offset);
+    emit(Opcode::Mov, lhs.stack_position, firstScratchSlot);
+  }
+
+  // opcode of comparison in group starting with opcode for ==
+  static Opcode comparison(const std::string &op, Opcode equal) {
+    static const std::map<std::string, int> order = {
+        {"==", 0}, {"!=", 1}, {"<", 2}, {"<=", 3}, {">", 4}, {">=", 5},
+    };
+    return static_cast<Opcode>(static_cast<int>(equal) + order.at(op));
+  }
+};
+
+template <typename T> T readSlot(const std::byte *address) {
+  T value;
+  std::memcpy(&value, address, sizeof(T));
+  return value;
+}
+
+template <typename T> void writeSlot(std::byte *address, T value) {
+  std::memcpy(address, &value, sizeof(T));
+}
+
+// calls host function with arguments of pointer width, which is
+// how both cdecl and System V pass ints and pointers
+void callHostFunction(const void *address, const intptr_t *args,
+                      size_t count) {
+  using A = intptr_t;
+  switch (count) {
+  case 0:
+    reinterpret_cast<void (*)()>(address)();
+    break;
+  case 1:
+    reinterpret_cast<void (*)(A)>(address)(args[0]);
+    break;
+  case 2:
+    reinterpret_cast<void (*)(A, A)>(address)(args[0], args[1]);
+    break;
+  case 3:
+    reinterpret_cast<void (*)(A, A, A)>(address)(args[0], args[1], args[2]);
+    break;
+  case 4:
+    reinterpret_cast<void (*)(A, A, A, A)>(address)(args[0], args[1],
+                                                    args[2], args[3]);
+    break;
+  case 5:
+    reinterpret_cast<void (*)(A, A, A, A, A)>(address)(
+        args[0], args[1], args[2], args[3], args[4]);
+    break;
+  case 6:
+    reinterpret_cast<void (*)(A, A, A, A, A, A)>(address)(
+        args[0], args[1], args[2], args[3], args[4], args[5]);
+    break;
+  default:
+    throw InterpreterException("too many arguments");
+  }
+}
+
+#if defined(__GNUC__)
+#define COGECS_COMPUTED_GOTO
+#endif
+
+// Called when back edges of a loop reach threshold, with frame pointer
+// of the interpreter, and on every further back edge until it returns
+// true, when it finished the program from header of the loop, e.g. in
+// machine code using the same frame layout.
+using HotLoopHandler = std::function<bool(size_t loop, std::byte *frame)>;
+
+struct Interpreter {
+  explicit Interpreter(const Bytecode &code, Profile *counts = nullptr)
+      : bytecode(code), profile(counts) {}
+
+  void onHotLoop(size_t backEdgeThreshold, HotLoopHandler handler) {
+    hotLoopThreshold = backEdgeThreshold;
+    hotLoopHandler = std::move(handler);
+  }
+
+  void run() const {
+    std::vector<size_t> counters;
+    auto &backEdges = profile ? profile->backEdges : counters;
+    backEdges.resize(bytecode.loops.size());
+
+    auto variableBytes = (bytecode.frameSize + bytecodeSlotSize - 1) /
+                         bytecodeSlotSize * bytecodeSlotSize;
+    std::vector<long long> slots(variableBytes / bytecodeSlotSize + 2 +
+                                 bytecode.constants.size());
+    auto fp = reinterpret_cast<std::byte *>(slots.data()) + variableBytes;
+    std::memcpy(fp + firstConstantSlot, bytecode.constants.data(),
+                bytecode.constants.size() * bytecodeSlotSize);
+
+    const BytecodeInstruction *code = bytecode.instructions.data();
+    const BytecodeInstruction *ip = code;
+
+#define INT(slot) readSlot<int>(fp + ip->slot)
+#define PTR(slot) readSlot<intptr_t>(fp + ip->slot)
+#define SET_INT(value) writeSlot<int>(fp + ip->a, (value))
+#define SET_PTR(value) writeSlot<intptr_t>(fp + ip->a, (value))
+// ints wrap around like in JIT code
+#define WRAP(x, op, y)                                                        \
+  static_cast<int>(static_cast<unsigned>(x) op static_cast<unsigned>(y))
+
+#ifdef COGECS_COMPUTED_GOTO
+    static const void *const dispatch[] = {
+#define COGECS_OPCODE_LABEL(name) &&handle##name,
+        COGECS_OPCODES(COGECS_OPCODE_LABEL)
+#undef COGECS_OPCODE_LABEL
+    };
+#define HANDLER(name) handle##name:
+#define NEXT() goto *dispatch[static_cast<int>(ip->op)]
+    NEXT();
+#else
+#define HANDLER(name) case Opcode::name:
+#define NEXT() continue
+    for (;;) {
+      switch (ip->op) {
+#endif
+
+    HANDLER(Mov) {
+      SET_INT(INT(b));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(MovPtr) {
+      SET_PTR(PTR(b));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Widen) {
+      // like mov of 32 bit register, which clears upper half
+      SET_PTR(static_cast<intptr_t>(static_cast<uint32_t>(INT(b))));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(AddressOf) {
+      SET_PTR(reinterpret_cast<intptr_t>(fp + ip->b));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Load) {
+      SET_INT(readSlot<int>(reinterpret_cast<std::byte *>(PTR(b))));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(LoadPtr) {
+      SET_PTR(readSlot<intptr_t>(reinterpret_cast<std::byte *>(PTR(b))));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Store) {
+      writeSlot<int>(reinterpret_cast<std::byte *>(PTR(a)), INT(b));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(StorePtr) {
+      writeSlot<intptr_t>(reinterpret_cast<std::byte *>(PTR(a)), PTR(b));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Add) {
+      SET_INT(WRAP(INT(b), +, INT(c)));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Sub) {
+      SET_INT(WRAP(INT(b), -, INT(c)));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Mul) {
+      SET_INT(WRAP(INT(b), *, INT(c)));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Div) {
+      auto dividend = INT(b);
+      auto divisor = INT(c);
+      // idiv raises divide error for both
+      if (divisor == 0)
+        throw InterpreterException("division by zero");
+      if (divisor == -1 && dividend == INT_MIN)
+        throw InterpreterException("division overflow");
+      SET_INT(dividend / divisor);
+      ++ip;
+      NEXT();
+    }
+    HANDLER(PtrAddBytes) {
+      SET_PTR(PTR(b) + static_cast<intptr_t>(INT(c)));
+      ++ip;
+      NEXT();
+    }
+    HANDLER(PtrSubBytes) {
+      SET_PTR(PTR(b) - static_cast<intptr_t>(INT(c)));
+      ++ip;
+      NEXT();
+    }
+#define COMPARISON(name, op, type)                                            \
+  HANDLER(name) {                                                             \
+    SET_INT(type(b) op type(c));                                              \
+    ++ip;                                                                     \
+    NEXT();                                                                   \
+  }
+    COMPARISON(Eq, ==, INT)
+    COMPARISON(Ne, !=, INT)
+    COMPARISON(Lt, <, INT)
+    COMPARISON(Le, <=, INT)
+    COMPARISON(Gt, >, INT)
+    COMPARISON(Ge, >=, INT)
+    COMPARISON(EqPtr, ==, PTR)
+    COMPARISON(NePtr, !=, PTR)
+    COMPARISON(LtPtr, <, PTR)
+    COMPARISON(LePtr, <=, PTR)
+    COMPARISON(GtPtr, >, PTR)
+    COMPARISON(GePtr, >=, PTR)
+#undef COMPARISON
+    HANDLER(Jump) {
+      ip = code + ip->a;
+      NEXT();
+    }
+    HANDLER(BackEdge) {
+      if (++backEdges[ip->b] >= hotLoopThreshold && hotLoopHandler &&
+          hotLoopHandler(ip->b, fp))
+        return;
+      ip = code + ip->a;
+      NEXT();
+    }
+    HANDLER(JumpIfZero) {
+      ip = INT(b) == 0 ? code + ip->a : ip + 1;
+      NEXT();
+    }
+#define JUMP_UNLESS(name, op)                                                 \
+  HANDLER(name) {                                                             \
+    ip = INT(b) op INT(c) ? ip + 1 : code + ip->a;                            \
+    NEXT();                                                                   \
+  }
+    JUMP_UNLESS(JumpUnlessEq, ==)
+    JUMP_UNLESS(JumpUnlessNe, !=)
+    JUMP_UNLESS(JumpUnlessLt, <)
+    JUMP_UNLESS(JumpUnlessLe, <=)
+    JUMP_UNLESS(JumpUnlessGt, >)
+    JUMP_UNLESS(JumpUnlessGe, >=)
+#undef JUMP_UNLESS
+    HANDLER(Call) {
+      const auto &call = bytecode.calls[ip->a];
+      intptr_t args[maxCallArguments];
+      for (size_t i = 0; i < call.arguments.size(); ++i) {
+        auto slot = fp + call.arguments[i];
+        args[i] = call.wide[i] ? readSlot<intptr_t>(slot)
+                               : static_cast<intptr_t>(readSlot<int>(slot));
+      }
+      callHostFunction(call.address, args, call.arguments.size());
+      ++ip;
+      NEXT();
+    }
+    HANDLER(Halt) { return; }
+
+#ifndef COGECS_COMPUTED_GOTO
+      }
+    }
+#endif
+#undef HANDLER
+#undef NEXT
+#undef WRAP
+#undef SET_PTR
+#undef SET_INT
+#undef PTR
+#undef INT
+  }
+
+private:
+  const Bytecode &bytecode;
+  Profile *profile;
+  size_t hotLoopThreshold = std::numeric_limits<size_t>::max();
+  HotLoopHandler hotLoopHandler;
+};
+
+Bytecode compileBytecode(const StatementList &statements,
+                         const HostFunctions &functions) {
+  FrameLayoutPass frameLayout;
+  traverse(statements, frameLayout);
+
+  SemanticChecker semaChecker;
+  traverse(statements, semaChecker);
+
+  std::set<const Statement *> fusedComparisons;
+  for (auto index : findFusedComparisons(statements))
+    fusedComparisons.insert(statements[index].get());
+
+  BytecodeCompiler compiler(frameLayout, functions, fusedComparisons);
+  traverse(statements, compiler);
+  return compiler.finish();
+}
 
-void eval(std::vector<int> *v, const StatementList &statementList) {}
+// runs flattened program without generating machine code
+void eval(const StatementList &statements, const HostFunctions &functions) {
+  auto bytecode = compileBytecode(statements, functions);
+  Interpreter(bytecode).run();
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+// JitProfiler tells Linux perf where compiled code is, so samples in
+// anonymous executable memory are attributed to programs and functions
+// instead of unknown addresses. It writes either or both of:
+//   - perf map, /tmp/perf-<pid>.map, a line "start size name" per code,
+//     used by perf report directly
+//   - jitdump, jit-<pid>.dump, which keeps code bytes too, so perf can
+//     annotate it after perf inject --jit
+//
+// Process wide profiler is configured by COGECS_PERF environment
+// variable, "map", "jitdump" or "map,jitdump". Jitdump is written to
+// COGECS_JITDUMP_DIR or current directory:
+//
+//   COGECS_PERF=jitdump perf record -k 1 compiler file.cgs run
+//   perf inject --jit -i perf.data -o perf.jit.data
+//   perf report -i perf.jit.data
+//
+// On other systems nothing is written.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct JitProfilerOptions {
+  // empty path disables the output
+  std::string perfMapPath;
+  std::string jitDumpPath;
+};
+
+// jitdump format of perf (tools/perf/Documentation/jitdump-specification)
+constexpr uint32_t jitDumpMagic = 0x4A695444;
+constexpr uint32_t jitDumpVersion = 1;
+constexpr uint32_t jitCodeLoad = 0;
+constexpr uint32_t jitCodeClose = 3;
+
+struct JitDumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t totalSize;
+  uint32_t elfMachine;
+  uint32_t padding;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitDumpRecordHeader {
+  uint32_t id;
+  uint32_t totalSize;
+  uint64_t timestamp;
+};
+
+struct JitDumpCodeLoad {
+  JitDumpRecordHeader header;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t codeAddress;
+  uint64_t codeSize;
+  uint64_t codeIndex;
+  // followed by name with terminating zero and code bytes
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+constexpr uint32_t hostElfMachine = 62; // EM_X86_64
+#else
+constexpr uint32_t hostElfMachine = 3; // EM_386
+#endif
+
+struct JitProfiler {
+  explicit JitProfiler(const JitProfilerOptions &options = {}) {
+#ifdef __linux__
+    if (!options.perfMapPath.empty())
+      perfMap = std::fopen(options.perfMapPath.c_str(), "a");
+    if (!options.jitDumpPath.empty())
+      openJitDump(options.jitDumpPath);
+#else
+    (void)options;
+#endif
+  }
+  JitProfiler(const JitProfiler &) = delete;
+  JitProfiler &operator=(const JitProfiler &) = delete;
+
+  ~JitProfiler() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (perfMap)
+      std::fclose(perfMap);
+    if (jitDump) {
+      JitDumpRecordHeader close{jitCodeClose, sizeof(JitDumpRecordHeader),
+                                timestamp()};
+      std::fwrite(&close, sizeof(close), 1, jitDump);
+      std::fclose(jitDump);
+    }
+#ifdef __linux__
+    if (marker)
+      munmap(marker, markerSize);
+#endif
+  }
+
+  bool isEnabled() const { return perfMap || jitDump; }
+
+  // code of given size was made executable at address
+  void codeLoaded(const std::string &name, const void *code, size_t size) {
+    if (!isEnabled())
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto address = reinterpret_cast<uintptr_t>(code);
+    if (perfMap) {
+      std::fprintf(perfMap, "%llx %llx %s\n",
+                   static_cast<unsigned long long>(address),
+                   static_cast<unsigned long long>(size), name.c_str());
+      // perf reads the map after process exits, maybe by a crash
+      std::fflush(perfMap);
+    }
+    if (jitDump) {
+      JitDumpCodeLoad record{};
+      record.header.id = jitCodeLoad;
+      record.header.totalSize =
+          static_cast<uint32_t>(sizeof(record) + name.size() + 1 + size);
+      record.header.timestamp = timestamp();
+      record.pid = processId();
+      record.tid = threadId();
+      record.vma = address;
+      record.codeAddress = address;
+      record.codeSize = size;
+      record.codeIndex = codeIndex++;
+      std::fwrite(&record, sizeof(record), 1, jitDump);
+      std::fwrite(name.c_str(), name.size() + 1, 1, jitDump);
+      std::fwrite(code, size, 1, jitDump);
+      std::fflush(jitDump);
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::FILE *perfMap = nullptr;
+  std::FILE *jitDump = nullptr;
+  void *marker = nullptr;
+  size_t markerSize = 0;
+  uint64_t codeIndex = 0;
+
+  void openJitDump(const std::string &path) {
+#ifdef __linux__
+    jitDump = std::fopen(path.c_str(), "w+");
+    if (!jitDump)
+      return;
+    JitDumpHeader header{jitDumpMagic, jitDumpVersion, sizeof(JitDumpHeader),
+                         hostElfMachine, 0, processId(), timestamp(), 0};
+    std::fwrite(&header, sizeof(header), 1, jitDump);
+    std::fflush(jitDump);
+    // perf record finds the dump by this executable mapping of it
+    markerSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    marker = mmap(nullptr, markerSize, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                  fileno(jitDump), 0);
+    if (marker == MAP_FAILED)
+      marker = nullptr;
+#else
+    (void)path;
+#endif
+  }
+
+  // clock of perf record -k 1
+  static uint64_t timestamp() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  static uint32_t processId() {
+#ifdef __linux__
+    return static_cast<uint32_t>(getpid());
+#else
+    return 0;
+#endif
+  }
+
+  static uint32_t threadId() {
+#ifdef __linux__
+    return static_cast<uint32_t>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+  }
+};
+
+// options of process wide profiler from environment
+JitProfilerOptions jitProfilerOptionsFromEnvironment() {
+  JitProfilerOptions options;
+  auto perf = std::getenv("COGECS_PERF");
+  if (!perf)
+    return options;
+  std::string outputs = perf;
+  auto pid = std::to_string(
+#ifdef __linux__
+      getpid()
+#else
+      0
+#endif
+  );
+  if (outputs.find("map") != std::string::npos)
+    options.perfMapPath = "/tmp/perf-" + pid + ".map";
+  if (outputs.find("jitdump") != std::string::npos) {
+    auto directory = std::getenv("COGECS_JITDUMP_DIR");
+    options.jitDumpPath =
+        std::string(directory ? directory : ".") + "/jit-" + pid + ".dump";
+  }
+  return options;
+}
+
+// profiler that JitCompiler reports compiled code to
+JitProfiler &jitProfiler() {
+  static JitProfiler profiler(jitProfilerOptionsFromEnvironment());
+  return profiler;
+}
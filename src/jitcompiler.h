@@ -8,12 +8,13 @@
 #include <iterator>
 #include <iostream>
 #include <cstddef>
-#ifdef _WIN32
-#include <Windows.h>
-#else
-#include <sys/mman.h>
-#endif
+#include <map>
 #include <cstring>
+#include <cstdint>
+#include <utility>
+#include "code_heap.h"
+#include "jit_profiler.h"
+#include "pass_stats.h"
 
 std::string to_hex(const std::byte *buffer, size_t size) {
   using namespace std;
@@ -46,46 +47,318 @@ std::string to_hex_ext(const std::byte *buffer, size_t size) {
   return str.str();
 }
 
+// instruction set of generated code
+enum class Target { x86, x86_64 };
+
+// only code for target of running process can be executed
+constexpr Target hostTarget =
+    sizeof(void *) == 8 ? Target::x86_64 : Target::x86;
+
+constexpr size_t pointerSize(Target target) {
+  return target == Target::x86_64 ? 8 : 4;
+}
+
+// x86 general purpose registers in encoding order,
+// 64 bit registers have the same encoding (EAX is rax and so on),
+// R8 - R15 require REX prefix and exist only on x86-64
+enum X86Register {
+  EAX = 0,
+  ECX = 1,
+  EDX = 2,
+  EBX = 3,
+  ESP = 4,
+  EBP = 5,
+  ESI = 6,
+  EDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R10 = 10,
+  R11 = 11,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15
+};
+
+// REX prefix bits
+constexpr unsigned char rexPrefix = 0x40;
+constexpr unsigned char rexW = 0x08;
+constexpr unsigned char rexR = 0x04;
+constexpr unsigned char rexX = 0x02;
+constexpr unsigned char rexB = 0x01;
+
+// jump target in X86InstrVector, created by make_label
+struct Label {
+  size_t id;
+};
+
+constexpr size_t unboundPosition = static_cast<size_t>(-1);
+
+// upper bound of bytes appended by X86InstrVector::emit_literal_pool
+size_t literalPoolCapacity(Target target, size_t calls, size_t literals) {
+  auto entrySize = pointerSize(target);
+  // each call can get stub jmp [rip + disp32] with its own entry
+  size_t stubs = target == Target::x86_64 ? calls : 0;
+  // entries are aligned to their size
+  return stubs * (6 + entrySize) + literals * entrySize + entrySize;
+}
+
+// code bytes, either in ordinary memory or in a block of code heap
+using CodeBytes = std::vector<std::byte, CodeHeapAllocator<std::byte>>;
+
 struct X86InstrVector {
-  using const_iterator = std::vector<std::byte>::const_iterator;
-  using iterator = std::vector<std::byte>::iterator;
+  using const_iterator = CodeBytes::const_iterator;
+  using iterator = CodeBytes::iterator;
+
+  // code emitted into code heap can be made executable in place
+  explicit X86InstrVector(Target target = hostTarget,
+                          CodeHeap *codeHeap = nullptr)
+      : code_target(target),
+        code_vector(CodeHeapAllocator<std::byte>(codeHeap)) {}
+
+  Target target() const { return code_target; }
+
+  // code heap holding the code, nullptr for ordinary memory
+  CodeHeap *heap() const { return code_vector.get_allocator().heap; }
+
+  // emitting code doesn't allocate as long as it fits in reserved space
+  void reserve(size_t bytes) { code_vector.reserve(bytes); }
 
   void push_function_prolog() {
-    push_back({static_cast<std::byte>(0x55), static_cast<std::byte>(0x8B),
-               static_cast<std::byte>(0xEC)});
+    // push ebp
+    push_back(static_cast<std::byte>(0x55));
+    // mov ebp, esp
+    if (code_target == Target::x86_64)
+      push_back(static_cast<std::byte>(rexPrefix | rexW));
+    push_back(static_cast<std::byte>(0x8B));
+    push_back(static_cast<std::byte>(0xEC));
   }
 
   void push_function_epilog() {
-    push_back({static_cast<std::byte>(0x5D), static_cast<std::byte>(0xC3)});
+    push_back(static_cast<std::byte>(0x5D));
+    push_back(static_cast<std::byte>(0xC3));
   }
 
   void push_back(std::byte b) { code_vector.push_back(b); }
 
   void push_back(const std::vector<std::byte> &bytes) {
-    std::copy(bytes.begin(), bytes.end(), std::back_inserter(code_vector));
+    code_vector.insert(code_vector.end(), bytes.begin(), bytes.end());
+  }
+  void push_back(const CodeBytes &bytes) {
+    code_vector.insert(code_vector.end(), bytes.begin(), bytes.end());
+  }
+
+  // little endian 32 bit value
+  void push_int32(int value) {
+    for (size_t i = 0; i < 4; ++i)
+      push_back(
+          static_cast<std::byte>(static_cast<unsigned>(value) >> (8 * i)));
+  }
+
+  // absolute address, 64 bit on x86-64
+  void push_address(const void *addr) {
+    auto value = reinterpret_cast<uintptr_t>(addr);
+    for (size_t i = 0; i < pointerSize(code_target); ++i)
+      push_back(static_cast<std::byte>(
+          i < sizeof(value) ? value >> (8 * i) : 0));
   }
 
+  // mov eax, [address] and mov [address], eax with absolute address
+  // which is 64 bit on x86-64
   void push_argument(void *argument) {
     push_back(static_cast<std::byte>(0xA1));
-    push_back(get_address(argument));
+    push_address(argument);
   }
 
   void move_result_to(void *address) {
     push_back(static_cast<std::byte>(0xA3));
-    push_back(get_address(address));
+    push_address(address);
+  }
+
+  std::vector<std::byte> get_address(const void *addr) const {
+    X86InstrVector bytes(code_target);
+    bytes.push_address(addr);
+    return bytes.instruction_vector();
   }
 
-  std::vector<std::byte> get_address(void *addr) {
-    std::vector<std::byte> result;
-    auto addrBytes = intToBytes(reinterpret_cast<size_t>(addr));
-    std::copy(addrBytes.rbegin(), addrBytes.rend(), std::back_inserter(result));
+  std::vector<std::byte> int_to_bytes(int value) const {
+    X86InstrVector bytes(code_target);
+    bytes.push_int32(value);
+    return bytes.instruction_vector();
+  }
+
+  // label with given name, the same one for each call with that name
+  Label make_label(const std::string &name) {
+    auto it = label_ids.find(name);
+    if (it != label_ids.end())
+      return Label{it->second};
+    Label label{label_names.size()};
+    label_ids.emplace(name, label.id);
+    label_names.push_back(name);
+    label_offsets.push_back(unboundPosition);
+    fixups.emplace_back();
+    return label;
+  }
+
+  // label without name, for jumps inside code of a single statement
+  Label make_label() {
+    Label label{label_names.size()};
+    label_names.emplace_back();
+    label_offsets.push_back(unboundPosition);
+    fixups.emplace_back();
+    return label;
+  }
+
+  // binds label to current position and fixes jumps that refer to it
+  void bind_label(Label label) {
+    label_offsets[label.id] = size();
+    for (auto end : fixups[label.id])
+      patch_rel32(end, size());
+    fixups[label.id].clear();
+  }
+  void bind_label(const std::string &label) { bind_label(make_label(label)); }
+
+  // jmp label (e9 rel32)
+  void push_jump(Label label) {
+    push_back(static_cast<std::byte>(0xE9));
+    push_rel32(label);
+  }
+  void push_jump(const std::string &label) { push_jump(make_label(label)); }
+
+  // jcc label (0f 8x rel32), condition is x86 condition code
+  void push_conditional_jump(unsigned char condition, Label label) {
+    push_back(static_cast<std::byte>(0x0F));
+    push_back(static_cast<std::byte>(0x80 | condition));
+    push_rel32(label);
+  }
+  void push_conditional_jump(unsigned char condition,
+                             const std::string &label) {
+    push_conditional_jump(condition, make_label(label));
+  }
+
+  // call rel32 to host function, displacement is resolved by link
+  // when final address of code is known
+  void push_call(const void *address) {
+    push_back(static_cast<std::byte>(0xE8));
+    push_int32(0);
+    add_call_reference(size(), address);
+  }
+
+  // direct call, end is position just after rel32
+  void add_call_reference(size_t end, const void *address,
+                          size_t stub = unboundPosition) {
+    calls.push_back(CallReference{end, address, stub});
+  }
+
+  struct CallReference {
+    size_t end;
+    const void *address;
+    // jmp [rip + disp32] used when address is out of rel32 range
+    size_t stub;
+  };
+
+  const std::vector<CallReference> &call_references() const { return calls; }
+
+  // reference to literal pool entry, end is position just after disp32
+  void add_literal_reference(size_t end, const void *address) {
+    literals.push_back(std::make_pair(end, address));
+  }
+
+  const std::vector<std::pair<size_t, const void *>> &
+  literal_references() const {
+    return literals;
+  }
+
+  // absolute address written at position, e.g. literal pool entry
+  void add_absolute_reference(size_t position, const void *address) {
+    absolutes.push_back(std::make_pair(position, address));
+  }
+
+  const std::vector<std::pair<size_t, const void *>> &
+  absolute_references() const {
+    return absolutes;
+  }
+
+  // overwrites absolute address at position
+  void patch_address(size_t position, const void *address) {
+    auto bytes = get_address(address);
+    std::copy(bytes.begin(), bytes.end(), code_vector.begin() + position);
+  }
+
+  // Appends stubs of direct calls and addresses used by rip relative
+  // instructions after code and fixes their displacements. Has to be
+  // the last step, as nothing can be inserted between code and pool.
+  void emit_literal_pool() {
+    // on x86-64 host function can be further than 2GB from code,
+    // such call goes through stub which jumps to address from pool
+    if (code_target == Target::x86_64) {
+      std::map<const void *, size_t> stubs;
+      for (auto &call : calls) {
+        if (!stubs.count(call.address)) {
+          stubs[call.address] = size();
+          push_back(static_cast<std::byte>(0xFF));
+          push_back(static_cast<std::byte>(0x25));
+          push_int32(0);
+          add_literal_reference(size(), call.address);
+        }
+        call.stub = stubs[call.address];
+      }
+    }
+    if (literals.empty())
+      return;
+    auto entrySize = pointerSize(code_target);
+    while (size() % entrySize != 0)
+      push_back(static_cast<std::byte>(0xCC)); // int3
+    std::map<const void *, size_t> entries;
+    for (const auto &reference : literals) {
+      if (entries.count(reference.second))
+        continue;
+      entries[reference.second] = size();
+      add_absolute_reference(size(), reference.second);
+      push_address(reference.second);
+    }
+    for (const auto &reference : literals)
+      patch_rel32(reference.first, entries[reference.second]);
+    literals.clear();
+  }
+
+  // Copies code to destination, where it's going to run at address,
+  // and resolves direct calls for that address. Destination can be
+  // the code itself, when it's linked in place.
+  void link(std::byte *destination, uintptr_t address) const {
+    if (destination != code_vector.data())
+      std::copy(code_vector.begin(), code_vector.end(), destination);
+    for (const auto &call : calls) {
+      auto target = reinterpret_cast<uintptr_t>(call.address);
+      // x86 addresses wrap around, so any call target is in range
+      auto rel = static_cast<long long>(target - (address + call.end));
+      if (code_target == Target::x86)
+        rel = static_cast<int>(static_cast<uint32_t>(rel));
+      if (rel < INT32_MIN || rel > INT32_MAX)
+        rel = static_cast<long long>(call.stub) - call.end;
+      for (size_t i = 0; i < 4; ++i)
+        destination[call.end - 4 + i] = static_cast<std::byte>(
+            static_cast<uint32_t>(rel) >> (8 * i));
+    }
+  }
+
+  // bound labels with their positions
+  std::map<std::string, size_t> label_positions() const {
+    std::map<std::string, size_t> result;
+    for (size_t id = 0; id < label_names.size(); ++id) {
+      if (label_offsets[id] != unboundPosition && !label_names[id].empty())
+        result[label_names[id]] = label_offsets[id];
+    }
     return result;
   }
 
-  std::vector<std::byte> int_to_bytes(int value) {
-    std::vector<std::byte> result;
-    auto addrBytes = intToBytes(value);
-    std::copy(addrBytes.rbegin(), addrBytes.rend(), std::back_inserter(result));
+  // labels that are used by jumps but were never bound
+  std::vector<std::string> unbound_labels() const {
+    std::vector<std::string> result;
+    for (size_t id = 0; id < label_names.size(); ++id) {
+      if (!fixups[id].empty())
+        result.push_back(label_names[id]);
+    }
     return result;
   }
 
@@ -100,65 +373,97 @@ struct X86InstrVector {
   iterator begin() { return code_vector.begin(); }
 
   size_t size() const { return code_vector.size(); }
+  const std::byte *data() const { return code_vector.data(); }
+  std::byte *data() { return code_vector.data(); }
 
-  std::vector<std::byte> instruction_vector() const { return code_vector; }
+  const CodeBytes &bytes() const { return code_vector; }
+
+  std::vector<std::byte> instruction_vector() const {
+    return std::vector<std::byte>(code_vector.begin(), code_vector.end());
+  }
+
+  // overwrites 32 bit displacement that ends at given position
+  void patch_rel32(size_t end, size_t target) {
+    auto value = static_cast<int>(target) - static_cast<int>(end);
+    for (size_t i = 0; i < 4; ++i)
+      code_vector[end - 4 + i] =
+          static_cast<std::byte>(static_cast<unsigned>(value) >> (8 * i));
+  }
 
 private:
-  std::vector<std::byte> code_vector;
-
-  std::vector<std::byte> intToBytes(int value) {
-    std::vector<std::byte> result;
-    result.push_back(static_cast<std::byte>(value >> 24));
-    result.push_back(static_cast<std::byte>(value >> 16));
-    result.push_back(static_cast<std::byte>(value >> 8));
-    result.push_back(static_cast<std::byte>(value));
-    return result;
+  Target code_target;
+  CodeBytes code_vector;
+  // labels are indexed by id
+  std::map<std::string, size_t> label_ids;
+  std::vector<std::string> label_names;
+  std::vector<size_t> label_offsets;
+  // positions just after rel32 of jumps to label which is not bound yet
+  std::vector<std::vector<size_t>> fixups;
+  // position just after disp32 and address it refers to
+  std::vector<std::pair<size_t, const void *>> literals;
+  std::vector<std::pair<size_t, const void *>> absolutes;
+  std::vector<CallReference> calls;
+
+  void push_rel32(Label label) {
+    push_int32(0);
+    if (label_offsets[label.id] != unboundPosition)
+      patch_rel32(size(), label_offsets[label.id]);
+    else
+      fixups[label.id].push_back(size());
   }
 };
 
+// Places code into executable memory of code heap, where it stays
+// until JitCompiler is destroyed. Code that was emitted into the same
+// heap and is given to JitCompiler is linked and made executable
+// in place, without copying.
 struct JitCompiler {
   typedef int (*pfunc)(void);
 
-#ifndef _WIN32
-  void *alloc_executable_memory(size_t size) {
-    void *ptr = mmap(0, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (ptr == reinterpret_cast<void *>(-1)) {
-      perror("mmap");
-      return NULL;
-    }
-    return ptr;
+  JitCompiler(const X86InstrVector &i_vector,
+              CodeHeap &codeHeap = defaultCodeHeap())
+      : heap(codeHeap), instr_vector(i_vector) {
+    size = instr_vector.size();
+    buf = heap.allocate(size);
   }
-#endif
-  JitCompiler(const X86InstrVector &i_vector)
-      : buf(nullptr), instr_vector(i_vector) {
+
+  JitCompiler(X86InstrVector &&i_vector, CodeHeap &codeHeap = defaultCodeHeap())
+      : heap(codeHeap), owned_vector(std::move(i_vector)),
+        instr_vector(owned_vector) {
     size = instr_vector.size();
-#ifdef _WIN32
-    buf = reinterpret_cast<std::byte *>(VirtualAllocEx(
-        GetCurrentProcess(), 0, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE));
-#else
-    buf = reinterpret_cast<std::byte *>(alloc_executable_memory(size));
-#endif
+    in_place = owned_vector.heap() == &heap && size > 0;
+    buf = in_place ? owned_vector.data() : heap.allocate(size);
   }
 
   ~JitCompiler() {
-#ifdef _WIN32
-    VirtualFreeEx(GetCurrentProcess(), buf, size, MEM_RELEASE);
-#else
-#endif
+    // block of code emitted in place is released with its vector
+    if (!in_place)
+      heap.release(buf);
   }
 
-  pfunc compile() {
-    memcpy(buf, &instr_vector.instruction_vector()[0], size);
+  // name identifies code for profilers, see jit_profiler.h
+  pfunc compile(const std::string &name = "program") {
+    // code is read only once it's executable
+    if (!compiled) {
+      PassTimer timer("jit compile");
+      instr_vector.link(buf, reinterpret_cast<uintptr_t>(buf));
+      heap.makeExecutable(buf);
+      jitProfiler().codeLoaded(name, buf, size);
+      compiled = true;
+      timer.count(size, "bytes");
+    }
     pfunc func = reinterpret_cast<pfunc>(buf);
     return func;
   }
 
 private:
+  CodeHeap &heap;
+  X86InstrVector owned_vector;
+  const X86InstrVector &instr_vector;
   std::byte *buf;
   size_t size;
-
-  const X86InstrVector &instr_vector;
+  bool in_place = false;
+  bool compiled = false;
 
   JitCompiler(const JitCompiler &);
   JitCompiler &operator=(const JitCompiler &);
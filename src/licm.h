@@ -0,0 +1,184 @@
+#pragma once
+
+// Loop invariant code motion hoists pure computations which operands
+// are not changed inside a loop to the loop preheader.
+// Computation is moved to a new variable declared in preheader and
+// original statement becomes a copy, so variable that was assigned
+// keeps its value on every path.
+//
+//                              var invariant__0:i32;
+//                              invariant__0 = a * b;
+//   label__2:                  label__2:
+//   ...                 ==>    ...
+//   x = a * b;                 x = invariant__0;
+//   goto label__2;             goto label__2;
+//
+// Division is hoisted only by a constant that can't trap, as loop
+// body may not be executed at all.
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "tools.h"
+#include "flow_graph.h"
+
+struct LoopInvariantCodeMotion {
+  explicit LoopInvariantCodeMotion(const StatementList &stmts)
+      : statements(stmts) {}
+
+  StatementList run() {
+    // each hoisting changes statement indexes,
+    // so graph is rebuilt after every transformed loop
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      ControlFlowGraph cfg(statements);
+      AllocationRegions regions(statements);
+      for (const auto &loop : findNaturalLoops(cfg)) {
+        if (hoistInvariants(cfg, regions, loop)) {
+          changed = true;
+          break;
+        }
+      }
+    }
+    return statements;
+  }
+
+  size_t numberOfHoistedExpressions() const { return hoisted; }
+
+private:
+  // copy x = invariant__N that replaced hoisted computation
+  struct HoistedCopy {
+    std::string variable;
+    size_t index;
+  };
+
+  // returns operand as it should be used in preheader
+  // or empty string if operand is not loop invariant
+  std::string invariantOperand(const ControlFlowGraph &cfg,
+                               const AllocationRegions &regions,
+                               const LoopSummary &summary,
+                               const std::map<std::string, HoistedCopy> &copies,
+                               const std::string &operand, size_t index,
+                               size_t preheaderIndex) const {
+    if (!isIdentifier(operand))
+      return operand;
+    if (summary.clobbersMemory)
+      return "";
+    auto copy = copies.find(operand);
+    if (copy != copies.end() && summary.assignments.at(operand) == 1) {
+      auto defBlock = cfg.blockOf(copy->second.index);
+      auto useBlock = cfg.blockOf(index);
+      bool dominates = defBlock == useBlock ? copy->second.index < index
+                                            : cfg.dominates(defBlock, useBlock);
+      if (dominates)
+        return copy->second.variable;
+    }
+    if (summary.isChanged(operand))
+      return "";
+    auto decl = regions.resolve(operand, index);
+    if (decl == noBlock || regions.resolve(operand, preheaderIndex) != decl)
+      return "";
+    return operand;
+  }
+
+  bool canBeSpeculated(const std::string &op, const std::string &divisor) {
+    if (op == "+" || op == "-" || op == "*" || op == "==" || op == "!=" ||
+        op == "<" || op == ">" || op == "<=" || op == ">=")
+      return true;
+    if (op == "/")
+      return !isIdentifier(divisor) && std::stoi(divisor) != 0 &&
+             std::stoi(divisor) != -1;
+    return false;
+  }
+
+  std::string getNextVariable() {
+    return "invariant__" + std::to_string(id++);
+  }
+
+  bool hoistInvariants(const ControlFlowGraph &cfg,
+                       const AllocationRegions &regions,
+                       const NaturalLoop &loop) {
+    if (!hasPreheader(cfg, loop))
+      return false;
+    auto summary = summarizeLoop(cfg, regions, loop);
+    size_t preheaderIndex = cfg.block(loop.header).begin;
+
+    std::map<std::string, HoistedCopy> copies;
+    StatementList preheader;
+    for (auto id : cfg.reversePostOrder()) {
+      if (!loop.contains(id))
+        continue;
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        auto lhs = assignedVariable(statements[i]);
+        if (lhs.empty())
+          continue;
+        const auto &children = cast<Expression>(statements[i])->getChilds();
+        if (!std::all_of(children.begin(), children.end(),
+                         [](const StatementPtr &child) {
+                           return is<BasicExpression>(child);
+                         }))
+          continue;
+        std::vector<std::string> operands;
+        for (size_t c = 2; c < children.size(); ++c)
+          operands.push_back(cast<BasicExpression>(children[c])->value);
+
+        std::vector<std::string> hoistedOperands;
+        if (operands.size() == 3 &&
+            canBeSpeculated(operands[1], operands[2])) {
+          hoistedOperands = {
+              invariantOperand(cfg, regions, summary, copies, operands[0], i,
+                               preheaderIndex),
+              operands[1],
+              invariantOperand(cfg, regions, summary, copies, operands[2], i,
+                               preheaderIndex)};
+        } else if (operands.size() == 2 && operands[0] == "!" &&
+                   isIdentifier(operands[1])) {
+          hoistedOperands = {operands[0],
+                             invariantOperand(cfg, regions, summary, copies,
+                                              operands[1], i, preheaderIndex)};
+        } else {
+          continue;
+        }
+        if (std::any_of(hoistedOperands.begin(), hoistedOperands.end(),
+                        [](const std::string &op) { return op.empty(); }))
+          continue;
+
+        auto scope = statements[preheaderIndex]->scope;
+        auto variable = getNextVariable();
+        auto decl = makeNode(VarDecl(scope, variable));
+        auto type = variableType(statements, regions, lhs, i);
+        cast<VarDecl>(decl)->type = type.empty() ? "i32" : type;
+        preheader.push_back(decl);
+
+        Expression::ElementsType elements = {
+            makeNode(BasicExpression(scope, variable)),
+            makeNode(BasicExpression(scope, "="))};
+        for (const auto &op : hoistedOperands)
+          elements.push_back(makeNode(BasicExpression(scope, op)));
+        preheader.push_back(makeNode(Expression(scope, elements)));
+
+        auto stmtScope = statements[i]->scope;
+        statements[i] = makeNode(
+            Expression(stmtScope, {makeNode(BasicExpression(stmtScope, lhs)),
+                                   makeNode(BasicExpression(stmtScope, "=")),
+                                   makeNode(BasicExpression(stmtScope,
+                                                            variable))}));
+        copies[lhs] = HoistedCopy{variable, i};
+        ++hoisted;
+      }
+    }
+    if (preheader.empty())
+      return false;
+    statements.insert(statements.begin() + preheaderIndex, preheader.begin(),
+                      preheader.end());
+    return true;
+  }
+
+  StatementList statements;
+  size_t id = 0;
+  size_t hoisted = 0;
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+// Module compiles every function declared in source to native code
+// with its own entry point, so host calls the functions directly, as
+// many times as it needs, without running the program:
+//
+//   Module module(source, functions);
+//   auto add = module.get<int(int, int)>("add");
+//   auto sum = add(1, 2);
+//
+// Parameters and result are ints passed by calling convention of the
+// host (cdecl on x86, System V on x86-64 with at most six parameters).
+// Function returns value of its return statement or 0 without one.
+// Top level statements of the source are not compiled. Calls of small
+// leaf functions are inlined, other calls between functions of the
+// module aren't supported.
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "ast.h"
+#include "tools.h"
+#include "compiler.h"
+#include "inliner.h"
+#include "cfg_flatten.h"
+#include "optimizer.h"
+#include "host_functions.h"
+#include "code_heap.h"
+#include "code_emitter.h"
+#include "jitcompiler.h"
+
+struct ModuleException : public std::runtime_error {
+  ModuleException(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// signatures functions of module can be called with
+template <typename Signature> struct NativeSignature {
+  static constexpr bool isValid = false;
+};
+
+template <typename... Args> struct NativeSignature<int(Args...)> {
+  static constexpr bool isValid = (std::is_same_v<Args, int> && ...);
+  static constexpr size_t arity = sizeof...(Args);
+};
+
+struct Module {
+  Module(const std::string &source, const HostFunctions &hostFunctions,
+         CodeHeap &codeHeap = defaultCodeHeap())
+      : functionMap(hostFunctions), heap(codeHeap) {
+    auto program = parseSource(source);
+    std::map<std::string, const FunctionDecl *> declarations;
+    for (const auto &stmt : program) {
+      if (is<FunctionDecl>(stmt))
+        declarations[cast<FunctionDecl>(stmt)->name] = cast<FunctionDecl>(stmt);
+    }
+    // bodies with calls inlined, function inlined at all its calls is
+    // removed from program, but it's a leaf that is compiled as it is
+    FunctionInliner inliner(program);
+    auto inlined = inliner.run();
+    for (const auto &stmt : inlined) {
+      if (is<FunctionDecl>(stmt))
+        declarations[cast<FunctionDecl>(stmt)->name] = cast<FunctionDecl>(stmt);
+    }
+    for (const auto &declaration : declarations)
+      compileFunction(*declaration.second);
+  }
+  Module(const Module &) = delete;
+  Module &operator=(const Module &) = delete;
+
+  // entry point of function, which stays valid while module exists
+  template <typename Signature> Signature *get(const std::string &name) const {
+    static_assert(NativeSignature<Signature>::isValid,
+                  "functions of module take and return int");
+    const auto &function = find(name);
+    if (function.parameters.size() != NativeSignature<Signature>::arity)
+      throw ModuleException("wrong number of parameters : " + name);
+    return reinterpret_cast<Signature *>(function.address);
+  }
+
+  bool contains(const std::string &name) const {
+    return functions.count(name) != 0;
+  }
+
+  std::vector<std::string> getFunctionNames() const {
+    std::vector<std::string> names;
+    for (const auto &function : functions)
+      names.push_back(function.first);
+    return names;
+  }
+
+private:
+  struct Function {
+    std::vector<std::string> parameters;
+    std::unique_ptr<JitCompiler> jit;
+    JitCompiler::pfunc address = nullptr;
+  };
+
+  HostFunctions functionMap;
+  CodeHeap &heap;
+  std::map<std::string, Function> functions;
+
+  const Function &find(const std::string &name) const {
+    auto function = functions.find(name);
+    if (function == functions.end())
+      throw ModuleException("unknown function : " + name);
+    return function->second;
+  }
+
+  // parameters are declared as variables enclosing the body
+  void compileFunction(const FunctionDecl &declaration) {
+    StatementList body;
+    for (const auto &parameter : declaration.parameters) {
+      auto decl = makeNode(VarDecl(declaration.scope, parameter));
+      cast<VarDecl>(decl)->type = "i32";
+      body.push_back(decl);
+    }
+    body.insert(body.end(), declaration.statements.begin(),
+                declaration.statements.end());
+    CFGFlattener flattener;
+    traverse(body, flattener);
+    auto code =
+        emitFunctionCode(optimize(flattener.getStatements()),
+                         declaration.parameters, functionMap, hostTarget,
+                         &heap);
+
+    auto &function = functions[declaration.name];
+    function.parameters = declaration.parameters;
+    function.jit = std::make_unique<JitCompiler>(std::move(code), heap);
+    function.address = function.jit->compile(declaration.name);
+  }
+};
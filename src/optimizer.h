@@ -0,0 +1,28 @@
+#pragma once
+
+// Optimizer runs transformation passes on flattened code
+// just before machine code emission
+
+#include "ast.h"
+#include "value_numbering.h"
+#include "licm.h"
+#include "strength_reduction.h"
+#include "pass_stats.h"
+
+StatementList optimize(const StatementList &statements) {
+  PassTimer numbering("value numbering");
+  ValueNumbering valueNumbering(statements);
+  auto numbered = valueNumbering.run();
+  numbering.stop();
+
+  PassTimer motion("licm");
+  LoopInvariantCodeMotion licm(numbered);
+  auto hoisted = licm.run();
+  motion.stop();
+
+  PassTimer reduction("strength reduction");
+  StrengthReduction strengthReduction(hoisted);
+  auto reduced = strengthReduction.run();
+  reduction.count(reduced.size(), "statements");
+  return reduced;
+}
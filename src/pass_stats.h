@@ -0,0 +1,200 @@
+#pragma once
+
+// PassStatistics records wall time, heap allocations and size of result
+// of each compiler pass, to see where compile latency goes. Passes are
+// measured by PassTimer, which records into statistics active on its
+// thread and does nothing without them:
+//
+//   PassStatistics stats;
+//   activePassStatistics() = &stats;
+//   {
+//     PassTimer timer("flatten");
+//     traverse(statements, visitor);
+//     timer.count(visitor.getStatements().size(), "statements");
+//   }
+//   stats.print(std::cerr);
+//
+// Allocations are counted only by executable that replaces global
+// operator new with one calling countAllocation and sets it as
+// d_allocation_hook of the parser, which allocates with malloc (driver
+// does both), otherwise they are 0. Reallocation is counted as a new
+// allocation of its size.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ast.h"
+#include "nullvisitor.h"
+
+struct AllocationCounters {
+  std::atomic<size_t> allocations{0};
+  std::atomic<size_t> bytes{0};
+};
+
+// counters of the whole process, used by operator new
+AllocationCounters &allocationCounters() {
+  static AllocationCounters counters;
+  return counters;
+}
+
+void countAllocation(size_t size) {
+  auto &counters = allocationCounters();
+  counters.allocations.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+struct PassRecord {
+  std::string name;
+  std::chrono::nanoseconds time{0};
+  size_t allocations = 0;
+  size_t allocatedBytes = 0;
+  // size of result, e.g. nodes of AST or bytes of code, 0 without one
+  size_t count = 0;
+  std::string unit;
+
+  double milliseconds() const { return time.count() / 1e6; }
+};
+
+struct PassStatistics {
+  void add(PassRecord record) { passes.push_back(std::move(record)); }
+
+  const std::vector<PassRecord> &records() const { return passes; }
+
+  // sum of all passes, without count
+  PassRecord total() const {
+    PassRecord sum;
+    sum.name = "total";
+    for (const auto &pass : passes) {
+      sum.time += pass.time;
+      sum.allocations += pass.allocations;
+      sum.allocatedBytes += pass.allocatedBytes;
+    }
+    return sum;
+  }
+
+  // table for humans
+  void print(std::ostream &out) const {
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-20s %10s %12s %12s  %s\n", "pass",
+                  "time (ms)", "allocations", "bytes", "size");
+    out << line;
+    auto printRecord = [&](const PassRecord &record) {
+      std::snprintf(line, sizeof(line), "%-20s %10.3f %12zu %12zu",
+                    record.name.c_str(), record.milliseconds(),
+                    record.allocations, record.allocatedBytes);
+      out << line;
+      if (!record.unit.empty())
+        out << "  " << record.count << " " << record.unit;
+      out << "\n";
+    };
+    for (const auto &pass : passes)
+      printRecord(pass);
+    printRecord(total());
+  }
+
+  // names of passes and units are plain words, they aren't escaped
+  void printJson(std::ostream &out) const {
+    auto printRecord = [&](const PassRecord &record) {
+      out << "{\"name\": \"" << record.name
+          << "\", \"ms\": " << record.milliseconds()
+          << ", \"allocations\": " << record.allocations
+          << ", \"allocatedBytes\": " << record.allocatedBytes;
+      if (!record.unit.empty())
+        out << ", \"count\": " << record.count << ", \"unit\": \""
+            << record.unit << "\"";
+      out << "}";
+    };
+    out << "{\"passes\": [";
+    for (size_t i = 0; i < passes.size(); ++i) {
+      out << (i ? ",\n  " : "\n  ");
+      printRecord(passes[i]);
+    }
+    out << "],\n \"total\": ";
+    printRecord(total());
+    out << "}\n";
+  }
+
+private:
+  std::vector<PassRecord> passes;
+};
+
+// statistics passes on this thread record into, nullptr disables them
+PassStatistics *&activePassStatistics() {
+  thread_local PassStatistics *statistics = nullptr;
+  return statistics;
+}
+
+// measures the pass from construction to destruction or stop
+struct PassTimer {
+  explicit PassTimer(const char *name) : statistics(activePassStatistics()) {
+    if (!statistics)
+      return;
+    record.name = name;
+    auto &counters = allocationCounters();
+    allocations = counters.allocations.load(std::memory_order_relaxed);
+    allocatedBytes = counters.bytes.load(std::memory_order_relaxed);
+    start = std::chrono::steady_clock::now();
+  }
+  PassTimer(const PassTimer &) = delete;
+  PassTimer &operator=(const PassTimer &) = delete;
+
+  ~PassTimer() { stop(); }
+
+  // ends the pass before end of scope
+  void stop() {
+    if (!statistics)
+      return;
+    record.time = std::chrono::steady_clock::now() - start;
+    auto &counters = allocationCounters();
+    record.allocations =
+        counters.allocations.load(std::memory_order_relaxed) - allocations;
+    record.allocatedBytes =
+        counters.bytes.load(std::memory_order_relaxed) - allocatedBytes;
+    statistics->add(std::move(record));
+    statistics = nullptr;
+  }
+
+  // size of result of the pass
+  void count(size_t value, const char *unit) {
+    if (!statistics)
+      return;
+    record.count = value;
+    record.unit = unit;
+  }
+
+private:
+  PassStatistics *statistics;
+  PassRecord record;
+  size_t allocations = 0;
+  size_t allocatedBytes = 0;
+  std::chrono::steady_clock::time_point start;
+};
+
+// counts statements and expressions of AST
+struct NodeCounter : public NullVisitor {
+  void visitPre(const BasicStatement *) { ++nodes; }
+  void visitPre(const VarDecl *) { ++nodes; }
+  void visitPre(const BasicExpression *) { ++nodes; }
+  void visitPre(const Expression *) { ++nodes; }
+  void visitPre(const IfStatement *) { ++nodes; }
+  void visitPre(const WhileLoop *) { ++nodes; }
+  void visitPre(const BlockStatement *) { ++nodes; }
+  void visitPre(const LabelStatement *) { ++nodes; }
+  void visitPre(const GotoStatement *) { ++nodes; }
+  void visitPre(const FunctionCall *) { ++nodes; }
+  void visitPre(const FunctionDecl *) { ++nodes; }
+  void visitPre(const ReturnStatement *) { ++nodes; }
+
+  size_t nodes = 0;
+};
+
+size_t countNodes(const StatementList &statements) {
+  NodeCounter counter;
+  traverse(statements, counter);
+  return counter.nodes;
+}
@@ -0,0 +1,470 @@
+#pragma once
+
+// Peephole optimizer works on machine code produced by Basicx86Emitter.
+// Code is decoded into instructions, relative jumps are turned into
+// references to target instructions, so removing an instruction only
+// requires jumps to be encoded again with new displacements.
+//
+// Patterns:
+//   mov x, reg; mov reg, x          - load of just stored value
+//   mov eax, a; mov eax, b          - first write to eax is dead
+//   pushf ... popf                  - flags are never used across
+//                                     statements, so saves are useless
+//   jmp next                        - jump to following instruction
+//
+// Afterwards jumps are relaxed, each jump which displacement fits
+// in a byte gets short form (eb rel8 or 7x rel8).
+// Instruction which is a jump target or label position is never removed
+// as a second instruction of a pattern, as it can be reached from
+// another path. Code that can't be decoded is left unchanged.
+// On x86-64 instruction can start with REX prefix, patterns look at
+// opcode and ModRM that follow it and require equal prefixes.
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <cstddef>
+#include "jitcompiler.h"
+
+constexpr size_t noTarget = static_cast<size_t>(-1);
+
+struct X86Instruction {
+  // offset in original code
+  size_t offset = 0;
+  std::vector<std::byte> bytes;
+  // relative jump has displacement of relSize bytes at the end
+  size_t relSize = 0;
+  // index of target instruction (instructions.size() for end of code)
+  size_t target = noTarget;
+  bool removed = false;
+  // REX prefix or 0 when there is none
+  unsigned char rex = 0;
+
+  // i-th byte after prefix
+  unsigned char byte(size_t i) const {
+    i += prefixLength();
+    return i < bytes.size() ? static_cast<unsigned char>(bytes[i]) : 0;
+  }
+  size_t prefixLength() const { return rex != 0 ? 1 : 0; }
+  bool isJump() const { return relSize != 0; }
+  bool isUnconditionalJump() const {
+    return isJump() && (byte(0) == 0xE9 || byte(0) == 0xEB);
+  }
+};
+
+// length of ModRM byte with SIB and displacement
+size_t modrmLength(const CodeBytes &code, size_t pos) {
+  if (pos >= code.size())
+    return 0;
+  auto modrm = static_cast<unsigned char>(code[pos]);
+  auto mod = modrm >> 6;
+  auto rm = modrm & 7;
+  size_t length = 1;
+  if (mod != 3 && rm == 4) {
+    if (pos + 1 >= code.size())
+      return 0;
+    ++length;
+    if (mod == 0 && (static_cast<unsigned char>(code[pos + 1]) & 7) == 5)
+      length += 4;
+  }
+  if (mod == 0 && rm == 5)
+    length += 4;
+  if (mod == 1)
+    length += 1;
+  if (mod == 2)
+    length += 4;
+  return length;
+}
+
+// decodes instructions used by emitter,
+// returns false if code contains anything else
+bool decodeInstructions(const CodeBytes &code,
+                        std::vector<X86Instruction> &instructions,
+                        Target target = hostTarget) {
+  std::map<size_t, size_t> offsetToIndex;
+  std::vector<size_t> targetOffsets;
+  size_t start = 0;
+  while (start < code.size()) {
+    // 0x40 - 0x4F are inc/dec in 32 bit code, which emitter never uses
+    unsigned char rex = 0;
+    auto first = static_cast<unsigned char>(code[start]);
+    if (target == Target::x86_64 && (first & 0xF0) == rexPrefix)
+      rex = first;
+    size_t pos = start + (rex != 0 ? 1 : 0);
+    if (pos >= code.size())
+      return false;
+    auto op = static_cast<unsigned char>(code[pos]);
+    size_t length = 0;
+    size_t relSize = 0;
+    if ((op >= 0x50 && op <= 0x5F) || op == 0x99 || op == 0xC3 ||
+        op == 0x90) {
+      length = 1;
+    } else if (op == 0x66 && pos + 1 < code.size() &&
+               (code[pos + 1] == std::byte(0x9C) ||
+                code[pos + 1] == std::byte(0x9D))) {
+      length = 2;
+    } else if (op >= 0xB8 && op <= 0xBF && (rex & rexW) != 0) {
+      // mov r64, imm64
+      length = 9;
+    } else if ((op >= 0xB8 && op <= 0xBF) || op == 0x05 || op == 0x2D ||
+               op == 0x3D || op == 0x68 || op == 0xE8) {
+      length = 5;
+    } else if (op == 0x6A) {
+      length = 2;
+    } else if (op == 0x8B || op == 0x89 || op == 0x03 || op == 0x2B ||
+               op == 0x3B || op == 0x8D || op == 0x85 || op == 0x31 ||
+               op == 0x33 || op == 0x63 || op == 0xFF) {
+      length = 1 + modrmLength(code, pos + 1);
+    } else if (op == 0x83 || op == 0xC1 || op == 0x6B) {
+      length = 2 + modrmLength(code, pos + 1);
+    } else if (op == 0x81 || op == 0xC7 || op == 0x69) {
+      length = 5 + modrmLength(code, pos + 1);
+    } else if (op == 0xF7 && pos + 1 < code.size()) {
+      auto ext = (static_cast<unsigned char>(code[pos + 1]) >> 3) & 7;
+      length = 1 + modrmLength(code, pos + 1) + (ext == 0 ? 4 : 0);
+    } else if (op == 0xE9) {
+      length = 5;
+      relSize = 4;
+    } else if (op == 0xEB || (op >= 0x70 && op <= 0x7F)) {
+      length = 2;
+      relSize = 1;
+    } else if (op == 0x0F && pos + 1 < code.size()) {
+      auto op2 = static_cast<unsigned char>(code[pos + 1]);
+      if (op2 >= 0x80 && op2 <= 0x8F) {
+        length = 6;
+        relSize = 4;
+      } else if (op2 == 0xAF || (op2 >= 0x90 && op2 <= 0x9F) ||
+                 op2 == 0xB6 || op2 == 0xB7) {
+        length = 2 + modrmLength(code, pos + 2);
+      }
+    }
+    if (length == 0 || length <= relSize || pos + length > code.size() ||
+        (rex != 0 && relSize != 0))
+      return false;
+    length += pos - start;
+    pos = start;
+
+    X86Instruction instruction;
+    instruction.offset = pos;
+    instruction.bytes.assign(code.begin() + pos, code.begin() + pos + length);
+    instruction.relSize = relSize;
+    instruction.rex = rex;
+    long long target = 0;
+    if (relSize == 4) {
+      int rel = 0;
+      for (size_t i = 0; i < 4; ++i)
+        rel |= static_cast<int>(code[pos + length - 4 + i]) << (8 * i);
+      target = static_cast<long long>(pos + length) + rel;
+    }
+    if (relSize == 1) {
+      auto rel = static_cast<signed char>(code[pos + length - 1]);
+      target = static_cast<long long>(pos + length) + rel;
+    }
+    if (relSize != 0 &&
+        (target < 0 || target > static_cast<long long>(code.size())))
+      return false;
+    targetOffsets.push_back(relSize != 0 ? static_cast<size_t>(target)
+                                         : noTarget);
+    offsetToIndex[pos] = instructions.size();
+    instructions.push_back(instruction);
+    start += length;
+  }
+  offsetToIndex[code.size()] = instructions.size();
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    if (targetOffsets[i] == noTarget)
+      continue;
+    // jump into the middle of instruction
+    auto it = offsetToIndex.find(targetOffsets[i]);
+    if (it == offsetToIndex.end())
+      return false;
+    instructions[i].target = it->second;
+  }
+  return true;
+}
+
+struct PeepholeOptimizer {
+  explicit PeepholeOptimizer(const X86InstrVector &code,
+                             const std::map<std::string, size_t> &labels = {})
+      : code(code.bytes()), target(code.target()),
+        literals(code.literal_references()), calls(code.call_references()),
+        labels(labels) {}
+
+  // optimized code, emitted into code heap when it's given,
+  // with space reserved for its literal pool
+  X86InstrVector run(CodeHeap *heap = nullptr) {
+    X86InstrVector result(target, heap);
+    result.reserve(code.size() +
+                   literalPoolCapacity(target, calls.size(), literals.size()));
+    if (!decodeInstructions(code, instructions, target)) {
+      result.push_back(code);
+      for (const auto &literal : literals)
+        result.add_literal_reference(literal.first, literal.second);
+      for (const auto &call : calls)
+        result.add_call_reference(call.end, call.address);
+      return result;
+    }
+    findBarriers();
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      changed |= removeRedundantLoads();
+      changed |= removeDeadAccumulatorWrites();
+      changed |= removeJumpsToNext();
+    }
+    removeFlagSaves();
+    relaxJumps();
+
+    computeOffsets();
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      auto &instruction = instructions[i];
+      if (instruction.removed)
+        continue;
+      if (instruction.isJump()) {
+        auto end = newOffsets[i] + instruction.bytes.size();
+        auto rel = static_cast<int>(newOffsets[instruction.target]) -
+                   static_cast<int>(end);
+        auto relBytes = result.int_to_bytes(rel);
+        auto relStart = instruction.bytes.size() - instruction.relSize;
+        for (size_t b = 0; b < instruction.relSize; ++b)
+          instruction.bytes[relStart + b] = relBytes[b];
+      }
+      result.push_back(instruction.bytes);
+    }
+    // rip relative references and calls end together with their instruction
+    for (const auto &literal : literals)
+      result.add_literal_reference(translate(literal.first), literal.second);
+    for (const auto &call : calls)
+      result.add_call_reference(translate(call.end), call.address);
+    return result;
+  }
+
+  // position in optimized code of given position in original code
+  size_t translate(size_t position) const {
+    auto it = originalToNew.lower_bound(position);
+    if (it == originalToNew.end())
+      return position;
+    return it->second;
+  }
+
+  // labels with positions in optimized code
+  std::map<std::string, size_t> translatedLabels() const {
+    std::map<std::string, size_t> result;
+    for (const auto &label : labels)
+      result[label.first] = translate(label.second);
+    return result;
+  }
+
+  size_t numberOfRemovedInstructions() const {
+    size_t removed = 0;
+    for (const auto &instruction : instructions)
+      removed += instruction.removed ? 1 : 0;
+    return removed;
+  }
+
+private:
+  void findBarriers() {
+    std::set<size_t> labelOffsets;
+    for (const auto &label : labels)
+      labelOffsets.insert(label.second);
+    barriers.assign(instructions.size() + 1, false);
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      if (instructions[i].isJump())
+        barriers[instructions[i].target] = true;
+      if (labelOffsets.count(instructions[i].offset))
+        barriers[i] = true;
+    }
+  }
+
+  // next instruction that was not removed
+  size_t next(size_t i) const {
+    ++i;
+    while (i < instructions.size() && instructions[i].removed)
+      ++i;
+    return i;
+  }
+
+  void remove(size_t i) { instructions[i].removed = true; }
+
+  static bool isRegisterOperand(const X86Instruction &instruction) {
+    return (instruction.byte(1) >> 6) == 3;
+  }
+  // registers include REX extension bits
+  static int regField(const X86Instruction &instruction) {
+    return ((instruction.byte(1) >> 3) & 7) |
+           ((instruction.rex & rexR) != 0 ? 8 : 0);
+  }
+  static int rmField(const X86Instruction &instruction) {
+    return (instruction.byte(1) & 7) | ((instruction.rex & rexB) != 0 ? 8 : 0);
+  }
+
+  // r/m operand does not depend on value of register
+  static bool operandIndependentOf(const X86Instruction &instruction,
+                                   int reg) {
+    if (isRegisterOperand(instruction))
+      return rmField(instruction) != reg;
+    // [ebp + disp8]
+    return (instruction.byte(1) >> 6) == 1 && rmField(instruction) == 5;
+  }
+
+  static bool sameOperand(const X86Instruction &lhs,
+                          const X86Instruction &rhs) {
+    if (lhs.bytes.size() != rhs.bytes.size() || lhs.rex != rhs.rex ||
+        rmField(lhs) != rmField(rhs) ||
+        (lhs.byte(1) >> 6) != (rhs.byte(1) >> 6))
+      return false;
+    auto operand = lhs.prefixLength() + 2;
+    return std::equal(lhs.bytes.begin() + operand, lhs.bytes.end(),
+                      rhs.bytes.begin() + operand);
+  }
+
+  // mov x, reg; mov reg, x
+  bool removeRedundantLoads() {
+    bool changed = false;
+    for (size_t i = 0; i < instructions.size(); i = next(i)) {
+      auto j = next(i);
+      if (j >= instructions.size() || instructions[i].removed || barriers[j])
+        continue;
+      const auto &store = instructions[i];
+      const auto &load = instructions[j];
+      if (store.byte(0) != 0x89 || load.byte(0) != 0x8B ||
+          regField(store) != regField(load) || !sameOperand(store, load))
+        continue;
+      remove(j);
+      changed = true;
+    }
+    return changed;
+  }
+
+  // eax is written without being read
+  static bool overwritesAccumulator(const X86Instruction &instruction) {
+    if (instruction.byte(0) == 0xB8)
+      return (instruction.rex & rexB) == 0;
+    if (instruction.byte(0) == 0x8B && regField(instruction) == EAX)
+      return operandIndependentOf(instruction, EAX);
+    if (instruction.byte(0) == 0x89 && isRegisterOperand(instruction) &&
+        rmField(instruction) == EAX)
+      return regField(instruction) != EAX;
+    return false;
+  }
+
+  bool removeDeadAccumulatorWrites() {
+    bool changed = false;
+    for (size_t i = 0; i < instructions.size(); i = next(i)) {
+      auto j = next(i);
+      if (j >= instructions.size() || instructions[i].removed)
+        continue;
+      if (!overwritesAccumulator(instructions[i]) ||
+          !overwritesAccumulator(instructions[j]))
+        continue;
+      remove(i);
+      changed = true;
+    }
+    return changed;
+  }
+
+  // first instruction at or after i that was not removed
+  size_t surviving(size_t i) const {
+    return i < instructions.size() && instructions[i].removed ? next(i) : i;
+  }
+
+  bool removeJumpsToNext() {
+    bool changed = false;
+    for (size_t i = 0; i < instructions.size(); i = next(i)) {
+      if (instructions[i].removed || !instructions[i].isUnconditionalJump() ||
+          surviving(instructions[i].target) != next(i))
+        continue;
+      remove(i);
+      changed = true;
+    }
+    return changed;
+  }
+
+  static bool isPushf(const X86Instruction &instruction) {
+    return instruction.byte(0) == 0x66 && instruction.byte(1) == 0x9C;
+  }
+  static bool isPopf(const X86Instruction &instruction) {
+    return instruction.byte(0) == 0x66 && instruction.byte(1) == 0x9D;
+  }
+
+  // emitter saves flags around each comparison,
+  // pairs are removed only when all of them are matched
+  void removeFlagSaves() {
+    std::vector<size_t> open;
+    std::vector<size_t> pairs;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      if (instructions[i].removed)
+        continue;
+      if (isPushf(instructions[i]))
+        open.push_back(i);
+      if (isPopf(instructions[i])) {
+        if (open.empty())
+          return;
+        pairs.push_back(open.back());
+        pairs.push_back(i);
+        open.pop_back();
+      }
+    }
+    if (!open.empty())
+      return;
+    for (auto i : pairs)
+      remove(i);
+  }
+
+  // Starts with all jumps long, shortening a jump never makes
+  // any displacement bigger, so it's repeated until nothing changes.
+  void relaxJumps() {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      computeOffsets();
+      for (size_t i = 0; i < instructions.size(); ++i) {
+        auto &instruction = instructions[i];
+        if (instruction.removed || instruction.relSize != 4)
+          continue;
+        constexpr size_t shortSize = 2;
+        auto longSize = instruction.bytes.size();
+        auto target = static_cast<long long>(newOffsets[instruction.target]);
+        auto end = static_cast<long long>(newOffsets[i] + shortSize);
+        // forward target moves back together with end of jump
+        if (instruction.target > i)
+          target -= longSize - shortSize;
+        auto rel = target - end;
+        if (rel < -128 || rel > 127)
+          continue;
+        if (instruction.byte(0) == 0xE9)
+          instruction.bytes = {std::byte(0xEB), std::byte(0)};
+        else
+          instruction.bytes = {std::byte(0x70 | (instruction.byte(1) & 0xF)),
+                               std::byte(0)};
+        instruction.relSize = 1;
+        changed = true;
+      }
+    }
+  }
+
+  void computeOffsets() {
+    newOffsets.assign(instructions.size() + 1, 0);
+    size_t offset = 0;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+      newOffsets[i] = offset;
+      if (!instructions[i].removed)
+        offset += instructions[i].bytes.size();
+    }
+    newOffsets[instructions.size()] = offset;
+    for (size_t i = 0; i < instructions.size(); ++i)
+      originalToNew[instructions[i].offset] = newOffsets[i];
+    originalToNew[code.size()] = offset;
+  }
+
+  // bytes of code given to constructor, which has to outlive optimizer
+  const CodeBytes &code;
+  Target target;
+  std::vector<std::pair<size_t, const void *>> literals;
+  std::vector<X86InstrVector::CallReference> calls;
+  std::map<std::string, size_t> labels;
+  std::vector<X86Instruction> instructions;
+  std::vector<bool> barriers;
+  std::vector<size_t> newOffsets;
+  std::map<size_t, size_t> originalToNew;
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+// Liveness analysis and linear scan register allocation of flattened code.
+//
+// Each statement i gets two positions: 2i where its operands are read
+// and 2i + 1 where result is written. Live interval of a variable is
+// a list of ranges [from, to) built from block level liveness,
+// gaps between ranges are lifetime holes, where another variable can
+// use the same register.
+// Allocation follows linear scan of Poletto and Sarkar extended with
+// lifetime holes (active/inactive lists as described by Wimmer).
+// Variable gets register for whole life or stays in its stack slot,
+// when registers run out the variable with lowest spill weight
+// (uses weighted by loop depth) is left in memory.
+//
+// Variables whose address is taken always stay in memory. Pointer
+// arithmetic can walk from one stack slot to another, so when program
+// takes an address and does pointer arithmetic nothing is allocated.
+
+#include <map>
+#include <set>
+#include <limits>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "ast.h"
+#include "tools.h"
+#include "flow_graph.h"
+#include "jitcompiler.h"
+
+constexpr int noRegister = -1;
+
+// eax is an accumulator and edx is a scratch register of emitter,
+// registers not preserved by calls are used only between them
+struct RegisterFile {
+  std::vector<X86Register> allocatable;
+  std::set<int> callerSaved;
+};
+
+// x86 uses cdecl where ecx is not preserved,
+// x86-64 uses System V where only rbx and r12 - r15 are preserved,
+// caller saved registers go first so code without calls
+// doesn't need to save anything
+const RegisterFile &registerFile(Target target) {
+  static const RegisterFile x86 = {{EBX, ESI, EDI, ECX}, {ECX}};
+  static const RegisterFile x86_64 = {
+      {ECX, ESI, EDI, R8, R9, R10, R11, EBX, R12, R13, R14, R15},
+      {ECX, ESI, EDI, R8, R9, R10, R11}};
+  return target == Target::x86_64 ? x86_64 : x86;
+}
+
+bool isCalleeSaved(int reg, Target target = hostTarget) {
+  const auto &registers = registerFile(target);
+  return std::find(registers.allocatable.begin(), registers.allocatable.end(),
+                   reg) != registers.allocatable.end() &&
+         !registers.callerSaved.count(reg);
+}
+
+struct LiveRange {
+  size_t from;
+  size_t to;
+};
+
+struct LiveInterval {
+  size_t decl = noBlock;
+  std::vector<LiveRange> ranges;
+  double weight = 0;
+  int reg = noRegister;
+
+  size_t start() const { return ranges.front().from; }
+  size_t end() const { return ranges.back().to; }
+  bool empty() const { return ranges.empty(); }
+
+  bool covers(size_t position) const {
+    for (const auto &range : ranges) {
+      if (position >= range.from && position < range.to)
+        return true;
+    }
+    return false;
+  }
+
+  // first position where both intervals are live
+  size_t nextIntersection(const LiveInterval &other) const {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < ranges.size() && j < other.ranges.size()) {
+      const auto &lhs = ranges[i];
+      const auto &rhs = other.ranges[j];
+      auto from = std::max(lhs.from, rhs.from);
+      if (from < std::min(lhs.to, rhs.to))
+        return from;
+      if (lhs.to <= rhs.to)
+        ++i;
+      else
+        ++j;
+    }
+    return noBlock;
+  }
+
+  // ranges are added in decreasing order of positions
+  void addRange(size_t from, size_t to) {
+    if (!ranges.empty() && ranges.front().from <= to) {
+      ranges.front().from = std::min(ranges.front().from, from);
+      ranges.front().to = std::max(ranges.front().to, to);
+      return;
+    }
+    ranges.insert(ranges.begin(), LiveRange{from, to});
+  }
+
+  // definition shortens range that reaches beginning of block
+  void setFrom(size_t from) {
+    if (ranges.empty() || ranges.front().from > from ||
+        ranges.front().to <= from) {
+      ranges.insert(ranges.begin(), LiveRange{from, from + 1});
+      return;
+    }
+    ranges.front().from = from;
+  }
+};
+
+size_t usePosition(size_t statementIndex) { return 2 * statementIndex; }
+size_t defPosition(size_t statementIndex) { return 2 * statementIndex + 1; }
+
+struct Liveness {
+  Liveness(const ControlFlowGraph &cfg, const AllocationRegions &regions,
+           const std::set<size_t> &variables)
+      : cfg(cfg), regions(regions), variables(variables) {
+    const auto &statements = cfg.getStatements();
+    uses.resize(statements.size());
+    defs.assign(statements.size(), noBlock);
+    for (size_t i = 0; i < statements.size(); ++i) {
+      for (const auto &name : usedVariables(statements[i])) {
+        auto decl = regions.resolve(name, i);
+        if (variables.count(decl))
+          uses[i].push_back(decl);
+      }
+      auto name = assignedVariable(statements[i]);
+      if (!name.empty()) {
+        auto decl = regions.resolve(name, i);
+        if (variables.count(decl))
+          defs[i] = decl;
+      }
+    }
+    solve();
+  }
+
+  const std::set<size_t> &liveIn(size_t block) const { return in[block]; }
+  const std::set<size_t> &liveOut(size_t block) const { return out[block]; }
+
+  std::map<size_t, LiveInterval> buildIntervals() const {
+    std::map<size_t, LiveInterval> intervals;
+    for (size_t id = cfg.size(); id-- > 0;) {
+      const auto &bb = cfg.block(id);
+      if (bb.begin == bb.end)
+        continue;
+      for (auto var : out[id])
+        intervals[var].addRange(usePosition(bb.begin), usePosition(bb.end));
+      for (size_t i = bb.end; i-- > bb.begin;) {
+        if (defs[i] != noBlock)
+          intervals[defs[i]].setFrom(defPosition(i));
+        for (auto var : uses[i])
+          intervals[var].addRange(usePosition(bb.begin), usePosition(i) + 1);
+      }
+    }
+    for (auto &interval : intervals)
+      interval.second.decl = interval.first;
+    return intervals;
+  }
+
+  const std::vector<size_t> &usesOf(size_t statementIndex) const {
+    return uses[statementIndex];
+  }
+  size_t defOf(size_t statementIndex) const { return defs[statementIndex]; }
+
+private:
+  void solve() {
+    std::vector<std::set<size_t>> gen(cfg.size());
+    std::vector<std::set<size_t>> kill(cfg.size());
+    for (size_t id = 0; id < cfg.size(); ++id) {
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        for (auto var : uses[i]) {
+          if (!kill[id].count(var))
+            gen[id].insert(var);
+        }
+        if (defs[i] != noBlock)
+          kill[id].insert(defs[i]);
+      }
+    }
+    in.assign(cfg.size(), {});
+    out.assign(cfg.size(), {});
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t id = cfg.size(); id-- > 0;) {
+        std::set<size_t> liveOut;
+        for (auto succ : cfg.block(id).successors)
+          liveOut.insert(in[succ].begin(), in[succ].end());
+        std::set<size_t> liveIn = gen[id];
+        for (auto var : liveOut) {
+          if (!kill[id].count(var))
+            liveIn.insert(var);
+        }
+        if (liveIn != in[id] || liveOut != out[id]) {
+          in[id] = liveIn;
+          out[id] = liveOut;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  const ControlFlowGraph &cfg;
+  const AllocationRegions &regions;
+  std::set<size_t> variables;
+  std::vector<std::vector<size_t>> uses;
+  std::vector<size_t> defs;
+  std::vector<std::set<size_t>> in;
+  std::vector<std::set<size_t>> out;
+};
+
+// maps declarations (VarDecl statements) to registers
+using RegisterAssignment = std::map<const Statement *, int>;
+
+struct LinearScanAllocator {
+  explicit LinearScanAllocator(const StatementList &stmts,
+                               Target target = hostTarget)
+      : statements(stmts), cfg(stmts), regions(stmts),
+        registers(registerFile(target)) {}
+
+  RegisterAssignment run() {
+    auto variables = registerCandidates();
+    Liveness liveness(cfg, regions, variables);
+    intervals = liveness.buildIntervals();
+    computeWeights(liveness, intervals);
+
+    // caller saved registers are blocked on every call
+    LiveInterval callClobbers;
+    for (size_t i = statements.size(); i-- > 0;) {
+      if (getFunctionCall(statements[i]))
+        callClobbers.addRange(usePosition(i), defPosition(i) + 1);
+    }
+
+    std::vector<LiveInterval *> unhandled;
+    for (auto &interval : intervals) {
+      if (!interval.second.empty())
+        unhandled.push_back(&interval.second);
+    }
+    std::stable_sort(unhandled.begin(), unhandled.end(),
+                     [](const LiveInterval *lhs, const LiveInterval *rhs) {
+                       return lhs->start() < rhs->start();
+                     });
+
+    std::vector<LiveInterval *> active;
+    std::vector<LiveInterval *> inactive;
+    for (auto current : unhandled) {
+      auto position = current->start();
+      updateLists(position, active, inactive);
+
+      std::map<int, size_t> freeUntil;
+      for (auto reg : registers.allocatable)
+        freeUntil[reg] = std::numeric_limits<size_t>::max();
+      for (auto interval : active)
+        freeUntil[interval->reg] = 0;
+      for (auto interval : inactive)
+        blockUntilIntersection(freeUntil, interval->reg, *interval, *current);
+      for (auto reg : registers.callerSaved)
+        blockUntilIntersection(freeUntil, reg, callClobbers, *current);
+
+      int reg = noRegister;
+      for (auto candidate : registers.allocatable) {
+        if (freeUntil[candidate] >= current->end() &&
+            (reg == noRegister || freeUntil[candidate] > freeUntil[reg]))
+          reg = candidate;
+      }
+      if (reg == noRegister)
+        reg = takeFromActive(*current, active, inactive, callClobbers);
+      if (reg == noRegister)
+        continue;
+      current->reg = reg;
+      active.push_back(current);
+    }
+
+    RegisterAssignment result;
+    for (const auto &interval : intervals) {
+      if (interval.second.reg != noRegister)
+        result[statements[interval.first].get()] = interval.second.reg;
+    }
+    return result;
+  }
+
+  // declarations of variables that are in registers when statement
+  // starts executing, valid after run
+  std::set<const Statement *> liveAt(size_t statementIndex) const {
+    std::set<const Statement *> live;
+    for (const auto &interval : intervals) {
+      if (interval.second.reg != noRegister &&
+          interval.second.covers(usePosition(statementIndex)))
+        live.insert(statements[interval.first].get());
+    }
+    return live;
+  }
+
+private:
+  // variables that can be kept in registers
+  std::set<size_t> registerCandidates() const {
+    std::set<size_t> addressTaken;
+    bool pointerArithmetic = false;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (!is<Expression>(statements[i]))
+        continue;
+      const auto &children = cast<Expression>(statements[i])->getChilds();
+      std::vector<std::string> operands;
+      for (const auto &child : children) {
+        if (is<BasicExpression>(child))
+          operands.push_back(cast<BasicExpression>(child)->value);
+      }
+      if (operands.size() == 4 && operands[2] == "&")
+        addressTaken.insert(regions.resolve(operands[3], i));
+      if (operands.size() == 5 && (operands[3] == "+" || operands[3] == "-")) {
+        auto type = variableType(statements, regions, operands[2], i);
+        if (!type.empty() && type[0] == '^')
+          pointerArithmetic = true;
+      }
+    }
+    std::set<size_t> candidates;
+    if (pointerArithmetic && !addressTaken.empty())
+      return candidates;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (is<VarDecl>(statements[i]) && !addressTaken.count(i))
+        candidates.insert(i);
+    }
+    // result of comparison fused with branch is never stored
+    for (auto i : findFusedComparisons(statements))
+      candidates.erase(regions.resolve(assignedVariable(statements[i]), i));
+    return candidates;
+  }
+
+  void computeWeights(const Liveness &liveness,
+                      std::map<size_t, LiveInterval> &intervals) const {
+    std::vector<size_t> depth(cfg.size(), 0);
+    for (const auto &loop : findNaturalLoops(cfg)) {
+      for (auto id : loop.blocks)
+        ++depth[id];
+    }
+    for (size_t i = 0; i < statements.size(); ++i) {
+      double weight = 1;
+      for (size_t d = 0; d < std::min<size_t>(depth[cfg.blockOf(i)], 6); ++d)
+        weight *= 10;
+      for (auto var : liveness.usesOf(i))
+        intervals[var].weight += weight;
+      if (liveness.defOf(i) != noBlock)
+        intervals[liveness.defOf(i)].weight += weight;
+    }
+  }
+
+  static void blockUntilIntersection(std::map<int, size_t> &freeUntil, int reg,
+                                     const LiveInterval &interval,
+                                     const LiveInterval &current) {
+    auto intersection = interval.nextIntersection(current);
+    if (intersection != noBlock)
+      freeUntil[reg] = std::min(freeUntil[reg], intersection);
+  }
+
+  static void updateLists(size_t position, std::vector<LiveInterval *> &active,
+                          std::vector<LiveInterval *> &inactive) {
+    std::vector<LiveInterval *> nextActive;
+    std::vector<LiveInterval *> nextInactive;
+    for (auto interval : active) {
+      if (interval->end() <= position)
+        continue;
+      if (interval->covers(position))
+        nextActive.push_back(interval);
+      else
+        nextInactive.push_back(interval);
+    }
+    for (auto interval : inactive) {
+      if (interval->end() <= position)
+        continue;
+      if (interval->covers(position))
+        nextActive.push_back(interval);
+      else
+        nextInactive.push_back(interval);
+    }
+    active = nextActive;
+    inactive = nextInactive;
+  }
+
+  // spills active interval with lower weight than current one
+  // if its register is free for whole current interval
+  int takeFromActive(const LiveInterval &current,
+                     std::vector<LiveInterval *> &active,
+                     const std::vector<LiveInterval *> &inactive,
+                     const LiveInterval &callClobbers) const {
+    auto victim = active.end();
+    for (auto it = active.begin(); it != active.end(); ++it) {
+      auto reg = (*it)->reg;
+      if ((*it)->weight >= current.weight ||
+          (victim != active.end() && (*it)->weight >= (*victim)->weight))
+        continue;
+      if (registers.callerSaved.count(reg) &&
+          callClobbers.nextIntersection(current) != noBlock)
+        continue;
+      bool blocked = std::any_of(
+          inactive.begin(), inactive.end(), [&](const LiveInterval *other) {
+            return other->reg == reg &&
+                   other->nextIntersection(current) != noBlock;
+          });
+      if (!blocked)
+        victim = it;
+    }
+    if (victim == active.end())
+      return noRegister;
+    auto reg = (*victim)->reg;
+    (*victim)->reg = noRegister;
+    active.erase(victim);
+    return reg;
+  }
+
+  StatementList statements;
+  ControlFlowGraph cfg;
+  AllocationRegions regions;
+  const RegisterFile &registers;
+  std::map<size_t, LiveInterval> intervals;
+};
@@ -0,0 +1,330 @@
+#pragma once
+
+// Strength reduction replaces multiplications by induction variables
+// with additions.
+// Basic induction variable is changed in a loop only by i = i + c
+// or i = i - c, derived one is linear function of basic variable:
+// j = i * c, q = p + i or q = p - i where p is loop invariant pointer.
+// Each derived expression gets a new variable, initialized in preheader
+// and updated just after basic induction variable is updated,
+// so it holds value of the expression during whole loop.
+//
+//                              var reduced__0:i32;
+//                              reduced__0 = i * 4;
+//   label__2:                  label__2:
+//   ...                 ==>    ...
+//   j = i * 4;                 j = reduced__0;
+//   i = i + 1;                 i = i + 1;
+//                              reduced__0 = reduced__0 + 4;
+//   goto label__2;             goto label__2;
+//
+// Pointer arithmetic is scaled by emitter for both forms, so for
+// q = p + i update of reduced variable uses step of i.
+
+#include <map>
+#include <set>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "tools.h"
+#include "flow_graph.h"
+
+struct StrengthReduction {
+  explicit StrengthReduction(const StatementList &stmts) : statements(stmts) {}
+
+  StatementList run() {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      ControlFlowGraph cfg(statements);
+      AllocationRegions regions(statements);
+      for (const auto &loop : findNaturalLoops(cfg)) {
+        if (reduceLoop(cfg, regions, loop)) {
+          changed = true;
+          break;
+        }
+      }
+    }
+    return statements;
+  }
+
+  size_t numberOfReducedExpressions() const { return reduced; }
+
+private:
+  // i = i op step
+  struct InductionVariable {
+    std::string op;
+    long long step;
+    size_t index;
+  };
+
+  // variable that keeps value of derived expression
+  struct ReducedVariable {
+    std::string name;
+    std::string type;
+    // operands of expression computed in preheader
+    std::vector<std::string> initialization;
+    // variable is updated by var = var op step after basic variable
+    std::string basic;
+    std::string op;
+    long long step;
+  };
+
+  static std::vector<std::string> operandsOf(const StatementPtr &stmt) {
+    std::vector<std::string> operands;
+    const auto &children = cast<Expression>(stmt)->getChilds();
+    for (size_t i = 2; i < children.size(); ++i) {
+      if (!is<BasicExpression>(children[i]))
+        return {};
+      operands.push_back(cast<BasicExpression>(children[i])->value);
+    }
+    return operands;
+  }
+
+  static bool fitsInt(long long value) {
+    return value >= std::numeric_limits<int>::min() &&
+           value <= std::numeric_limits<int>::max();
+  }
+
+  // variable visible in the loop is the one declared before the loop
+  bool declaredOutside(const AllocationRegions &regions,
+                       const LoopSummary &summary, const std::string &var,
+                       size_t index, size_t preheaderIndex) const {
+    if (summary.declarations.count(var))
+      return false;
+    auto decl = regions.resolve(var, index);
+    return decl != noBlock && regions.resolve(var, preheaderIndex) == decl;
+  }
+
+  std::map<std::string, InductionVariable>
+  findBasicInductionVariables(const ControlFlowGraph &cfg,
+                              const AllocationRegions &regions,
+                              const NaturalLoop &loop,
+                              const LoopSummary &summary,
+                              size_t preheaderIndex) const {
+    std::map<std::string, InductionVariable> result;
+    for (auto id : loop.blocks) {
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        auto lhs = assignedVariable(statements[i]);
+        if (lhs.empty() || summary.assignments.at(lhs) != 1)
+          continue;
+        auto operands = operandsOf(statements[i]);
+        if (operands.size() != 3 || operands[0] != lhs ||
+            (operands[1] != "+" && operands[1] != "-") ||
+            isIdentifier(operands[2]))
+          continue;
+        if (variableType(statements, regions, lhs, i) != "i32" ||
+            !declaredOutside(regions, summary, lhs, i, preheaderIndex))
+          continue;
+        result[lhs] =
+            InductionVariable{operands[1], std::stoll(operands[2]), i};
+      }
+    }
+    return result;
+  }
+
+  std::string getNextVariable() {
+    return "reduced__" + std::to_string(id++);
+  }
+
+  StatementPtr makeAssignment(size_t scope, const std::string &lhs,
+                              const std::vector<std::string> &operands) {
+    Expression::ElementsType elements = {
+        makeNode(BasicExpression(scope, lhs)),
+        makeNode(BasicExpression(scope, "="))};
+    for (const auto &op : operands)
+      elements.push_back(makeNode(BasicExpression(scope, op)));
+    return makeNode(Expression(scope, elements));
+  }
+
+  // Variable that gets only reduced value and is local to loop body
+  // is replaced by reduced variable, so copy and declaration are removed.
+  // All uses have to follow the copy in its block, before the reduced
+  // variable is updated. Variable declared in body of a goto loop stays
+  // visible after the loop, so no statement outside may refer to it.
+  void forwardCopy(const ControlFlowGraph &cfg,
+                   const AllocationRegions &regions, const NaturalLoop &loop,
+                   const LoopSummary &summary, size_t copyIndex,
+                   const std::string &reducedName, size_t updateIndex,
+                   std::set<size_t> &removed) {
+    auto var = assignedVariable(statements[copyIndex]);
+    if (!summary.declarations.count(var) || summary.assignments.at(var) != 1)
+      return;
+    auto decl = regions.resolve(var, copyIndex);
+    for (size_t i = 0; i < statements.size(); ++i) {
+      auto used = usedVariables(statements[i]);
+      bool refers = assignedVariable(statements[i]) == var ||
+                    std::find(used.begin(), used.end(), var) != used.end();
+      if (refers && regions.resolve(var, i) == decl &&
+          !loop.contains(cfg.blockOf(i)))
+        return;
+    }
+    auto block = cfg.blockOf(copyIndex);
+    std::vector<size_t> uses;
+    for (auto id : loop.blocks) {
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        auto used = usedVariables(statements[i]);
+        if (std::find(used.begin(), used.end(), var) == used.end())
+          continue;
+        if (id != block || i < copyIndex || !is<Expression>(statements[i]) ||
+            getFunctionCall(statements[i]))
+          return;
+        if (updateIndex > copyIndex && updateIndex < i)
+          return;
+        // address of variable can't be forwarded
+        auto operands = operandsOf(statements[i]);
+        if (operands.size() == 2 && operands[0] == "&")
+          return;
+        uses.push_back(i);
+      }
+    }
+    for (auto use : uses) {
+      const auto &children = cast<Expression>(statements[use])->getChilds();
+      Expression::ElementsType elements;
+      for (size_t c = 0; c < children.size(); ++c) {
+        auto value = cast<BasicExpression>(children[c])->value;
+        auto scope = children[c]->scope;
+        elements.push_back(makeNode(
+            BasicExpression(scope, value == var ? reducedName : value)));
+      }
+      statements[use] = makeNode(Expression(statements[use]->scope, elements));
+    }
+    removed.insert(copyIndex);
+    removed.insert(decl);
+  }
+
+  bool reduceLoop(const ControlFlowGraph &cfg, const AllocationRegions &regions,
+                  const NaturalLoop &loop) {
+    if (!hasPreheader(cfg, loop))
+      return false;
+    auto summary = summarizeLoop(cfg, regions, loop);
+    // basic induction variable can be changed through pointer
+    if (summary.clobbersMemory)
+      return false;
+    size_t preheaderIndex = cfg.block(loop.header).begin;
+    auto basics = findBasicInductionVariables(cfg, regions, loop, summary,
+                                              preheaderIndex);
+    if (basics.empty())
+      return false;
+
+    // derived expression (as text) -> reduced variable
+    std::map<std::string, ReducedVariable> reducedVariables;
+    std::vector<std::string> order;
+    // index of j = reduced__N and its derived expression
+    std::vector<std::pair<size_t, std::string>> copies;
+    for (auto id : loop.blocks) {
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        auto lhs = assignedVariable(statements[i]);
+        if (lhs.empty())
+          continue;
+        auto operands = operandsOf(statements[i]);
+        if (operands.size() != 3)
+          continue;
+
+        ReducedVariable candidate;
+        const auto &op = operands[1];
+        auto isBasic = [&](const std::string &var) {
+          return basics.count(var) &&
+                 declaredOutside(regions, summary, var, i, preheaderIndex);
+        };
+        if (op == "*") {
+          // j = i * c or j = c * i
+          auto basic = isBasic(operands[0]) ? operands[0] : operands[2];
+          auto factor = basic == operands[0] ? operands[2] : operands[0];
+          if (!isBasic(basic) || isIdentifier(factor))
+            continue;
+          auto step = std::stoll(factor) * basics[basic].step;
+          if (!fitsInt(step))
+            continue;
+          candidate.type = "i32";
+          candidate.basic = basic;
+          candidate.op = basics[basic].op;
+          candidate.step = step;
+          candidate.initialization = {basic, "*", factor};
+        } else if (op == "+" || op == "-") {
+          // q = p + i or q = p - i
+          const auto &pointer = operands[0];
+          const auto &basic = operands[2];
+          if (!isBasic(basic) || !isIdentifier(pointer) ||
+              summary.isChanged(pointer) ||
+              !declaredOutside(regions, summary, pointer, i, preheaderIndex))
+            continue;
+          auto type = variableType(statements, regions, pointer, i);
+          if (type.empty() || type[0] != '^')
+            continue;
+          const auto &update = basics[basic];
+          candidate.type = type;
+          candidate.basic = basic;
+          candidate.op = op == update.op ? "+" : "-";
+          candidate.step = update.step;
+          candidate.initialization = {pointer, op, basic};
+        } else {
+          continue;
+        }
+
+        std::string key = operands[0] + op + operands[2];
+        auto it = reducedVariables.find(key);
+        if (it == reducedVariables.end()) {
+          candidate.name = getNextVariable();
+          it = reducedVariables.insert(std::make_pair(key, candidate)).first;
+          order.push_back(key);
+        }
+        auto stmtScope = statements[i]->scope;
+        statements[i] = makeAssignment(stmtScope, lhs, {it->second.name});
+        copies.push_back(std::make_pair(i, key));
+        ++reduced;
+      }
+    }
+    if (reducedVariables.empty())
+      return false;
+
+    std::set<size_t> removed;
+    for (const auto &copy : copies) {
+      const auto &var = reducedVariables[copy.second];
+      forwardCopy(cfg, regions, loop, summary, copy.first, var.name,
+                  basics[var.basic].index, removed);
+    }
+
+    // updates are inserted after basic induction variables
+    auto scope = statements[preheaderIndex]->scope;
+    std::map<size_t, StatementList> updates;
+    StatementList preheader;
+    for (const auto &key : order) {
+      const auto &var = reducedVariables[key];
+      auto decl = makeNode(VarDecl(scope, var.name));
+      cast<VarDecl>(decl)->type = var.type;
+      preheader.push_back(decl);
+      preheader.push_back(makeAssignment(scope, var.name, var.initialization));
+
+      auto index = basics[var.basic].index;
+      auto updateScope = statements[index]->scope;
+      updates[index].push_back(makeAssignment(
+          updateScope, var.name,
+          {var.name, var.op, std::to_string(var.step)}));
+    }
+
+    StatementList result;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (i == preheaderIndex)
+        result.insert(result.end(), preheader.begin(), preheader.end());
+      if (!removed.count(i))
+        result.push_back(statements[i]);
+      auto update = updates.find(i);
+      if (update != updates.end())
+        result.insert(result.end(), update->second.begin(),
+                      update->second.end());
+    }
+    statements = result;
+    return true;
+  }
+
+  StatementList statements;
+  size_t id = 0;
+  size_t reduced = 0;
+};
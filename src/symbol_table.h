@@ -7,14 +7,15 @@
 
 struct symbol {
   symbol(const std::string &id, const std::string &type,
-         unsigned char stack_pos = -1, size_t s = 0)
+         int stack_pos = 0, size_t s = 0)
       : id(id), type(type), stack_position(stack_pos), scope(s) {}
   std::string id;
   std::string type;
-  unsigned char stack_position;
+  // offset from frame pointer
+  int stack_position;
   size_t scope = 0;
-  size_t allocation_level = 0;
-  size_t level_index = 0;
+  // register assigned by allocator or -1 when variable lives on stack
+  int register_id = -1;
 };
 
 typedef std::list<symbol> symbol_list;
@@ -44,11 +45,9 @@ struct BasicSymbolTable {
   }
 
   void insertSymbol(const std::string &id, const std::string &type,
-                    unsigned char position_on_stack = -1, size_t level = 0,
-                    size_t index = 0) {
+                    int position_on_stack = 0, int register_id = -1) {
     auto new_symbol = symbol(id, type, position_on_stack, symbol_table_id);
-    new_symbol.allocation_level = level;
-    new_symbol.level_index = index;
+    new_symbol.register_id = register_id;
     symbol_table[symbol_table_id].push_back(new_symbol);
   }
 
@@ -57,7 +56,7 @@ struct BasicSymbolTable {
       for (const auto &symbol : bucket.second) {
         std::cout << bucket.first << " : "
                   << "(" << symbol.id << "," << symbol.type << ","
-                  << static_cast<int>(symbol.stack_position) << ")"
+                  << symbol.stack_position << ")"
                   << std::endl;
       }
     }
@@ -0,0 +1,157 @@
+#pragma once
+
+// TieredEngine starts running a program in the interpreter, which costs
+// only compilation to bytecode, and compiles it to machine code once
+// it gets hot. Inliner leaves a single function, the whole program, so
+// it is compiled when it was run enough times or when one of its loops
+// was hot during a run in interpreter:
+//
+//   TieredEngine engine(statements, functions);
+//   engine.run();   // interpreted, back edges are counted
+//   engine.run();   // native, loop was hot in previous run
+//
+// Loop that gets hot in the middle of a run is left by on-stack
+// replacement: program is compiled with entry at loop header, which
+// takes interpreter frame as its own, since both use FrameLayoutPass,
+// and runs the rest of the program natively.
+//
+// With a CompileService in the policy both are compiled in background
+// and program keeps running in interpreter until its code is ready.
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "host_functions.h"
+#include "jitcompiler.h"
+#include "code_emitter.h"
+#include "interpreter.h"
+#include "compile_service.h"
+
+struct TierPolicy {
+  // invocation from which program runs natively
+  size_t invocationThreshold = 2;
+  // back edges of a single loop after which loop is hot
+  size_t backEdgeThreshold = 1000;
+  // hot loop is entered natively in the middle of a run
+  bool onStackReplacement = true;
+  // compiles off the running thread when set, with its own host
+  // functions, must outlive the engine
+  CompileService *compileService = nullptr;
+};
+
+struct TieredEngine {
+  TieredEngine(const StatementList &program, const HostFunctions &functions,
+               TierPolicy tierPolicy = {})
+      : statements(program), functionMap(functions), policy(tierPolicy),
+        bytecode(compileBytecode(program, functions)) {}
+
+  void run() {
+    ++invocations;
+    if (!native && isHot())
+      compile();
+    if (native) {
+      native();
+      return;
+    }
+    Interpreter interpreter(bytecode, &executionProfile);
+    if (policy.onStackReplacement)
+      interpreter.onHotLoop(policy.backEdgeThreshold,
+                            [this](size_t loop, std::byte *frame) {
+                              return enterLoop(bytecode.loops[loop], frame);
+                            });
+    interpreter.run();
+  }
+
+  bool isCompiled() const { return native != nullptr; }
+
+  // number of runs finished by on-stack replacement
+  size_t getLoopEntries() const { return loopEntries; }
+
+  size_t getInvocations() const { return invocations; }
+
+  const Profile &profile() const { return executionProfile; }
+
+  // header labels of loops that reached back edge threshold
+  std::vector<std::string> hotLoops() const {
+    std::vector<std::string> loops;
+    for (size_t i = 0; i < executionProfile.backEdges.size(); ++i) {
+      if (executionProfile.backEdges[i] >= policy.backEdgeThreshold)
+        loops.push_back(bytecode.loops[i]);
+    }
+    return loops;
+  }
+
+private:
+  StatementList statements;
+  HostFunctions functionMap;
+  TierPolicy policy;
+  Bytecode bytecode;
+  Profile executionProfile;
+  size_t invocations = 0;
+
+  std::unique_ptr<JitCompiler> jit;
+  JitCompiler::pfunc native = nullptr;
+  // program compiled by compile service
+  CompileHandle program;
+
+  using LoopEntry = void (*)(std::byte *);
+  // code entered at loop header, by header label
+  std::map<std::string, LoopEntry> entries;
+  std::vector<std::unique_ptr<JitCompiler>> entryJits;
+  std::map<std::string, CompileHandle> entryPrograms;
+  size_t loopEntries = 0;
+
+  bool isHot() const {
+    return invocations >= policy.invocationThreshold || !hotLoops().empty();
+  }
+
+  // native stays nullptr while program is compiled in background
+  void compile() {
+    if (policy.compileService) {
+      if (!program.isValid())
+        program = policy.compileService->compile(statements);
+      native = program.tryEntry();
+      return;
+    }
+    jit = std::make_unique<JitCompiler>(
+        emitMachineCode(statements, functionMap, hostTarget, {},
+                        &defaultCodeHeap()));
+    native = jit->compile("program");
+  }
+
+  // false while entry is compiled in background,
+  // interpreter asks again on next back edge
+  bool enterLoop(const std::string &header, std::byte *frame) {
+    auto entry = entries.find(header);
+    if (entry == entries.end()) {
+      auto address = compileEntry(header);
+      if (!address)
+        return false;
+      entry = entries
+                  .emplace(header, reinterpret_cast<LoopEntry>(
+                                       reinterpret_cast<void *>(address)))
+                  .first;
+    }
+    ++loopEntries;
+    entry->second(frame);
+    return true;
+  }
+
+  JitCompiler::pfunc compileEntry(const std::string &header) {
+    if (policy.compileService) {
+      auto pending = entryPrograms.find(header);
+      if (pending == entryPrograms.end())
+        pending = entryPrograms
+                      .emplace(header, policy.compileService->compile(
+                                           statements, header))
+                      .first;
+      return pending->second.tryEntry();
+    }
+    entryJits.push_back(std::make_unique<JitCompiler>(emitMachineCode(
+        statements, functionMap, hostTarget, header, &defaultCodeHeap())));
+    return entryJits.back()->compile("program@" + header);
+  }
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+// Value numbering eliminates redundant computations in flattened code.
+// Each basic block is processed with hash based local value numbering,
+// then value tables are propagated down the dominator tree, so
+// computation available in dominating block is reused as well.
+//
+//   x = a * b;          x = a * b;
+//   y = a * b;   ==>    y = x;
+//
+// Code is not in SSA form, so when table is passed from dominator
+// to dominated block every variable that can be redefined on the way
+// gets a new value number.
+// Memory is treated conservatively: value loaded by *p is always a new
+// value, store through pointer or call that gets pointer as an argument
+// invalidates values of all variables.
+
+#include <map>
+#include <tuple>
+#include <vector>
+#include <string>
+#include <utility>
+#include "ast.h"
+#include "tools.h"
+#include "flow_graph.h"
+
+struct ValueNumbering {
+  explicit ValueNumbering(const StatementList &stmts)
+      : statements(stmts), cfg(stmts), regions(stmts) {}
+
+  StatementList run() {
+    result = statements;
+    removed.assign(statements.size(), false);
+    ValueTable table;
+    visitBlock(0, table);
+
+    StatementList optimized;
+    for (size_t i = 0; i < result.size(); ++i) {
+      if (!removed[i])
+        optimized.push_back(result[i]);
+    }
+    return optimized;
+  }
+
+  size_t numberOfEliminatedExpressions() const { return eliminated; }
+
+private:
+  // (operator, operand kind, first value, second value)
+  using ExpressionKey = std::tuple<std::string, std::string, size_t, size_t>;
+  // variable name and index of its declaration
+  using Holder = std::pair<std::string, size_t>;
+
+  struct ValueTable {
+    std::map<std::string, size_t> variables;
+    std::map<ExpressionKey, size_t> expressions;
+    std::map<size_t, std::vector<Holder>> holders;
+  };
+
+  void visitBlock(size_t id, ValueTable &table) {
+    const auto &bb = cfg.block(id);
+    for (size_t i = bb.begin; i < bb.end; ++i)
+      processStatement(i, table);
+
+    for (auto child : cfg.dominatorTreeChildren(id)) {
+      ValueTable childTable = table;
+      killOnPathsBetween(id, child, childTable);
+      visitBlock(child, childTable);
+    }
+  }
+
+  // kills variables that can be redefined on any path from the end of
+  // dominator to the beginning of dominated block
+  void killOnPathsBetween(size_t dominator, size_t dominated,
+                          ValueTable &table) {
+    auto forward = reachableAvoiding(dominator, dominator, true);
+    auto backward = reachableAvoiding(dominated, dominator, false);
+    for (size_t id = 0; id < cfg.size(); ++id) {
+      if (!forward[id] || !backward[id])
+        continue;
+      const auto &bb = cfg.block(id);
+      for (size_t i = bb.begin; i < bb.end; ++i) {
+        const auto &stmt = statements[i];
+        if (clobbersMemory(stmt, i))
+          table.variables.clear();
+        if (is<VarDecl>(stmt))
+          table.variables.erase(cast<VarDecl>(stmt)->var_name);
+        auto var = assignedVariable(stmt);
+        if (!var.empty())
+          table.variables.erase(var);
+      }
+    }
+  }
+
+  // blocks reachable from successors (or predecessors) of start
+  // without passing through avoided block
+  std::vector<bool> reachableAvoiding(size_t start, size_t avoided,
+                                      bool forward) const {
+    std::vector<bool> visited(cfg.size(), false);
+    std::vector<size_t> worklist;
+    auto push = [&](size_t id) {
+      for (auto next : forward ? cfg.block(id).successors
+                               : cfg.block(id).predecessors) {
+        if (next != avoided && !visited[next]) {
+          visited[next] = true;
+          worklist.push_back(next);
+        }
+      }
+    };
+    push(start);
+    while (!worklist.empty()) {
+      auto id = worklist.back();
+      worklist.pop_back();
+      push(id);
+    }
+    return visited;
+  }
+
+  bool isPointer(const std::string &name, size_t index) const {
+    auto decl = regions.resolve(name, index);
+    if (decl == noBlock)
+      return true;
+    const auto &type = cast<VarDecl>(statements[decl])->type;
+    return !type.empty() && type[0] == '^';
+  }
+
+  bool clobbersMemory(const StatementPtr &stmt, size_t index) const {
+    if (isStoreThroughPointer(stmt))
+      return true;
+    if (auto fcall = getFunctionCall(stmt)) {
+      for (const auto &param : fcall->parameters) {
+        if (isIdentifier(param) && isPointer(param, index))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  size_t newValue() { return nextValue++; }
+
+  size_t valueOf(const std::string &operand, ValueTable &table) {
+    if (!isIdentifier(operand)) {
+      auto it = constants.find(operand);
+      if (it != constants.end())
+        return it->second;
+      return constants[operand] = newValue();
+    }
+    auto it = table.variables.find(operand);
+    if (it != table.variables.end())
+      return it->second;
+    return table.variables[operand] = newValue();
+  }
+
+  void assign(const std::string &var, size_t value, size_t index,
+              ValueTable &table) {
+    table.variables[var] = value;
+    table.holders[value].push_back(
+        std::make_pair(var, regions.resolve(var, index)));
+  }
+
+  // variable that currently holds value and is visible at index
+  std::string findHolder(size_t value, size_t index,
+                         const ValueTable &table) const {
+    auto it = table.holders.find(value);
+    if (it == table.holders.end())
+      return "";
+    for (const auto &holder : it->second) {
+      auto var = table.variables.find(holder.first);
+      if (var == table.variables.end() || var->second != value)
+        continue;
+      if (holder.second == noBlock ||
+          regions.resolve(holder.first, index) != holder.second)
+        continue;
+      return holder.first;
+    }
+    return "";
+  }
+
+  ExpressionKey makeKey(const std::vector<std::string> &operands,
+                        size_t index, ValueTable &table) {
+    // a = op b
+    if (operands.size() == 2) {
+      const auto &op = operands[0];
+      // address depends on variable not on its value
+      if (op == "&") {
+        auto decl = regions.resolve(operands[1], index);
+        return ExpressionKey(op, operands[1] + "#" + std::to_string(decl), 0,
+                             0);
+      }
+      return ExpressionKey(op, "", valueOf(operands[1], table), 0);
+    }
+    // a = b op c
+    const auto &op = operands[1];
+    auto first = valueOf(operands[0], table);
+    auto second = valueOf(operands[2], table);
+    std::string kind;
+    // pointer arithmetic is scaled by size of type
+    if ((op == "+" || op == "-") && isIdentifier(operands[0]) &&
+        isPointer(operands[0], index))
+      kind = "^";
+    bool commutative = op == "+" || op == "*" || op == "==" || op == "!=";
+    if (kind.empty() && commutative && second < first)
+      std::swap(first, second);
+    return ExpressionKey(op, kind, first, second);
+  }
+
+  void replaceWithCopy(size_t index, const std::string &lhs,
+                       const std::string &holder) {
+    auto scope = statements[index]->scope;
+    result[index] = makeNode(
+        Expression(scope, {makeNode(BasicExpression(scope, lhs)),
+                           makeNode(BasicExpression(scope, "=")),
+                           makeNode(BasicExpression(scope, holder))}));
+    ++eliminated;
+  }
+
+  void processStatement(size_t index, ValueTable &table) {
+    const auto &stmt = statements[index];
+    if (is<VarDecl>(stmt)) {
+      table.variables[cast<VarDecl>(stmt)->var_name] = newValue();
+      return;
+    }
+    if (clobbersMemory(stmt, index)) {
+      table.variables.clear();
+      return;
+    }
+    auto lhs = assignedVariable(stmt);
+    if (lhs.empty())
+      return;
+
+    std::vector<std::string> operands;
+    const auto &children = cast<Expression>(stmt)->getChilds();
+    for (size_t i = 2; i < children.size(); ++i) {
+      if (!is<BasicExpression>(children[i])) {
+        table.variables[lhs] = newValue();
+        return;
+      }
+      operands.push_back(cast<BasicExpression>(children[i])->value);
+    }
+
+    // a = b
+    if (operands.size() == 1) {
+      auto value = valueOf(operands[0], table);
+      auto current = table.variables.find(lhs);
+      if (current != table.variables.end() && current->second == value) {
+        removed[index] = true;
+        ++eliminated;
+        return;
+      }
+      assign(lhs, value, index, table);
+      return;
+    }
+
+    // a = *p loads from memory, a = b op c op d is not supported
+    if ((operands.size() == 2 && operands[0] == "*") || operands.size() > 3) {
+      table.variables[lhs] = newValue();
+      return;
+    }
+
+    auto key = makeKey(operands, index, table);
+    auto expression = table.expressions.find(key);
+    if (expression == table.expressions.end()) {
+      auto value = newValue();
+      table.expressions[key] = value;
+      assign(lhs, value, index, table);
+      return;
+    }
+
+    auto value = expression->second;
+    auto current = table.variables.find(lhs);
+    if (current != table.variables.end() && current->second == value) {
+      removed[index] = true;
+      ++eliminated;
+      return;
+    }
+    auto holder = findHolder(value, index, table);
+    if (!holder.empty())
+      replaceWithCopy(index, lhs, holder);
+    assign(lhs, value, index, table);
+  }
+
+  StatementList statements;
+  StatementList result;
+  std::vector<bool> removed;
+  ControlFlowGraph cfg;
+  AllocationRegions regions;
+  std::map<std::string, size_t> constants;
+  size_t nextValue = 0;
+  size_t eliminated = 0;
+};
@@ -2,6 +2,7 @@
 
 #include "tools.h"
 #include "ast.h"
+#include "code_emitter.h"
 
 TEST(codegen, test1)
 {
@@ -199,3 +200,109 @@ TEST(codegen, test14)
 		makeNode(Expression(0,{ makeNode(BasicExpression(0,"__dealloc__")) })),
 	});
 }
+
+TEST(frame_layout, test1)
+{
+	// flattened code declares a temporary for each condition:
+	// a, t0, { b, c }, t1, { d }, e
+	// slots of block are released when it ends, so t1, d and e reuse them
+	std::string text =
+		"var a:i32; if (a) { var b:i32; var c:i32; }"
+		"if (a) { var d:i32; } var e:i32;";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	auto statements = visitor.getStatements();
+	FrameLayoutPass frameLayout;
+	traverse(statements, frameLayout);
+	std::map<std::string, int> offsets;
+	for (const auto& stmt : statements) {
+		if (is<VarDecl>(stmt))
+			offsets[cast<VarDecl>(stmt)->var_name] = frameLayout.offsetOf(stmt.get());
+	}
+	EXPECT_EQ(offsets["a"], -4);
+	EXPECT_EQ(offsets["b"], -12);
+	EXPECT_EQ(offsets["c"], -16);
+	EXPECT_EQ(offsets["d"], -16);
+	EXPECT_EQ(offsets["e"], -16);
+	EXPECT_EQ(frameLayout.getFrameSize(), 16);
+}
+
+TEST(assembler, test1)
+{
+	// ModRM with disp8/disp32, SIB for esp base and scaled index,
+	// REX for wide operands and r8 - r15
+	X86InstrVector code(Target::x86_64);
+	X86Assembler assembler(code);
+	assembler.mov(Reg(EAX), Mem(EBP, -8));
+	assembler.mov(Mem(ESP, 200), Reg(ECX));
+	assembler.lea(Reg(EAX), Mem(EAX, EAX, 2, 0));
+	assembler.add(Reg(R9, true), Mem(R12, 0));
+	assembler.cmp(Reg(EAX), Imm(1000));
+	assembler.sub(Reg(EBX), Imm(1));
+	auto label = assembler.label("end");
+	assembler.jcc(conditionLess, label);
+	assembler.bind(label);
+	EXPECT_EQ(code.instruction_vector(),
+	          toBytes({ 0x8B, 0x45, 0xF8,
+	                    0x89, 0x8C, 0x24, 0xC8, 0x00, 0x00, 0x00,
+	                    0x8D, 0x04, 0x40,
+	                    0x4D, 0x03, 0x0C, 0x24,
+	                    0x3D, 0xE8, 0x03, 0x00, 0x00,
+	                    0x83, 0xEB, 0x01,
+	                    0x0F, 0x8C, 0x00, 0x00, 0x00, 0x00 }));
+}
+
+TEST(assembler, test2)
+{
+	// call is direct when host function is in rel32 range,
+	// otherwise it goes through stub placed after code
+	X86InstrVector code(Target::x86_64);
+	X86Assembler assembler(code);
+	assembler.call(reinterpret_cast<const void *>(0x100000));
+	assembler.ret();
+	code.emit_literal_pool();
+	std::vector<std::byte> linked(code.size());
+	code.link(linked.data(), 0x1000);
+	EXPECT_EQ(std::vector<std::byte>(linked.begin(), linked.begin() + 5),
+	          toBytes({ 0xE8, 0xFB, 0xEF, 0x0F, 0x00 }));
+	code.link(linked.data(), 0x100000000000);
+	EXPECT_EQ(std::vector<std::byte>(linked.begin(), linked.begin() + 8),
+	          toBytes({ 0xE8, 0x01, 0x00, 0x00, 0x00, 0xC3, 0xFF, 0x25 }));
+}
+
+void twoArguments(int, int *) {}
+
+TEST(host_functions, test1)
+{
+	// signature of registered function is checked
+	HostFunctions functions;
+	functions.add("f", &twoArguments);
+	auto emit = [&](std::string text) {
+		CFGFlattener visitor;
+		auto parser = initialize_parser();
+		auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+		traverse(stmts, visitor);
+		emitMachineCode(visitor.getStatements(), functions, Target::x86_64);
+	};
+	EXPECT_NO_THROW(emit("var a:i32; var p:^i32; p = &a; f(1 p);"));
+	EXPECT_THROW(emit("var a:i32; f(1);"), CodeEmitterException);
+	EXPECT_THROW(emit("var a:i32; f(1 a);"), CodeEmitterException);
+}
+
+void storeZero(int *p) { *p = 0; }
+
+TEST(host_functions, test2)
+{
+	// intrinsic is expanded inline, so no call is emitted
+	HostFunctions functions;
+	functions.addIntrinsic("out", &storeZero, Intrinsic::StoreZero);
+	std::string text = "var a:i32; var p:^i32; p = &a; out(p);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	auto code = emitMachineCode(visitor.getStatements(), functions);
+	EXPECT_TRUE(code.call_references().empty());
+}
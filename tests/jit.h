@@ -0,0 +1,294 @@
+#pragma once
+
+#include "tools.h"
+#include "runtime.h"
+#include "code_cache.h"
+#include "code_heap.h"
+#include "compile_service.h"
+#include "module.h"
+#include "code_batch.h"
+#include "jit_profiler.h"
+#include "pass_stats.h"
+
+TEST(code_cache, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text = "var a:i32; a = 3; print(a);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	auto code = emitMachineCode(visitor.getStatements(), functions);
+	CodeCache cache(std::filesystem::temp_directory_path() / "cogecs-test");
+	auto key = cache.key(text, functions);
+	EXPECT_NE(key, cache.key(text + " ", functions));
+	ASSERT_TRUE(cache.store(key, code, functions));
+	auto cached = cache.load(key, functions);
+	ASSERT_TRUE(cached.has_value());
+	EXPECT_EQ(cached->instruction_vector(), code.instruction_vector());
+	EXPECT_EQ(cached->call_references().size(), code.call_references().size());
+	printedValues.clear();
+	JitCompiler jit(*cached);
+	jit.compile()();
+	EXPECT_EQ(printedValues, std::vector<int>({3}));
+	// relocation can't be resolved without the function
+	EXPECT_FALSE(cache.load(key, HostFunctions()).has_value());
+	// entry with a flipped bit of code isn't loaded
+	{
+		std::fstream entry(cache.path(key),
+			std::ios::binary | std::ios::in | std::ios::out);
+		entry.seekg(30);
+		char byte = 0;
+		entry.read(&byte, 1);
+		entry.seekp(30);
+		byte ^= 1;
+		entry.write(&byte, 1);
+	}
+	EXPECT_FALSE(cache.load(key, functions).has_value());
+	std::filesystem::remove(cache.path(key));
+}
+
+TEST(code_heap, test1)
+{
+	CodeHeapOptions options;
+	options.chunkSize = 16 * systemPageSize();
+	CodeHeap heap(options);
+	// small blocks share a chunk and get whole pages
+	auto first = heap.allocate(10);
+	auto second = heap.allocate(systemPageSize() + 1);
+	EXPECT_EQ(heap.getChunkCount(), 1u);
+	EXPECT_EQ(heap.getUsedBytes(), 3 * systemPageSize());
+	// block larger than chunk gets its own chunk
+	auto large = heap.allocate(32 * systemPageSize());
+	EXPECT_EQ(heap.getChunkCount(), 2u);
+	heap.release(large);
+	EXPECT_EQ(heap.getChunkCount(), 1u);
+	// released space is reused
+	heap.release(first);
+	EXPECT_EQ(heap.allocate(1), first);
+	heap.release(second);
+	const unsigned char ret[] = { 0xC3 };
+	auto code = heap.allocate(sizeof(ret));
+	std::memcpy(code, ret, sizeof(ret));
+	heap.makeExecutable(code);
+	reinterpret_cast<void (*)()>(code)();
+}
+
+TEST(code_heap, test2)
+{
+	// code emitted into code heap is made executable where it was emitted
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text = "var a:i32; a = 4; print(a);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	CodeHeap heap;
+	auto code = emitMachineCode(visitor.getStatements(), functions, hostTarget,
+		{}, &heap);
+	EXPECT_EQ(code.heap(), &heap);
+	auto emitted = code.data();
+	auto usedBytes = heap.getUsedBytes();
+	printedValues.clear();
+	JitCompiler jit(std::move(code), heap);
+	EXPECT_EQ(reinterpret_cast<const std::byte *>(jit.compile()), emitted);
+	EXPECT_EQ(heap.getUsedBytes(), usedBytes);
+	jit.compile()();
+	EXPECT_EQ(printedValues, std::vector<int>({4}));
+}
+
+TEST(compile_service, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	CodeHeap heap;
+	std::vector<CompileHandle> handles;
+	{
+		CompileService service(functions, 2, heap);
+		EXPECT_EQ(service.getWorkerCount(), 2u);
+		for (int i = 0; i < 4; ++i)
+			handles.push_back(service.compile(
+				"var a:i32; var b:i32; a = " + std::to_string(i) +
+				"; b = a * 3; print(b);"));
+		handles.push_back(service.compile(std::string("print(1 * 3);")));
+	}
+	// service finished queued jobs before it was destroyed
+	printedValues.clear();
+	for (int i = 0; i < 4; ++i) {
+		EXPECT_TRUE(handles[i].isReady());
+		handles[i].entry()();
+	}
+	EXPECT_EQ(printedValues, std::vector<int>({0, 3, 6, 9}));
+	EXPECT_THROW(handles[4].entry(), CompileException);
+	handles.clear();
+	EXPECT_EQ(heap.getUsedBytes(), 0u);
+}
+
+TEST(compile_service, test2)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text =
+		"var i:i32; var s:i32; i = 0; s = 0;"
+		"while (i < 2000) { s = s + i; i = i + 1; } print(s);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	CompileService service(functions, 1);
+	TierPolicy policy;
+	policy.invocationThreshold = 3;
+	policy.backEdgeThreshold = 10;
+	policy.compileService = &service;
+	TieredEngine engine(visitor.getStatements(), functions, policy);
+	// interpreter runs until code compiled in background is ready
+	printedValues.clear();
+	size_t runs = 0;
+	while (!engine.isCompiled() && runs < 10000) {
+		engine.run();
+		++runs;
+	}
+	EXPECT_TRUE(engine.isCompiled());
+	engine.run();
+	EXPECT_EQ(printedValues, std::vector<int>(runs + 1, 1999000));
+}
+
+TEST(module, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	Module module(
+		"function add(a b) { var r:i32; r = a + b; return r; }"
+		"function clamp(v) { var r:i32; r = v; if (v > 10) { r = 10; } return r; }"
+		"function sum(n) { var i:i32; var s:i32; i = 0; s = 0;"
+		"  while (i < n) { var c:i32; c = clamp(i); s = s + c; i = i + 1; }"
+		"  return s; }"
+		"function show(v) { print(v); }"
+		"var x:i32; x = 1; print(x);",
+		functions);
+	EXPECT_EQ(module.getFunctionNames(),
+		std::vector<std::string>({"add", "clamp", "show", "sum"}));
+	auto add = module.get<int(int, int)>("add");
+	int total = 0;
+	for (int i = 0; i < 100000; ++i)
+		total = add(total, i & 3);
+	EXPECT_EQ(total, 150000);
+	EXPECT_EQ(module.get<int(int)>("clamp")(42), 10);
+	EXPECT_EQ(module.get<int(int)>("sum")(20), 45 + 10 * 10);
+	printedValues.clear();
+	EXPECT_EQ(module.get<int(int)>("show")(7), 0);
+	// top level statements are not run
+	EXPECT_EQ(printedValues, std::vector<int>({7}));
+	EXPECT_THROW(module.get<int(int)>("add"), ModuleException);
+	EXPECT_THROW(module.get<int()>("main"), ModuleException);
+}
+
+TEST(code_batch, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::vector<std::string> sources;
+	for (int i = 0; i < 200; ++i)
+		sources.push_back("var a:i32; var b:i32; a = " + std::to_string(i) +
+			"; b = a * 2; print(b);");
+	CodeHeap heap;
+	{
+		auto batch = compileBatch(sources, functions, heap);
+		EXPECT_EQ(batch.size(), 200u);
+		// all programs share one block
+		EXPECT_EQ(heap.getUsedBytes(),
+			(batch.getCodeBytes() + systemPageSize() - 1) / systemPageSize() *
+			systemPageSize());
+		EXPECT_LT(heap.getUsedBytes(), 200 * systemPageSize());
+		printedValues.clear();
+		for (size_t i = batch.size(); i-- > 0;)
+			batch.entry(i)();
+		std::vector<int> expected;
+		for (int i = 199; i >= 0; --i)
+			expected.push_back(2 * i);
+		EXPECT_EQ(printedValues, expected);
+	}
+	EXPECT_EQ(heap.getUsedBytes(), 0u);
+	EXPECT_THROW(compileBatch({"var a:i32;", "print(1 * 2);"}, functions, heap),
+		CompileException);
+}
+
+TEST(jit_profiler, test1)
+{
+	auto directory = std::filesystem::temp_directory_path();
+	auto mapPath = directory / "cogecs-test.map";
+	auto dumpPath = directory / "cogecs-test.dump";
+	const unsigned char code[] = {0x31, 0xC0, 0xC3};
+	{
+		JitProfiler profiler({mapPath.string(), dumpPath.string()});
+		ASSERT_TRUE(profiler.isEnabled());
+		profiler.codeLoaded("add", code, sizeof(code));
+	}
+	std::ifstream map(mapPath);
+	std::string address, size, name;
+	map >> address >> size >> name;
+	EXPECT_EQ(std::stoull(address, nullptr, 16),
+		reinterpret_cast<uintptr_t>(code));
+	EXPECT_EQ(size, "3");
+	EXPECT_EQ(name, "add");
+	std::ifstream dump(dumpPath, std::ios::binary);
+	std::vector<char> bytes((std::istreambuf_iterator<char>(dump)),
+		std::istreambuf_iterator<char>());
+	auto load = sizeof(JitDumpHeader) + sizeof(JitDumpCodeLoad);
+	ASSERT_EQ(bytes.size(),
+		load + 4 + sizeof(code) + sizeof(JitDumpRecordHeader));
+	JitDumpHeader header;
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	EXPECT_EQ(header.magic, jitDumpMagic);
+	EXPECT_EQ(header.elfMachine, hostElfMachine);
+	JitDumpCodeLoad record;
+	std::memcpy(&record, bytes.data() + sizeof(header), sizeof(record));
+	EXPECT_EQ(record.header.id, jitCodeLoad);
+	EXPECT_EQ(record.codeSize, sizeof(code));
+	EXPECT_STREQ(bytes.data() + load, "add");
+	EXPECT_EQ(std::memcmp(bytes.data() + load + 4, code, sizeof(code)), 0);
+	std::filesystem::remove(mapPath);
+	std::filesystem::remove(dumpPath);
+}
+
+TEST(pass_stats, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	auto statements = parseSource(
+		"var a:i32; a = 2; while (a < 10) { a = a + 1; } print(a);");
+	CFGFlattener visitor;
+	traverse(statements, visitor);
+	PassStatistics statistics;
+	activePassStatistics() = &statistics;
+	JitCompiler jit(
+		emitMachineCode(optimize(visitor.getStatements()), functions));
+	jit.compile();
+	activePassStatistics() = nullptr;
+	std::vector<std::string> names;
+	for (const auto &record : statistics.records())
+		names.push_back(record.name);
+	EXPECT_EQ(names, std::vector<std::string>({"value numbering", "licm",
+		"strength reduction", "frame layout", "semantic check",
+		"register allocation", "x86 emitter", "peephole", "jit compile"}));
+	// final code is what peephole optimizer produced
+	const auto &peephole = statistics.records()[names.size() - 2];
+	EXPECT_EQ(statistics.records().back().count, peephole.count);
+	EXPECT_EQ(statistics.records().back().unit, "bytes");
+	std::stringstream json;
+	statistics.printJson(json);
+	EXPECT_NE(json.str().find("\"name\": \"total\""), std::string::npos);
+	// without active statistics nothing is recorded
+	optimize(visitor.getStatements());
+	EXPECT_EQ(statistics.records().size(), names.size());
+	// nested statements and expressions are counted too
+	EXPECT_GT(countNodes(statements), statements.size());
+	// parser allocates with malloc, which is counted through its hook
+	d_allocation_hook = &countAllocation;
+	auto allocations = allocationCounters().allocations.load();
+	parseSource("var a:i32;");
+	EXPECT_GT(allocationCounters().allocations.load(), allocations);
+	d_allocation_hook = nullptr;
+}
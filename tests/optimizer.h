@@ -0,0 +1,487 @@
+#pragma once
+
+#include "tools.h"
+#include "ast.h"
+#include "value_numbering.h"
+#include "licm.h"
+#include "strength_reduction.h"
+#include "inliner.h"
+#include "register_allocation.h"
+#include "peephole.h"
+#include "code_emitter.h"
+
+TEST(value_numbering, test1)
+{
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var x:i32; var y:i32; var z:i32; var w:i32;"
+		"x = a + b; y = a - b; z = b + a; w = b - a;",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeNode(VarDecl(0, "z")),
+		makeNode(VarDecl(0, "w")),
+		makeExpression({ "x", "=", "a", "+", "b" }),
+		makeExpression({ "y", "=", "a", "-", "b" }),
+		makeExpression({ "z", "=", "x" }),
+		makeExpression({ "w", "=", "b", "-", "a" }),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(value_numbering, test2)
+{
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var x:i32; var y:i32; var z:i32;"
+		"x = a * b; y = b * a; z = a / b; y = a / b; a = 1; x = a * b;",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeNode(VarDecl(0, "z")),
+		makeExpression({ "x", "=", "a", "*", "b" }),
+		makeExpression({ "y", "=", "x" }),
+		makeExpression({ "z", "=", "a", "/", "b" }),
+		makeExpression({ "y", "=", "z" }),
+		makeExpression({ "a", "=", "1" }),
+		makeExpression({ "x", "=", "a", "*", "b" }),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(value_numbering, test3)
+{
+	// copies are followed and recomputation to the same variable is removed
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var c:i32; var x:i32; var y:i32;"
+		"c = a; x = c + b; y = a + b; x = a + b;",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "c")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeExpression({ "c", "=", "a" }),
+		makeExpression({ "x", "=", "c", "+", "b" }),
+		makeExpression({ "y", "=", "x" }),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(value_numbering, test4)
+{
+	// store through pointer may change any variable
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var x:i32; var y:i32; var p:^i32;"
+		"p = &a; x = a * b; *p = 2; y = a * b;",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeNode(VarDecl(0, "p")),
+		makeExpression({ "p", "=", "&", "a" }),
+		makeExpression({ "x", "=", "a", "*", "b" }),
+		makeExpression({ "*", "p", "=", "2" }),
+		makeExpression({ "y", "=", "a", "*", "b" }),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(value_numbering, test5)
+{
+	// computation in dominating block is reused
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var x:i32; var y:i32;"
+		"x = a + b; if (a) { y = a + b; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeExpression({ "x", "=", "a", "+", "b" }),
+		makeNode(VarDecl(0, "temp__1")),
+		makeExpression({ "temp__1", "=", "a" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__2")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "y", "=", "x" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(value_numbering, test6)
+{
+	// operand redefined inside the loop, value from before the loop
+	// can't be reused
+	testPass<ValueNumbering>(
+		"var a:i32; var b:i32; var x:i32; var y:i32;"
+		"x = a * b; while (a) { y = a * b; a = a - 1; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "y")),
+		makeExpression({ "x", "=", "a", "*", "b" }),
+		makeNode(VarDecl(0, "temp__1")),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "temp__1", "=", "a" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__3")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "y", "=", "a", "*", "b" }),
+		makeExpression({ "a", "=", "a", "-", "1" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(GotoStatement(0, "label__2")),
+		makeNode(LabelStatement(0, "label__3")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(licm, test1)
+{
+	testPass<LoopInvariantCodeMotion>(
+		"var a:i32; var b:i32; var i:i32; var x:i32;"
+		"while (i < a) { x = a * b; i = i + 1; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "i")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "temp__1")),
+		makeNode(VarDecl(0, "invariant__0")),
+		makeExpression({ "invariant__0", "=", "a", "*", "b" }),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "temp__1", "=", "i", "<", "a" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__3")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "x", "=", "invariant__0" }),
+		makeExpression({ "i", "=", "i", "+", "1" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(GotoStatement(0, "label__2")),
+		makeNode(LabelStatement(0, "label__3")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(licm, test2)
+{
+	// store through pointer may change operands, nothing is hoisted
+	testPass<LoopInvariantCodeMotion>(
+		"var a:i32; var b:i32; var i:i32; var x:i32; var p:^i32;"
+		"p = &a; while (i < 3) { x = a * b; *p = i; i = i + 1; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "a")),
+		makeNode(VarDecl(0, "b")),
+		makeNode(VarDecl(0, "i")),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "p")),
+		makeExpression({ "p", "=", "&", "a" }),
+		makeNode(VarDecl(0, "temp__1")),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "temp__1", "=", "i", "<", "3" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__3")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "x", "=", "a", "*", "b" }),
+		makeExpression({ "*", "p", "=", "i" }),
+		makeExpression({ "i", "=", "i", "+", "1" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(GotoStatement(0, "label__2")),
+		makeNode(LabelStatement(0, "label__3")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(strength_reduction, test1)
+{
+	testPass<StrengthReduction>(
+		"var i:i32; var j:i32;"
+		"while (i < 10) { j = i * 4; i = i + 1; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "i")),
+		makeNode(VarDecl(0, "j")),
+		makeNode(VarDecl(0, "temp__1")),
+		makeNode(VarDecl(0, "reduced__0")),
+		makeExpression({ "reduced__0", "=", "i", "*", "4" }),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "temp__1", "=", "i", "<", "10" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__3")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "j", "=", "reduced__0" }),
+		makeExpression({ "i", "=", "i", "+", "1" }),
+		makeExpression({ "reduced__0", "=", "reduced__0", "+", "4" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(GotoStatement(0, "label__2")),
+		makeNode(LabelStatement(0, "label__3")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(strength_reduction, test2)
+{
+	// pointer local to loop body is replaced by reduced variable
+	testPass<StrengthReduction>(
+		"var i:i32; var s:i32; var base:^i32;"
+		"while (i < 5) { var p:^i32; p = base + i; s = *p; i = i + 1; }",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "i")),
+		makeNode(VarDecl(0, "s")),
+		makeNode(VarDecl(0, "base")),
+		makeNode(VarDecl(0, "temp__1")),
+		makeNode(VarDecl(0, "reduced__0")),
+		makeExpression({ "reduced__0", "=", "base", "+", "i" }),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "temp__1", "=", "i", "<", "5" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__3")) })),
+		makeExpression({ "__alloc__" }),
+		makeExpression({ "s", "=", "*", "reduced__0" }),
+		makeExpression({ "i", "=", "i", "+", "1" }),
+		makeExpression({ "reduced__0", "=", "reduced__0", "+", "1" }),
+		makeExpression({ "__dealloc__" }),
+		makeNode(GotoStatement(0, "label__2")),
+		makeNode(LabelStatement(0, "label__3")),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+TEST(strength_reduction, test3)
+{
+	// variable declared in body of goto loop is used after the loop,
+	// so its declaration is kept
+	testPass<StrengthReduction>(
+		"var c:i32; L: c = c + 1; var d:i32; d = c * 8;"
+		"if (c < 5) goto L; c = d;",
+	{
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "c")),
+		makeNode(VarDecl(0, "reduced__0")),
+		makeExpression({ "reduced__0", "=", "c", "*", "8" }),
+		makeNode(LabelStatement(0, "L")),
+		makeExpression({ "c", "=", "c", "+", "1" }),
+		makeExpression({ "reduced__0", "=", "reduced__0", "+", "8" }),
+		makeNode(VarDecl(0, "d")),
+		makeExpression({ "d", "=", "reduced__0" }),
+		makeNode(VarDecl(0, "temp__1")),
+		makeExpression({ "temp__1", "=", "c", "<", "5" }),
+		makeNode(IfStatement(0,
+				Expression(0,{ makeNode(BasicExpression(0, "!")), makeNode(BasicExpression(0, "temp__1")) }),
+				{ makeNode(GotoStatement(0, "label__2")) })),
+		makeNode(GotoStatement(0, "L")),
+		makeNode(LabelStatement(0, "label__2")),
+		makeExpression({ "c", "=", "d" }),
+		makeExpression({ "__dealloc__" }),
+	});
+}
+
+StatementList inlineAndFlatten(std::string text, size_t budget)
+{
+	NullVisitor nvisitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), nvisitor);
+	FunctionInliner inliner(stmts, budget);
+	CFGFlattener visitor;
+	traverse(inliner.run(), visitor);
+	return visitor.getStatements();
+}
+
+TEST(inliner, test1)
+{
+	auto statements = inlineAndFlatten(
+		"function add(a b) { var r:i32; r = a + b; return r; }"
+		"var x:i32; x = add(1 x); add(x 2);", defaultInlineBudget);
+	checkASTs({
+		makeExpression({ "__alloc__" }),
+		makeNode(VarDecl(0, "x")),
+		makeNode(VarDecl(0, "a__inl0")),
+		makeExpression({ "a__inl0", "=", "1" }),
+		makeNode(VarDecl(0, "b__inl0")),
+		makeExpression({ "b__inl0", "=", "x" }),
+		makeNode(VarDecl(0, "r__inl0")),
+		makeExpression({ "r__inl0", "=", "a__inl0", "+", "b__inl0" }),
+		makeExpression({ "x", "=", "r__inl0" }),
+		makeNode(VarDecl(0, "a__inl1")),
+		makeExpression({ "a__inl1", "=", "x" }),
+		makeNode(VarDecl(0, "b__inl1")),
+		makeExpression({ "b__inl1", "=", "2" }),
+		makeNode(VarDecl(0, "r__inl1")),
+		makeExpression({ "r__inl1", "=", "a__inl1", "+", "b__inl1" }),
+		makeExpression({ "__dealloc__" }),
+	}, statements);
+}
+
+TEST(inliner, test2)
+{
+	// function bigger than budget is not inlined
+	auto statements = inlineAndFlatten(
+		"function add(a b) { var r:i32; r = a + b; return r; }"
+		"var x:i32; x = add(1 x);", 2);
+	ASSERT_EQ(statements.size(), 10);
+	EXPECT_TRUE(is<LabelStatement>(statements[1]));
+}
+
+// register of each variable, variables left in memory are not listed
+std::map<std::string, int> allocateRegisters(std::string text,
+                                             Target target = Target::x86)
+{
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	auto statements = visitor.getStatements();
+	auto registers = LinearScanAllocator(statements, target).run();
+	std::map<std::string, int> result;
+	for (const auto& stmt : statements) {
+		auto reg = registers.find(stmt.get());
+		if (reg != registers.end())
+			result[cast<VarDecl>(stmt)->var_name] = reg->second;
+	}
+	return result;
+}
+
+TEST(register_allocation, test1)
+{
+	// a is dead when b is defined, so both share a register,
+	// b is live across call, so it can't be in ecx
+	auto registers = allocateRegisters(
+		"var a:i32; var b:i32; a = 1; b = a + 2; print(b);");
+	ASSERT_EQ(registers.size(), 2);
+	EXPECT_EQ(registers["a"], registers["b"]);
+	EXPECT_NE(registers["b"], ECX);
+}
+
+TEST(register_allocation, test2)
+{
+	// a is address taken, five variables are live in the loop
+	// so e, which is not used there, is left in memory
+	auto registers = allocateRegisters(
+		"var a:i32; var p:^i32; var b:i32; var c:i32; var d:i32; var e:i32;"
+		"var i:i32; p = &a; b = 1; c = 2; d = 3; e = 4; i = 0;"
+		"while(i < 10) { i = i + b; i = i + c; i = i + d; }"
+		"i = i + e;");
+	EXPECT_EQ(registers.count("a"), 0);
+	EXPECT_EQ(registers.count("e"), 0);
+	EXPECT_EQ(registers.count("p"), 1);
+	EXPECT_EQ(registers.count("i"), 1);
+	EXPECT_EQ(registers.count("b"), 1);
+	EXPECT_EQ(registers.count("c"), 1);
+	EXPECT_EQ(registers.count("d"), 1);
+}
+
+TEST(register_allocation, test3)
+{
+	// x86-64 has enough registers for e as well,
+	// b is live across call so it gets callee saved register
+	auto registers = allocateRegisters(
+		"var a:i32; var p:^i32; var b:i32; var c:i32; var d:i32; var e:i32;"
+		"var i:i32; p = &a; b = 1; c = 2; d = 3; e = 4; i = 0;"
+		"while(i < 10) { i = i + b; i = i + c; i = i + d; }"
+		"i = i + e; print(b);", Target::x86_64);
+	EXPECT_EQ(registers.count("a"), 0);
+	EXPECT_EQ(registers.count("e"), 1);
+	ASSERT_EQ(registers.count("b"), 1);
+	EXPECT_TRUE(isCalleeSaved(registers["b"], Target::x86_64));
+}
+
+TEST(peephole, test1)
+{
+	// mov [ebp-4], eax; mov eax, [ebp-4]; pushf; cmp eax, 1; popf; ret
+	X86InstrVector code;
+	code.push_back(toBytes({ 0x89, 0x45, 0xFC, 0x8B, 0x45, 0xFC, 0x66, 0x9C,
+		0x3D, 0x01, 0x00, 0x00, 0x00, 0x66, 0x9D, 0xC3 }));
+	PeepholeOptimizer peephole(code);
+	EXPECT_EQ(peephole.run().instruction_vector(),
+		toBytes({ 0x89, 0x45, 0xFC, 0x3D, 0x01, 0x00, 0x00, 0x00, 0xC3 }));
+	EXPECT_EQ(peephole.numberOfRemovedInstructions(), 3);
+}
+
+TEST(peephole, test2)
+{
+	// jmp over removed load gets new displacement and short form,
+	// label is moved
+	// jmp L; mov [ebp-4], eax; mov eax, [ebp-4]; L: mov eax, 0; ret
+	X86InstrVector code;
+	code.push_back(toBytes({ 0xE9, 0x06, 0x00, 0x00, 0x00, 0x89, 0x45, 0xFC,
+		0x8B, 0x45, 0xFC, 0xB8, 0x00, 0x00, 0x00, 0x00, 0xC3 }));
+	PeepholeOptimizer peephole(code, { { "L", 11 } });
+	EXPECT_EQ(peephole.run().instruction_vector(),
+		toBytes({ 0xEB, 0x03, 0x89, 0x45, 0xFC,
+			0xB8, 0x00, 0x00, 0x00, 0x00, 0xC3 }));
+	EXPECT_EQ(peephole.translatedLabels()["L"], 5);
+}
+
+TEST(fused_comparison, test1)
+{
+	// loop condition is used only by branch, x is printed
+	std::string text =
+		"var i:i32; var x:i32; i = 0; x = i < 3; print(x);"
+		"while(i < 10) { i = i + 1; }";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	auto statements = visitor.getStatements();
+	auto fused = findFusedComparisons(statements);
+	ASSERT_EQ(fused.size(), 1);
+	EXPECT_NE(assignedVariable(statements[*fused.begin()]), "x");
+	EXPECT_TRUE(is<IfStatement>(statements[*fused.begin() + 1]));
+}
+
+TEST(peephole, test3)
+{
+	// forward jumps are fixed when label is bound,
+	// jump that does not fit in a byte stays long
+	X86InstrVector code;
+	// je end; jmp end; nop x 126; end: ret
+	code.push_conditional_jump(0x4, "end");
+	code.push_jump("end");
+	for (int i = 0; i < 126; ++i)
+		code.push_back(std::byte(0x90));
+	code.bind_label("end");
+	code.push_back(std::byte(0xC3));
+	EXPECT_TRUE(code.unbound_labels().empty());
+	EXPECT_EQ(code.instruction_vector()[2], std::byte(131));
+	auto relaxed = PeepholeOptimizer(code).run().instruction_vector();
+	ASSERT_EQ(relaxed.size(), 135);
+	EXPECT_EQ(relaxed[1], std::byte(0x84));
+	EXPECT_EQ(relaxed[2], std::byte(128));
+	EXPECT_EQ(relaxed[6], std::byte(0xEB));
+	EXPECT_EQ(relaxed[7], std::byte(126));
+}
+
+TEST(peephole, test4)
+{
+	// REX prefixes are decoded on x86-64, load is redundant
+	// only when its operand size is the same as size of store
+	X86InstrVector code(Target::x86_64);
+	// mov [rbp-8], rax; mov rax, [rbp-8]; mov [rbp-8], eax; mov rax, [rbp-8]
+	code.push_back(toBytes({0x48, 0x89, 0x45, 0xF8, 0x48, 0x8B, 0x45, 0xF8,
+	                        0x89, 0x45, 0xF8, 0x48, 0x8B, 0x45, 0xF8, 0xC3}));
+	PeepholeOptimizer peephole(code);
+	auto optimized = peephole.run().instruction_vector();
+	EXPECT_EQ(peephole.numberOfRemovedInstructions(), 1);
+	EXPECT_EQ(optimized.size(), 12);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "tools.h"
+#include "builtin.h"
+#include "interpreter.h"
+#include "tiered.h"
+#include "../src/optimizer.h"
+
+TEST(runtime, test1)
+{
+	char buffer[maxIntLength];
+	auto format = [&](int value) {
+		return std::string(buffer, formatInt(value, buffer));
+	};
+	EXPECT_EQ(format(0), "0");
+	EXPECT_EQ(format(7), "7");
+	EXPECT_EQ(format(-42), "-42");
+	EXPECT_EQ(format(1000000), "1000000");
+	EXPECT_EQ(format(2147483647), "2147483647");
+	EXPECT_EQ(format(-2147483647 - 1), "-2147483648");
+}
+
+std::vector<int> printedValues;
+
+void collectValue(int value) { printedValues.push_back(value); }
+
+// program flattened and optimized like driver does
+StatementList flattenAndOptimize(const std::string &text)
+{
+	CFGFlattener visitor;
+	traverse(parseSource(text), visitor);
+	return optimize(visitor.getStatements());
+}
+
+std::vector<int> printedByInterpreter(const std::string &text)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	printedValues.clear();
+	eval(flattenAndOptimize(text), functions);
+	return printedValues;
+}
+
+std::vector<int> printedByJit(const std::string &text)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	printedValues.clear();
+	JitCompiler jit(emitMachineCode(flattenAndOptimize(text), functions));
+	jit.compile()();
+	return printedValues;
+}
+
+TEST(interpreter, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text =
+		"var i:i32; var a:i32; var b:i32; var p:^i32; i = 0; p = &a;"
+		"while (i < 4) { b = i * 3; *p = b; print(a); i = i + 1; }"
+		"a = 7 / 2; print(a);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	printedValues.clear();
+	eval(visitor.getStatements(), functions);
+	EXPECT_EQ(printedValues, std::vector<int>({0, 3, 6, 9, 3}));
+	EXPECT_THROW(eval(visitor.getStatements(), HostFunctions()),
+		InterpreterException);
+}
+
+TEST(interpreter, test2)
+{
+	// if on plain variable after comparison fused with its branch
+	std::string text = "var a:i32; a = 0; if (a < 2) { print(1); }"
+		"if (a) { print(2); } print(3);";
+	EXPECT_EQ(printedByInterpreter(text), std::vector<int>({1, 3}));
+	EXPECT_EQ(printedByJit(text), std::vector<int>({1, 3}));
+}
+
+TEST(interpreter, test3)
+{
+	// interpreter is the reference the JIT is compared against
+	std::vector<std::string> programs = {
+		// nested if and while
+		"var i:i32; var j:i32; var s:i32; i = 0; s = 0;"
+		"while (i < 5) { j = 0; while (j < i) { if (j < 2) { s = s + j; }"
+		"j = j + 1; } if (i == 3) { print(s); } i = i + 1; } print(s);",
+		// if on plain variable
+		"var a:i32; var b:i32; a = 3; b = 0;"
+		"while (a) { if (b) { print(b); } b = a; a = a - 1; }"
+		"if (a) { print(7); } print(a);",
+		// pointers
+		"var a:i32; var b:i32; var p:^i32; a = 1; p = &a; *p = 5; print(a);"
+		"b = *p; if (b) { b = b * 2; *p = b; } print(a);",
+		// division
+		"var a:i32; var b:i32; a = 17; b = a / 5; print(b); a = 0;"
+		"a = a - 17; b = a / 5; print(b); b = 100 / a; print(b);",
+	};
+	std::vector<std::vector<int>> expected = {
+		{2, 3}, {3, 2, 0}, {5, 10}, {3, -3, -5}};
+	for (size_t i = 0; i < programs.size(); ++i) {
+		EXPECT_EQ(printedByInterpreter(programs[i]), expected[i]);
+		EXPECT_EQ(printedByJit(programs[i]), expected[i]);
+	}
+}
+
+TEST(tiered, test1)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text =
+		"var i:i32; i = 0; while (i < 10) { print(i); i = i + 1; }";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	TierPolicy policy;
+	policy.invocationThreshold = 100;
+	policy.backEdgeThreshold = 5;
+	TieredEngine engine(visitor.getStatements(), functions, policy);
+	printedValues.clear();
+	engine.run();
+	EXPECT_FALSE(engine.isCompiled());
+	EXPECT_EQ(engine.hotLoops().size(), 1u);
+	auto interpreted = printedValues;
+	printedValues.clear();
+	// loop was hot, so second run is native
+	engine.run();
+	EXPECT_TRUE(engine.isCompiled());
+	EXPECT_EQ(printedValues, interpreted);
+	EXPECT_EQ(interpreted.size(), 10u);
+}
+
+TEST(tiered, test2)
+{
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text =
+		"var i:i32; var s:i32; i = 0; s = 0;"
+		"while (i < 50) { s = s + i; i = i + 1; } print(s); print(i);";
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	TierPolicy policy;
+	policy.backEdgeThreshold = 10;
+	TieredEngine engine(visitor.getStatements(), functions, policy);
+	printedValues.clear();
+	// loop gets hot in the first run, which is finished natively
+	engine.run();
+	EXPECT_EQ(engine.getLoopEntries(), 1u);
+	EXPECT_EQ(printedValues, std::vector<int>({1225, 50}));
+	// x86 entry takes frame pointer from the stack
+	auto code = emitMachineCode(visitor.getStatements(), functions,
+		Target::x86, "label__2");
+	auto bytes = code.instruction_vector();
+	std::vector<std::byte> prolog(bytes.begin(), bytes.begin() + 7);
+	EXPECT_EQ(prolog, toBytes({ 0x8B, 0x44, 0x24, 0x04, 0x55, 0x8B, 0xE8 }));
+}
+
+TEST(tiered, test3)
+{
+	// cold code is interpreted with non-fused if before the hot loop
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text = "var a:i32; var i:i32; var s:i32; a = 0; i = 0;"
+		"s = 0; if (a < 2) { print(1); } if (a) { print(2); }"
+		"while (i < 20) { s = s + i; i = i + 1; } print(s);";
+	auto native = printedByJit(text);
+	EXPECT_EQ(native, std::vector<int>({1, 190}));
+	TierPolicy policy;
+	policy.invocationThreshold = 100;
+	policy.backEdgeThreshold = 5;
+	policy.onStackReplacement = false;
+	TieredEngine engine(flattenAndOptimize(text), functions, policy);
+	printedValues.clear();
+	engine.run();
+	EXPECT_FALSE(engine.isCompiled());
+	EXPECT_EQ(printedValues, native);
+	printedValues.clear();
+	engine.run();
+	EXPECT_TRUE(engine.isCompiled());
+	EXPECT_EQ(printedValues, native);
+}
+
+TEST(tiered, test4)
+{
+	// loop is entered natively after if on plain variable was interpreted
+	HostFunctions functions;
+	functions.add("print", &collectValue);
+	std::string text = "var a:i32; var b:i32; var i:i32; var s:i32;"
+		"a = 0; b = 1; i = 0; s = 0; if (a < 2) { print(1); }"
+		"if (a) { print(2); } if (b) { s = 100; }"
+		"while (i < 20) { s = s + i; i = i + 1; } print(s); print(i);";
+	auto native = printedByJit(text);
+	EXPECT_EQ(native, std::vector<int>({1, 290, 20}));
+	TierPolicy policy;
+	policy.invocationThreshold = 100;
+	policy.backEdgeThreshold = 5;
+	TieredEngine engine(flattenAndOptimize(text), functions, policy);
+	printedValues.clear();
+	engine.run();
+	EXPECT_EQ(engine.getLoopEntries(), 1u);
+	EXPECT_EQ(printedValues, native);
+}
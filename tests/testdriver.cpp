@@ -7,6 +7,9 @@
 #include "gtest/gtest.h"
 #include "../tests/compiler.h"
 #include "../tests/codegen.h"
+#include "../tests/optimizer.h"
+#include "../tests/runtime.h"
+#include "../tests/jit.h"
 
 int main(int argc, char* argv[]) 
 {    
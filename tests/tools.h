@@ -1,5 +1,6 @@
 #pragma once
 #include "../src/compiler.h"
+#include "../src/cfg_flatten.h"
 
 void checkASTs(const StatementList& ast1, const StatementList& ast2)
 {
@@ -35,3 +36,34 @@ void testProgram(std::string text, StatementList result)
 	checkASTs(result, statements);
 }
 
+
+StatementPtr makeExpression(std::initializer_list<std::string> elements)
+{
+	Expression::ElementsType children;
+	for (const auto& element : elements) {
+		children.push_back(makeNode(BasicExpression(0, element)));
+	}
+	return makeNode(Expression(0, children));
+}
+
+template<typename Pass>
+void testPass(std::string text, StatementList result)
+{
+	CFGFlattener visitor;
+	auto parser = initialize_parser();
+	auto stmts = parse(parser.get(), &text[0], &text[0] + text.size(), visitor);
+	traverse(stmts, visitor);
+	Pass pass(visitor.getStatements());
+	auto statements = pass.run();
+	EXPECT_EQ(statements.size(), result.size());
+
+	checkASTs(result, statements);
+}
+
+std::vector<std::byte> toBytes(std::initializer_list<int> values)
+{
+	std::vector<std::byte> bytes;
+	for (auto value : values)
+		bytes.push_back(std::byte(value));
+	return bytes;
+}